@@ -10,6 +10,7 @@
 #include <phosg/Network.hh>
 #include <phosg/Time.hh>
 
+#include "CommandTrace.hh"
 #include "Loggers.hh"
 #include "Version.hh"
 
@@ -81,6 +82,7 @@ void Channel::replace_with(
   this->name = name;
   this->terminal_send_color = other.terminal_send_color;
   this->terminal_recv_color = other.terminal_recv_color;
+  this->traffic_counters = other.traffic_counters;
   this->on_command_received = on_command_received;
   this->on_error = on_error;
   this->context_obj = context_obj;
@@ -102,7 +104,8 @@ void Channel::set_bufferevent(struct bufferevent* bev) {
     }
 
     bufferevent_setcb(this->bev.get(),
-        &Channel::dispatch_on_input, nullptr,
+        &Channel::dispatch_on_input,
+        this->on_output_drained ? &Channel::dispatch_on_output : nullptr,
         &Channel::dispatch_on_error, this);
     bufferevent_enable(this->bev.get(), EV_READ | EV_WRITE);
 
@@ -114,7 +117,9 @@ void Channel::set_bufferevent(struct bufferevent* bev) {
 }
 
 void Channel::disconnect() {
+  this->on_output_drained = nullptr;
   if (this->bev.get()) {
+    bufferevent_setwatermark(this->bev.get(), EV_WRITE, 0, 0);
     // If the output buffer is not empty, move the bufferevent into the draining
     // pool instead of disconnecting it, to make sure all the data gets sent.
     struct evbuffer* out_buffer = bufferevent_get_output(this->bev.get());
@@ -168,6 +173,9 @@ Channel::Message Channel::recv() {
   }
 
   size_t command_logical_size = header.size(version);
+  if (command_logical_size < header_size) {
+    throw runtime_error("command size field is smaller than the header");
+  }
 
   // If encryption is enabled, BB pads commands to 8-byte boundaries, and this
   // is not reflected in the size field. This logic does not occur if encryption
@@ -179,37 +187,52 @@ Channel::Message Channel::recv() {
     throw out_of_range("no command available");
   }
 
-  // If we get here, then there is a full command in the buffer. Some encryption
-  // algorithms' advancement depends on the decrypted data, so we have to
-  // actually decrypt the header again (with advance=true) to keep them in a
-  // consistent state.
-
-  string header_data(header_size, '\0');
-  if (evbuffer_remove(buf, header_data.data(), header_data.size()) < static_cast<ssize_t>(header_data.size())) {
-    throw logic_error("enough bytes available, but could not remove them");
+  // If we get here, then there is a full command in the buffer. Make it
+  // contiguous so we can read it in place; this is usually free since most
+  // commands arrive in a single read. The only copy of the command's data is
+  // the one we hand to the handler, which owns it (and often modifies it in
+  // place before forwarding it).
+  const uint8_t* command_bytes = evbuffer_pullup(buf, command_physical_size);
+  if (!command_bytes) {
+    throw logic_error("enough bytes available, but could not make them contiguous");
   }
+
+  // Some encryption algorithms' advancement depends on the decrypted data, so
+  // we have to actually decrypt the header again (with advance=true) to keep
+  // them in a consistent state.
+  memcpy(&header, command_bytes, header_size);
   if (this->crypt_in.get()) {
-    this->crypt_in->decrypt(header_data.data(), header_data.size());
+    this->crypt_in->decrypt(&header, header_size);
   }
 
-  string command_data(command_physical_size - header_size, '\0');
-  if (evbuffer_remove(buf, command_data.data(), command_data.size()) < static_cast<ssize_t>(command_data.size())) {
-    throw logic_error("enough bytes available, but could not remove them");
-  }
+  // Some versions of PSO DC can send commands whose sizes are not a multiple
+  // of 4, but the server is expected to always use a multiple of 4 bytes when
+  // decrypting (the extra cipher bytes are lost). To emulate this behavior, we
+  // have to round up the size for DC commands here. We reserve the rounded-up
+  // size in advance so the temporary resize below doesn't reallocate.
+  size_t data_physical_size = command_physical_size - header_size;
+  string command_data;
+  command_data.reserve((data_physical_size + 3) & (~3));
+  command_data.assign(reinterpret_cast<const char*>(command_bytes + header_size), data_physical_size);
+  evbuffer_drain(buf, command_physical_size);
 
   if (this->crypt_in.get()) {
-    // Some versions of PSO DC can send commands whose sizes are not a multiple
-    // of 4, but the server is expected to always use a multiple of 4 bytes when
-    // decrypting (the extra cipher bytes are lost). To emulate this behavior,
-    // we have to round up the size for DC commands here.
-    size_t orig_size = command_data.size();
-    command_data.resize((orig_size + 3) & (~3), 0);
+    command_data.resize((data_physical_size + 3) & (~3), 0);
     this->crypt_in->decrypt(command_data.data(), command_data.size());
-    command_data.resize(orig_size);
   }
   command_data.resize(command_logical_size - header_size);
 
-  if (command_data_log.should_log(LogLevel::INFO) && (this->terminal_recv_color != TerminalFormat::END)) {
+  if (this->traffic_counters) {
+    Metrics::add(this->traffic_counters->commands_received);
+    Metrics::add(this->traffic_counters->bytes_received, command_physical_size);
+  }
+
+  if (command_trace && (this->terminal_recv_color != TerminalFormat::END)) {
+    command_trace->add_command(
+        CommandTrace::RecordType::FROM_CLIENT, this->name, this->version,
+        &header, header_size, command_data.data(), command_data.size());
+
+  } else if (command_data_log.should_log(LogLevel::INFO) && (this->terminal_recv_color != TerminalFormat::END)) {
     if (use_terminal_colors && this->terminal_recv_color != TerminalFormat::NORMAL) {
       print_color_escape(stderr, this->terminal_recv_color, TerminalFormat::BOLD, TerminalFormat::END);
     }
@@ -230,7 +253,7 @@ Channel::Message Channel::recv() {
     }
 
     vector<struct iovec> iovs;
-    iovs.emplace_back(iovec{.iov_base = header_data.data(), .iov_len = header_data.size()});
+    iovs.emplace_back(iovec{.iov_base = &header, .iov_len = header_size});
     iovs.emplace_back(iovec{.iov_base = command_data.data(), .iov_len = command_data.size()});
     print_data(stderr, iovs, 0, nullptr, PrintDataFlags::PRINT_ASCII | PrintDataFlags::DISABLE_COLOR | PrintDataFlags::OFFSET_16_BITS);
 
@@ -250,18 +273,35 @@ void Channel::send(uint16_t cmd, uint32_t flag, bool silent) {
   this->send(cmd, flag, nullptr, 0, silent);
 }
 
-void Channel::send(uint16_t cmd, uint32_t flag, const std::vector<std::pair<const void*, size_t>> blocks, bool silent) {
+void Channel::send(uint16_t cmd, uint32_t flag, const std::vector<std::pair<const void*, size_t>>& blocks, bool silent) {
+  this->send_blocks(cmd, flag, blocks.data(), blocks.size(), silent);
+}
+
+void Channel::send_blocks(uint16_t cmd, uint32_t flag, const std::pair<const void*, size_t>* blocks, size_t num_blocks, bool silent) {
+  size_t size = 0;
+  for (size_t z = 0; z < num_blocks; z++) {
+    size += blocks[z].second;
+  }
+  this->send_generated(cmd, flag, size, [&](void* dest) -> void {
+    uint8_t* dest_bytes = reinterpret_cast<uint8_t*>(dest);
+    for (size_t z = 0; z < num_blocks; z++) {
+      if (blocks[z].second) {
+        memcpy(dest_bytes, blocks[z].first, blocks[z].second);
+        dest_bytes += blocks[z].second;
+      }
+    }
+  },
+      silent);
+}
+
+void Channel::send_generated(uint16_t cmd, uint32_t flag, size_t size, const function<void(void*)>& write_data, bool silent) {
   if (!this->connected()) {
     channel_exceptions_log.warning("Attempted to send command on closed channel; dropping data");
     return;
   }
 
-  size_t size = 0;
-  for (const auto& b : blocks) {
-    size += b.second;
-  }
-
-  string send_data;
+  PSOCommandHeader header;
+  size_t header_size;
   size_t logical_size;
   size_t send_data_size = 0;
   switch (this->version) {
@@ -274,37 +314,35 @@ void Channel::send(uint16_t cmd, uint32_t flag, const std::vector<std::pair<cons
     case Version::GC_EP3_NTE:
     case Version::GC_EP3:
     case Version::XB_V3: {
-      PSOCommandHeaderDCV3 header;
+      header_size = sizeof(header.dc);
       if (this->crypt_out.get() &&
           (this->version != Version::DC_NTE) &&
           (this->version != Version::DC_V1_11_2000_PROTOTYPE) &&
           (this->version != Version::DC_V1)) {
-        send_data_size = (sizeof(header) + size + 3) & ~3;
+        send_data_size = (header_size + size + 3) & ~3;
       } else {
-        send_data_size = (sizeof(header) + size);
+        send_data_size = (header_size + size);
       }
       logical_size = send_data_size;
-      header.command = cmd;
-      header.flag = flag;
-      header.size = send_data_size;
-      send_data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+      header.dc.command = cmd;
+      header.dc.flag = flag;
+      header.dc.size = send_data_size;
       break;
     }
     case Version::PC_PATCH:
     case Version::BB_PATCH:
     case Version::PC_NTE:
     case Version::PC_V2: {
-      PSOCommandHeaderPC header;
+      header_size = sizeof(header.pc);
       if (this->crypt_out.get()) {
-        send_data_size = (sizeof(header) + size + 3) & ~3;
+        send_data_size = (header_size + size + 3) & ~3;
       } else {
-        send_data_size = (sizeof(header) + size);
+        send_data_size = (header_size + size);
       }
       logical_size = send_data_size;
-      header.size = send_data_size;
-      header.command = cmd;
-      header.flag = flag;
-      send_data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+      header.pc.size = send_data_size;
+      header.pc.command = cmd;
+      header.pc.flag = flag;
       break;
     }
     case Version::BB_V4: {
@@ -315,17 +353,16 @@ void Channel::send(uint16_t cmd, uint32_t flag, const std::vector<std::pair<cons
       // before encryption is enabled have no size restrictions (except they
       // must include a full header and must fit in the client's receive
       // buffer), and no implicit extra bytes are sent.
-      PSOCommandHeaderBB header;
+      header_size = sizeof(header.bb);
       if (this->crypt_out.get()) {
-        send_data_size = (sizeof(header) + size + 7) & ~7;
+        send_data_size = (header_size + size + 7) & ~7;
       } else {
-        send_data_size = (sizeof(header) + size);
+        send_data_size = (header_size + size);
       }
-      logical_size = (sizeof(header) + size + 3) & ~3;
-      header.size = logical_size;
-      header.command = cmd;
-      header.flag = flag;
-      send_data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+      logical_size = (header_size + size + 3) & ~3;
+      header.bb.size = logical_size;
+      header.bb.command = cmd;
+      header.bb.flag = flag;
       break;
     }
 
@@ -339,13 +376,25 @@ void Channel::send(uint16_t cmd, uint32_t flag, const std::vector<std::pair<cons
     throw runtime_error("outbound command too large");
   }
 
-  send_data.reserve(send_data_size);
-  for (const auto& b : blocks) {
-    send_data.append(reinterpret_cast<const char*>(b.first), b.second);
+  // Build the command directly in the output buffer's free space, then encrypt
+  // it there. If anything fails before the space is committed, the reserved
+  // space is simply not used, so nothing partial is ever sent.
+  struct evbuffer* buf = bufferevent_get_output(this->bev.get());
+  struct evbuffer_iovec iov;
+  if (evbuffer_reserve_space(buf, send_data_size, &iov, 1) != 1 || iov.iov_len < send_data_size) {
+    throw runtime_error("cannot reserve space in output buffer");
   }
-  send_data.resize(send_data_size, '\0');
+  uint8_t* send_data = reinterpret_cast<uint8_t*>(iov.iov_base);
+  memcpy(send_data, &header, header_size);
+  write_data(send_data + header_size);
+  memset(send_data + header_size + size, 0, send_data_size - header_size - size);
 
-  if (!silent && (command_data_log.should_log(LogLevel::INFO)) && (this->terminal_send_color != TerminalFormat::END)) {
+  if (!silent && command_trace && (this->terminal_send_color != TerminalFormat::END)) {
+    command_trace->add_command(
+        CommandTrace::RecordType::TO_CLIENT, this->name, this->version,
+        send_data, logical_size, nullptr, 0);
+
+  } else if (!silent && (command_data_log.should_log(LogLevel::INFO)) && (this->terminal_send_color != TerminalFormat::END)) {
     if (use_terminal_colors && this->terminal_send_color != TerminalFormat::NORMAL) {
       print_color_escape(stderr, TerminalFormat::FG_YELLOW, TerminalFormat::BOLD, TerminalFormat::END);
     }
@@ -356,22 +405,30 @@ void Channel::send(uint16_t cmd, uint32_t flag, const std::vector<std::pair<cons
       command_data_log.info("Sending to %s (version=%s command=%02hX flag=%02" PRIX32 ")",
           this->name.c_str(), name_for_enum(version), cmd, flag);
     }
-    print_data(stderr, send_data.data(), logical_size, 0, nullptr, PrintDataFlags::PRINT_ASCII | PrintDataFlags::DISABLE_COLOR | PrintDataFlags::OFFSET_16_BITS);
+    print_data(stderr, send_data, logical_size, 0, nullptr, PrintDataFlags::PRINT_ASCII | PrintDataFlags::DISABLE_COLOR | PrintDataFlags::OFFSET_16_BITS);
     if (use_terminal_colors && this->terminal_send_color != TerminalFormat::NORMAL) {
       print_color_escape(stderr, TerminalFormat::NORMAL, TerminalFormat::END);
     }
   }
 
   if (this->crypt_out.get()) {
-    this->crypt_out->encrypt(send_data.data(), send_data.size());
+    this->crypt_out->encrypt(send_data, send_data_size);
   }
 
-  struct evbuffer* buf = bufferevent_get_output(this->bev.get());
-  evbuffer_add(buf, send_data.data(), send_data.size());
+  iov.iov_len = send_data_size;
+  if (evbuffer_commit_space(buf, &iov, 1) != 0) {
+    throw runtime_error("cannot commit space in output buffer");
+  }
+
+  if (this->traffic_counters) {
+    Metrics::add(this->traffic_counters->commands_sent);
+    Metrics::add(this->traffic_counters->bytes_sent, send_data_size);
+  }
 }
 
 void Channel::send(uint16_t cmd, uint32_t flag, const void* data, size_t size, bool silent) {
-  this->send(cmd, flag, {make_pair(data, size)}, silent);
+  pair<const void*, size_t> block(data, size);
+  this->send_blocks(cmd, flag, &block, 1, silent);
 }
 
 void Channel::send(uint16_t cmd, uint32_t flag, const string& data, bool silent) {
@@ -414,6 +471,27 @@ void Channel::dispatch_on_input(struct bufferevent*, void* ctx) {
   }
 }
 
+void Channel::set_output_drained_callback(size_t low_watermark, function<void()> fn) {
+  this->on_output_drained = std::move(fn);
+  if (this->bev.get()) {
+    bufferevent_setwatermark(this->bev.get(), EV_WRITE, this->on_output_drained ? low_watermark : 0, 0);
+    bufferevent_setcb(this->bev.get(),
+        &Channel::dispatch_on_input,
+        this->on_output_drained ? &Channel::dispatch_on_output : nullptr,
+        &Channel::dispatch_on_error, this);
+  }
+}
+
+void Channel::dispatch_on_output(struct bufferevent*, void* ctx) {
+  Channel* ch = reinterpret_cast<Channel*>(ctx);
+  // The callback may replace or remove itself (or disconnect the channel), so
+  // we call a copy of it
+  auto fn = ch->on_output_drained;
+  if (fn) {
+    fn();
+  }
+}
+
 void Channel::dispatch_on_error(struct bufferevent*, short events, void* ctx) {
   Channel* ch = reinterpret_cast<Channel*>(ctx);
   if (ch->on_error) {
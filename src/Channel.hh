@@ -2,9 +2,11 @@
 
 #include <netinet/in.h>
 
+#include <functional>
 #include <memory>
 #include <string>
 
+#include "Metrics.hh"
 #include "PSOEncryption.hh"
 #include "PSOProtocol.hh"
 #include "Version.hh"
@@ -24,6 +26,9 @@ struct Channel {
   TerminalFormat terminal_send_color;
   TerminalFormat terminal_recv_color;
 
+  // If not null, all commands sent and received are counted here
+  TrafficCounters* traffic_counters = nullptr;
+
   struct Message {
     uint16_t command;
     uint32_t flag;
@@ -83,7 +88,7 @@ struct Channel {
   // Sends a message with an automatically-constructed header.
   void send(uint16_t cmd, uint32_t flag = 0, bool silent = false);
   void send(uint16_t cmd, uint32_t flag, const void* data, size_t size, bool silent = false);
-  void send(uint16_t cmd, uint32_t flag, const std::vector<std::pair<const void*, size_t>> blocks, bool silent = false);
+  void send(uint16_t cmd, uint32_t flag, const std::vector<std::pair<const void*, size_t>>& blocks, bool silent = false);
   void send(uint16_t cmd, uint32_t flag, const std::string& data, bool silent = false);
   template <typename CmdT>
     requires(!std::is_pointer_v<CmdT>)
@@ -96,7 +101,26 @@ struct Channel {
   void send(const void* data, size_t size, bool silent = false);
   void send(const std::string& data, bool silent = false);
 
+  // Sends a message made of several non-contiguous blocks. The command is
+  // assembled and encrypted directly in the output buffer; no intermediate
+  // copies are made.
+  void send_blocks(uint16_t cmd, uint32_t flag, const std::pair<const void*, size_t>* blocks, size_t num_blocks, bool silent = false);
+  // Sends a message whose data (size bytes, not including the header) is
+  // written directly into the output buffer by write_data, for example by
+  // reading it from a file. If write_data throws, nothing is sent.
+  void send_generated(uint16_t cmd, uint32_t flag, size_t size, const std::function<void(void*)>& write_data, bool silent = false);
+
+  // Sets a function to be called when the amount of unsent data in the output
+  // buffer falls to low_watermark bytes or less. This is used to stream large
+  // transfers without buffering all of their data at once. Passing an empty
+  // function removes the callback. The callback is also removed when the
+  // channel is disconnected.
+  void set_output_drained_callback(size_t low_watermark, std::function<void()> fn);
+
 private:
+  std::function<void()> on_output_drained;
+
   static void dispatch_on_input(struct bufferevent*, void* ctx);
+  static void dispatch_on_output(struct bufferevent*, void* ctx);
   static void dispatch_on_error(struct bufferevent*, short events, void* ctx);
 };
@@ -834,6 +834,7 @@ void Client::load_all_files() {
 }
 
 void Client::save_all() {
+  uint64_t start_time = now();
   if (this->system_data) {
     this->save_system_file();
   }
@@ -854,6 +855,8 @@ void Client::save_all() {
         this->system_data,
         this->external_bank_character);
   }
+  Metrics::add(metrics.bb_saves);
+  Metrics::add(metrics.bb_save_usecs, now() - start_time);
 }
 
 void Client::save_system_file() const {
@@ -187,6 +187,12 @@ public:
 
   // Patch server
   std::vector<PatchFileChecksumRequest> patch_file_checksum_requests;
+  // Files not yet completely sent, and the state of the current (front) file.
+  // See send_queued_patch_files.
+  std::deque<std::shared_ptr<PatchFileIndex::File>> patch_files_to_send;
+  std::shared_ptr<const PatchFileIndex::FileReader> patch_file_data;
+  size_t patch_file_next_chunk = 0;
+  std::vector<std::string> patch_client_path_directories;
 
   // Lobby/positioning
   Config config;
@@ -253,6 +259,8 @@ public:
   // File loading state
   uint32_t dol_base_addr;
   std::shared_ptr<DOLFileIndex::File> loading_dol_file;
+  // Values are the 13/A7 command bodies for all chunks of each file (these may
+  // be shared with other clients receiving the same file)
   std::unordered_map<std::string, std::shared_ptr<const std::string>> sending_files;
 
   Client(
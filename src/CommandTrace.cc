@@ -0,0 +1,280 @@
+#include "CommandTrace.hh"
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+
+#include "Loggers.hh"
+#include "PSOProtocol.hh"
+
+using namespace std;
+
+shared_ptr<CommandTrace> command_trace;
+
+CommandTrace::CommandTrace(const Options& options)
+    : options(options),
+      read_offset(0),
+      write_offset(0),
+      pending_dropped_records(0),
+      num_records_written(0),
+      num_records_dropped(0),
+      should_exit(false),
+      f(nullptr),
+      file_size(0) {
+  if (this->options.max_files < 1) {
+    this->options.max_files = 1;
+  }
+  size_t buffer_size = 0x1000;
+  while (buffer_size < this->options.buffer_size) {
+    buffer_size <<= 1;
+  }
+  this->buffer.resize(buffer_size, '\0');
+  this->buffer_mask = buffer_size - 1;
+
+  this->open_file();
+  this->writer_thread = thread(&CommandTrace::writer_thread_fn, this);
+}
+
+CommandTrace::~CommandTrace() {
+  this->should_exit = true;
+  this->writer_thread.join();
+  if (this->f) {
+    fclose(this->f);
+  }
+}
+
+void CommandTrace::add_connect(const string& name, Version version, const string& listen_spec) {
+  this->add_record(RecordType::CONNECT, name, version, listen_spec.data(), listen_spec.size(), nullptr, 0);
+}
+
+void CommandTrace::add_disconnect(const string& name, Version version) {
+  this->add_record(RecordType::DISCONNECT, name, version, nullptr, 0, nullptr, 0);
+}
+
+void CommandTrace::add_command(
+    RecordType type,
+    const string& name,
+    Version version,
+    const void* header,
+    size_t header_size,
+    const void* data,
+    size_t data_size) {
+  this->add_record(type, name, version, header, header_size, data, data_size);
+}
+
+void CommandTrace::copy_into_buffer(size_t& offset, const void* data, size_t size) {
+  size_t start = offset & this->buffer_mask;
+  size_t first_size = min<size_t>(size, this->buffer.size() - start);
+  memcpy(this->buffer.data() + start, data, first_size);
+  if (first_size < size) {
+    memcpy(this->buffer.data(), reinterpret_cast<const uint8_t*>(data) + first_size, size - first_size);
+  }
+  offset += size;
+}
+
+bool CommandTrace::add_record(
+    RecordType type,
+    const string& name,
+    Version version,
+    const void* data1,
+    size_t size1,
+    const void* data2,
+    size_t size2) {
+  size_t name_size = min<size_t>(name.size(), 0xFF);
+  size_t record_size = sizeof(Record) + name_size + size1 + size2;
+  size_t drop_record_size = this->pending_dropped_records ? (sizeof(Record) + sizeof(le_uint64_t)) : 0;
+
+  size_t w = this->write_offset.load(memory_order_relaxed);
+  size_t r = this->read_offset.load(memory_order_acquire);
+  if (record_size + drop_record_size > this->buffer.size() - (w - r)) {
+    this->pending_dropped_records++;
+    this->num_records_dropped++;
+    return false;
+  }
+
+  uint64_t t = now();
+  if (this->pending_dropped_records) {
+    Record drop_rec;
+    drop_rec.size = drop_record_size;
+    drop_rec.type = RecordType::DROPPED;
+    drop_rec.version = 0;
+    drop_rec.name_size = 0;
+    drop_rec.unused = 0;
+    drop_rec.timestamp = t;
+    le_uint64_t count = this->pending_dropped_records;
+    this->copy_into_buffer(w, &drop_rec, sizeof(drop_rec));
+    this->copy_into_buffer(w, &count, sizeof(count));
+    this->pending_dropped_records = 0;
+  }
+
+  Record rec;
+  rec.size = record_size;
+  rec.type = type;
+  rec.version = static_cast<uint8_t>(version);
+  rec.name_size = name_size;
+  rec.unused = 0;
+  rec.timestamp = t;
+  this->copy_into_buffer(w, &rec, sizeof(rec));
+  this->copy_into_buffer(w, name.data(), name_size);
+  if (size1) {
+    this->copy_into_buffer(w, data1, size1);
+  }
+  if (size2) {
+    this->copy_into_buffer(w, data2, size2);
+  }
+  this->write_offset.store(w, memory_order_release);
+  return true;
+}
+
+void CommandTrace::writer_thread_fn() {
+  string chunk;
+  for (;;) {
+    size_t r = this->read_offset.load(memory_order_relaxed);
+    size_t w = this->write_offset.load(memory_order_acquire);
+    if (r == w) {
+      // Only exit when the buffer is empty, so all records added before the
+      // destructor was called are written
+      if (this->should_exit.load()) {
+        break;
+      }
+      if (this->f) {
+        fflush(this->f);
+      }
+      usleep(10000);
+      continue;
+    }
+
+    size_t size = w - r;
+    size_t start = r & this->buffer_mask;
+    size_t first_size = min<size_t>(size, this->buffer.size() - start);
+    chunk.resize(size);
+    memcpy(chunk.data(), this->buffer.data() + start, first_size);
+    memcpy(chunk.data() + first_size, this->buffer.data(), size - first_size);
+    this->read_offset.store(w, memory_order_release);
+
+    // The adding thread only publishes complete records, so the chunk always
+    // ends on a record boundary
+    size_t offset = 0;
+    while (offset + sizeof(Record) <= chunk.size()) {
+      const auto& rec = *reinterpret_cast<const Record*>(chunk.data() + offset);
+      string name(chunk.data() + offset + sizeof(Record), rec.name_size);
+      size_t data_offset = offset + sizeof(Record) + rec.name_size;
+      try {
+        this->write_record(rec, name, chunk.data() + data_offset, rec.size - sizeof(Record) - rec.name_size);
+      } catch (const exception& e) {
+        // An exception here would terminate the entire server, so instead we
+        // stop tracing (e.g. if the disk is full). All later records are
+        // counted as dropped in write_record.
+        server_log.error("Cannot write command trace; no more records will be written: %s", e.what());
+        if (this->f) {
+          fclose(this->f);
+          this->f = nullptr;
+        }
+        this->num_records_dropped++;
+      }
+      offset += rec.size;
+    }
+  }
+  if (this->f) {
+    fflush(this->f);
+  }
+}
+
+void CommandTrace::write_record(const Record& rec, const string& name, const void* data, size_t size) {
+  if (this->f && (this->file_size > sizeof(FileHeader)) && (this->file_size + rec.size > this->options.max_file_size)) {
+    this->rotate_file();
+  }
+  if (!this->f) {
+    this->num_records_dropped++;
+    return;
+  }
+
+  if (this->options.format == Format::BINARY) {
+    fwritex(this->f, &rec, sizeof(rec));
+    fwritex(this->f, name.data(), name.size());
+    fwritex(this->f, data, size);
+    this->file_size += rec.size;
+
+  } else {
+    time_t t_secs = rec.timestamp / 1000000;
+    struct tm t_parts;
+    localtime_r(&t_secs, &t_parts);
+    char time_str[0x40];
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &t_parts);
+
+    Version version = static_cast<Version>(rec.version);
+    switch (rec.type) {
+      case RecordType::CONNECT:
+        fprintf(this->f, "I %d %s - [Server] Client connected: %s on traced connection (version=%s) via %s\n",
+            getpid(), time_str, name.c_str(), name_for_enum(version),
+            string(reinterpret_cast<const char*>(data), size).c_str());
+        break;
+      case RecordType::DISCONNECT:
+        fprintf(this->f, "I %d %s - [Server] Client disconnected: %s (traced)\n",
+            getpid(), time_str, name.c_str());
+        break;
+      case RecordType::FROM_CLIENT:
+      case RecordType::TO_CLIENT: {
+        const char* direction = (rec.type == RecordType::FROM_CLIENT) ? "Received from" : "Sending to";
+        PSOCommandHeader header;
+        memcpy(&header, data, min<size_t>(size, PSOCommandHeader::header_size(version)));
+        if (version == Version::BB_V4) {
+          fprintf(this->f, "I %d %s - [Commands] %s %s (version=BB command=%04hX flag=%08" PRIX32 ")\n",
+              getpid(), time_str, direction, name.c_str(), header.command(version), header.flag(version));
+        } else {
+          fprintf(this->f, "I %d %s - [Commands] %s %s (version=%s command=%02hX flag=%02" PRIX32 ")\n",
+              getpid(), time_str, direction, name.c_str(), name_for_enum(version), header.command(version), header.flag(version));
+        }
+        print_data(this->f, data, size, 0, nullptr, PrintDataFlags::PRINT_ASCII | PrintDataFlags::DISABLE_COLOR | PrintDataFlags::OFFSET_16_BITS);
+        break;
+      }
+      case RecordType::DROPPED: {
+        uint64_t count = (size >= sizeof(le_uint64_t)) ? reinterpret_cast<const le_uint64_t*>(data)->load() : 0;
+        fprintf(this->f, "W %d %s - [CommandTrace] %" PRIu64 " records dropped\n", getpid(), time_str, count);
+        break;
+      }
+    }
+    this->file_size = ftell(this->f);
+  }
+
+  this->num_records_written++;
+}
+
+void CommandTrace::open_file() {
+  this->f = fopen(this->options.filename.c_str(), "wb");
+  if (!this->f) {
+    throw runtime_error(string_printf("cannot open command trace file %s", this->options.filename.c_str()));
+  }
+  this->file_size = 0;
+  if (this->options.format == Format::BINARY) {
+    FileHeader header;
+    memcpy(header.magic, MAGIC, sizeof(header.magic));
+    header.format_version = FORMAT_VERSION;
+    header.unused = 0;
+    fwritex(this->f, &header, sizeof(header));
+    this->file_size = sizeof(header);
+  }
+}
+
+void CommandTrace::rotate_file() {
+  fclose(this->f);
+  this->f = nullptr;
+
+  for (size_t z = this->options.max_files - 1; z > 0; z--) {
+    string src_filename = (z == 1)
+        ? this->options.filename
+        : string_printf("%s.%zu", this->options.filename.c_str(), z - 1);
+    string dst_filename = string_printf("%s.%zu", this->options.filename.c_str(), z);
+    rename(src_filename.c_str(), dst_filename.c_str());
+  }
+
+  try {
+    this->open_file();
+  } catch (const exception& e) {
+    server_log.error("Cannot rotate command trace: %s", e.what());
+  }
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <memory>
+#include <phosg/Encoding.hh>
+#include <string>
+#include <thread>
+
+#include "Version.hh"
+
+// CommandTrace is an asynchronous replacement for writing the command log to
+// stderr. Channels serialize each command into a ring buffer (which never
+// blocks; if the buffer is full, the record is dropped and counted), and a
+// background thread writes the records to a file, rotating it when it gets too
+// large. All records must be added from the same thread (the main event loop
+// thread, which runs all Channels). If writing to the file fails, tracing
+// stops, and all later records are counted as dropped.
+//
+// The binary trace format is a FileHeader followed by any number of records.
+// Each record is a Record structure, followed by name_size bytes of channel
+// name (e.g. "C-2"), followed by the record's data, which extends to the end
+// of the record (as given by Record::size). The data is:
+// - CONNECT: the listening socket's name (e.g. T-9000-GC-gc-jp10-login_server)
+// - DISCONNECT: empty
+// - FROM_CLIENT and TO_CLIENT: the entire command, including its header
+// - DROPPED: a le_uint64_t count of the records that were dropped immediately
+//   before this record
+// ReplaySession can replay traces in this format as well as text logs. The
+// text trace format is the same as the normal log output.
+class CommandTrace {
+public:
+  static constexpr char MAGIC[8] = {'\x89', 'N', 'S', 'T', 'R', 'A', 'C', 'E'};
+  static constexpr uint32_t FORMAT_VERSION = 1;
+
+  enum class Format {
+    BINARY = 0,
+    TEXT,
+  };
+
+  enum class RecordType : uint8_t {
+    CONNECT = 0,
+    DISCONNECT = 1,
+    FROM_CLIENT = 2,
+    TO_CLIENT = 3,
+    DROPPED = 4,
+  };
+
+  struct FileHeader {
+    char magic[8];
+    le_uint32_t format_version;
+    le_uint32_t unused;
+  } __attribute__((packed));
+
+  struct Record {
+    le_uint32_t size; // Includes this structure, the name, and the data
+    RecordType type;
+    uint8_t version; // Version enum value
+    uint8_t name_size;
+    uint8_t unused;
+    le_uint64_t timestamp; // Microseconds since the epoch
+  } __attribute__((packed));
+
+  struct Options {
+    std::string filename;
+    Format format = Format::BINARY;
+    size_t buffer_size = 0x400000; // Rounded up to a power of 2
+    size_t max_file_size = 0x10000000;
+    size_t max_files = 4; // Including the current file
+  };
+
+  explicit CommandTrace(const Options& options);
+  CommandTrace(const CommandTrace&) = delete;
+  CommandTrace(CommandTrace&&) = delete;
+  CommandTrace& operator=(const CommandTrace&) = delete;
+  CommandTrace& operator=(CommandTrace&&) = delete;
+  // Writes all pending records, then stops the writer thread
+  ~CommandTrace();
+
+  void add_connect(const std::string& name, Version version, const std::string& listen_spec);
+  void add_disconnect(const std::string& name, Version version);
+  void add_command(
+      RecordType type,
+      const std::string& name,
+      Version version,
+      const void* header,
+      size_t header_size,
+      const void* data,
+      size_t data_size);
+
+  inline uint64_t records_written() const {
+    return this->num_records_written.load();
+  }
+  inline uint64_t records_dropped() const {
+    return this->num_records_dropped.load();
+  }
+
+private:
+  Options options;
+
+  // The ring buffer. read_offset and write_offset increase monotonically; the
+  // actual buffer offsets are these values masked by (buffer_size - 1).
+  std::string buffer;
+  size_t buffer_mask;
+  std::atomic<size_t> read_offset;
+  std::atomic<size_t> write_offset;
+  uint64_t pending_dropped_records; // Only used by the adding thread
+
+  std::atomic<uint64_t> num_records_written;
+  std::atomic<uint64_t> num_records_dropped;
+
+  std::atomic<bool> should_exit;
+  std::thread writer_thread;
+  FILE* f;
+  size_t file_size;
+
+  bool add_record(
+      RecordType type,
+      const std::string& name,
+      Version version,
+      const void* data1,
+      size_t size1,
+      const void* data2,
+      size_t size2);
+  void copy_into_buffer(size_t& offset, const void* data, size_t size);
+
+  void writer_thread_fn();
+  void write_record(const Record& rec, const std::string& name, const void* data, size_t size);
+  void open_file();
+  void rotate_file();
+};
+
+// Null unless CommandTrace is enabled in the configuration
+extern std::shared_ptr<CommandTrace> command_trace;
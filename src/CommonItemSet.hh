@@ -298,7 +298,8 @@ struct ProbabilityTable {
     return this->items[--this->count];
   }
 
-  void shuffle(PSOLFGEncryption& random_crypt) {
+  template <typename RandomT>
+  void shuffle(RandomT& random_crypt) {
     for (size_t z = 1; z < this->count; z++) {
       size_t other_z = random_crypt.next() % (z + 1);
       ItemT t = this->items[z];
@@ -307,7 +308,8 @@ struct ProbabilityTable {
     }
   }
 
-  ItemT sample(PSOLFGEncryption& random_crypt) const {
+  template <typename RandomT>
+  ItemT sample(RandomT& random_crypt) const {
     if (this->count == 0) {
       throw std::runtime_error("sample from empty probability table");
     } else if (this->count == 1) {
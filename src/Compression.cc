@@ -1,14 +1,26 @@
 #include "Compression.hh"
 
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <unistd.h>
 
+#include <phosg/Filesystem.hh>
+#include <phosg/Hash.hh>
 #include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <set>
+#include <thread>
 
+#include "Metrics.hh"
 #include "Text.hh"
 
 using namespace std;
@@ -192,6 +204,146 @@ private:
   uint16_t bits;
 };
 
+// Cache file name prefixes. The version number in each must be incremented
+// whenever the corresponding compressor's output changes, so that results from
+// the old version are not used. Cache files from other versions are deleted
+// when the cache is pruned. (Other files in the directory are left alone.)
+static const char* PRS_OPTIMAL_CACHE_PREFIX = "prs-optimal-v1";
+static const char* BC0_OPTIMAL_CACHE_PREFIX = "bc0-optimal-v1";
+
+struct CompressionCacheConfig {
+  string directory;
+  size_t max_size;
+};
+
+// The configuration may be replaced on the main thread (when the server's
+// config is reloaded) while other threads are compressing, so it's accessed
+// only while holding compression_cache_config_lock. Pruning can also happen on
+// any thread, so it's serialized by compression_cache_prune_lock.
+static mutex compression_cache_config_lock;
+static shared_ptr<const CompressionCacheConfig> compression_cache_config;
+static mutex compression_cache_prune_lock;
+static atomic<size_t> compression_cache_bytes = 0;
+
+static shared_ptr<const CompressionCacheConfig> get_compression_cache_config() {
+  lock_guard g(compression_cache_config_lock);
+  return compression_cache_config;
+}
+
+static void prune_compression_cache(const CompressionCacheConfig& config) {
+  lock_guard g(compression_cache_prune_lock);
+
+  struct CacheFile {
+    string path;
+    uint64_t mtime;
+    size_t size;
+  };
+  vector<CacheFile> files;
+  size_t total_size = 0;
+  uint64_t now_secs = now() / 1000000;
+  for (const auto& filename : list_directory(config.directory)) {
+    string path = config.directory + "/" + filename;
+    try {
+      auto st = stat(path);
+      if (!S_ISREG(st.st_mode)) {
+        continue;
+      }
+      if (!starts_with(filename, "prs-optimal-") && !starts_with(filename, "bc0-optimal-")) {
+        continue;
+      }
+      bool is_temp = ends_with(filename, ".tmp");
+      bool is_current = starts_with(filename, string(PRS_OPTIMAL_CACHE_PREFIX) + "-") ||
+          starts_with(filename, string(BC0_OPTIMAL_CACHE_PREFIX) + "-");
+      if (is_temp ? (static_cast<uint64_t>(st.st_mtime) + 3600 < now_secs) : !is_current) {
+        // Stale temporary file from a crashed process, or a result from an
+        // older compressor version
+        remove(path.c_str());
+      } else if (!is_temp) {
+        files.emplace_back(CacheFile{path, static_cast<uint64_t>(st.st_mtime), static_cast<size_t>(st.st_size)});
+        total_size += st.st_size;
+      }
+    } catch (const exception&) {
+    }
+  }
+
+  // Delete the least recently used files (compress_with_cache updates each
+  // file's modification time when it's used) until the cache is at most 3/4
+  // of the maximum size, so this doesn't need to be done again immediately
+  if (total_size > config.max_size) {
+    sort(files.begin(), files.end(), [](const CacheFile& a, const CacheFile& b) -> bool {
+      return a.mtime < b.mtime;
+    });
+    for (const auto& f : files) {
+      if (total_size <= (config.max_size / 4) * 3) {
+        break;
+      }
+      if (!remove(f.path.c_str())) {
+        total_size -= f.size;
+      }
+    }
+  }
+  compression_cache_bytes = total_size;
+}
+
+void set_compression_cache_directory(const string& directory, size_t max_size) {
+  shared_ptr<const CompressionCacheConfig> new_config;
+  if (!directory.empty()) {
+    if (!isdir(directory)) {
+      mkdir(directory.c_str(), 0755);
+    }
+    new_config = make_shared<CompressionCacheConfig>(CompressionCacheConfig{directory, max_size});
+    prune_compression_cache(*new_config);
+  }
+  lock_guard g(compression_cache_config_lock);
+  compression_cache_config = std::move(new_config);
+}
+
+// Returns the cached result of compressing the given data, or calls compress_fn
+// and caches its result if there isn't one. Cached results are checked by
+// decompressing them, so a corrupt cache file or a hash collision can't cause
+// incorrect output to be returned.
+static string compress_with_cache(
+    const char* prefix,
+    const void* data,
+    size_t size,
+    function<string(const string&)> decompress_fn,
+    function<string()> compress_fn) {
+  auto config = get_compression_cache_config();
+  if (!config) {
+    return compress_fn();
+  }
+
+  string filename = string_printf("%s/%s-%016" PRIX64 "-%08" PRIX32 "-%zX",
+      config->directory.c_str(), prefix, fnv1a64(data, size), crc32(data, size), size);
+  try {
+    string cached = load_file(filename);
+    string decompressed = decompress_fn(cached);
+    if ((decompressed.size() == size) && !memcmp(decompressed.data(), data, size)) {
+      // Mark the file as recently used, so pruning deletes it last
+      utimes(filename.c_str(), nullptr);
+      return cached;
+    }
+  } catch (const exception&) {
+  }
+
+  string ret = compress_fn();
+  // Multiple threads (or servers) may compress the same data at the same time,
+  // so write to a temporary file and rename it to make sure nobody reads a
+  // partially-written file. If this fails, just don't cache the result.
+  try {
+    string temp_filename = string_printf("%s.%d.%zX.tmp",
+        filename.c_str(), getpid(), hash<thread::id>()(this_thread::get_id()));
+    save_file(temp_filename, ret);
+    if (rename(temp_filename.c_str(), filename.c_str())) {
+      remove(temp_filename.c_str());
+    } else if (compression_cache_bytes.fetch_add(ret.size()) + ret.size() > config->max_size) {
+      prune_compression_cache(*config);
+    }
+  } catch (const exception&) {
+  }
+  return ret;
+}
+
 struct PRSPathNode {
   enum class CommandType {
     NONE = 0,
@@ -217,7 +369,7 @@ struct PRSPathNode {
   size_t to_offset = 0;
 };
 
-string prs_compress_optimal(const void* in_data_v, size_t in_size, ProgressCallback progress_fn) {
+static string prs_compress_optimal_uncached(const void* in_data_v, size_t in_size, ProgressCallback progress_fn) {
   const uint8_t* in_data = reinterpret_cast<const uint8_t*>(in_data_v);
 
   vector<PRSPathNode> nodes;
@@ -434,6 +586,13 @@ string prs_compress_optimal(const void* in_data_v, size_t in_size, ProgressCallb
   return std::move(w.close());
 }
 
+string prs_compress_optimal(const void* in_data_v, size_t in_size, ProgressCallback progress_fn) {
+  return compress_with_cache(
+      PRS_OPTIMAL_CACHE_PREFIX, in_data_v, in_size,
+      [](const string& data) -> string { return prs_decompress(data); },
+      [&]() -> string { return prs_compress_optimal_uncached(in_data_v, in_size, progress_fn); });
+}
+
 string prs_compress_optimal(const string& data, ProgressCallback progress_fn) {
   return prs_compress_optimal(data.data(), data.size(), progress_fn);
 }
@@ -441,6 +600,7 @@ string prs_compress_optimal(const string& data, ProgressCallback progress_fn) {
 PRSCompressor::PRSCompressor(
     ssize_t compression_level, ProgressCallback progress_fn)
     : compression_level(compression_level),
+      max_chain_depth(0x80 << min<ssize_t>(max<ssize_t>(compression_level, 0), 6)),
       progress_fn(progress_fn),
       closed(false),
       control_byte_offset(0),
@@ -464,6 +624,18 @@ void PRSCompressor::add(const string& data) {
   this->add(data.data(), data.size());
 }
 
+void PRSCompressor::add_dictionary(const void* data, size_t size) {
+  if (this->closed || (this->reverse_log.end_offset() != this->input_bytes)) {
+    throw logic_error("dictionary must be added before any data");
+  }
+
+  StringReader r(data, size);
+  while (!r.eof()) {
+    this->reverse_log.push_back(r.get_u8());
+    this->input_bytes++;
+  }
+}
+
 void PRSCompressor::add_byte(uint8_t v) {
   if (this->reverse_log.end_offset() + this->forward_log.data.size() <= this->input_bytes) {
     this->advance();
@@ -472,6 +644,36 @@ void PRSCompressor::add_byte(uint8_t v) {
   this->input_bytes++;
 }
 
+size_t PRSCompressor::match_size(size_t match_offset, size_t compression_offset, size_t max_size) const {
+  // If the match overlaps the data being compressed, the backreference repeats
+  // the data between match_offset and compression_offset
+  size_t match_loop_bytes = compression_offset - match_offset;
+  size_t size = 0;
+  while (size < max_size) {
+    // Compare 8 bytes at a time when they're contiguous in both logs and
+    // don't overlap the data being compressed; otherwise, compare one byte
+    size_t reverse_index = (match_offset + size) % this->reverse_log.data.size();
+    size_t forward_index = (compression_offset + size) % this->forward_log.data.size();
+    if ((size + 8 <= max_size) &&
+        (size + 8 <= match_loop_bytes) &&
+        (reverse_index + 8 <= this->reverse_log.data.size()) &&
+        (forward_index + 8 <= this->forward_log.data.size())) {
+      uint64_t reverse_word, forward_word;
+      memcpy(&reverse_word, this->reverse_log.data.data() + reverse_index, sizeof(reverse_word));
+      memcpy(&forward_word, this->forward_log.data.data() + forward_index, sizeof(forward_word));
+      if (reverse_word == forward_word) {
+        size += 8;
+        continue;
+      }
+    }
+    if (this->reverse_log.at(match_offset + (size % match_loop_bytes)) != this->forward_log.at(compression_offset + size)) {
+      break;
+    }
+    size++;
+  }
+  return size;
+}
+
 void PRSCompressor::advance() {
   // Search for a match in the decompressed data history
   size_t best_match_size = 0;
@@ -482,33 +684,67 @@ void PRSCompressor::advance() {
       this->reverse_log.push_back(this->forward_log.at(this->reverse_log.end_offset()));
     }
 
-    size_t compression_offset = reverse_log.end_offset();
-    uint8_t first_v = this->forward_log.at(compression_offset);
-    const auto& start_offsets = this->reverse_log.find(first_v);
+    size_t compression_offset = this->reverse_log.end_offset();
+    // Near the end of the input, num_literals may be large enough that
+    // compression_offset is beyond the end
+    size_t max_match_size = (compression_offset < this->input_bytes)
+        ? min<size_t>(this->input_bytes - compression_offset, 0x100)
+        : 0;
+
+    // Candidates are checked from latest to earliest. If there are multiple
+    // matches of the longest length, we use the latest one, since it's more
+    // likely that it can be expressed as a short copy instead of a long copy.
+    size_t literals_match_size = 0;
+    size_t literals_match_offset = 0;
+    auto check_candidate = [&](size_t match_offset) -> void {
+      // Backreferences can't reach the earliest byte in the log
+      if (compression_offset - match_offset >= 0x2000) {
+        return;
+      }
+      size_t match_size = this->match_size(match_offset, compression_offset, max_match_size);
+      if (match_size > literals_match_size) {
+        literals_match_size = match_size;
+        literals_match_offset = match_offset;
+      }
+    };
 
-    for (auto it = start_offsets.begin(); (it != start_offsets.end()) && (best_match_size < 0x100); it++) {
-      size_t match_offset = *it;
-      if (match_offset + 0x2000 <= compression_offset) {
-        continue;
+    if (max_match_size >= 2) {
+      // The last two positions aren't in the hash chains, so check them first
+      for (size_t distance = 1; (distance <= 2) && (distance <= this->reverse_log.size); distance++) {
+        check_candidate(compression_offset - distance);
       }
 
-      size_t match_size = 0;
-      size_t match_loop_bytes = compression_offset - match_offset;
-      while ((match_size < 0x100) &&
-          (compression_offset + match_size < this->input_bytes) &&
-          (this->reverse_log.at(match_offset + (match_size % match_loop_bytes)) == this->forward_log.at(compression_offset + match_size))) {
-        match_size++;
+      uint8_t v0 = this->forward_log.at(compression_offset);
+      uint8_t v1 = this->forward_log.at(compression_offset + 1);
+      if (max_match_size >= 3) {
+        uint8_t v2 = this->forward_log.at(compression_offset + 2);
+        size_t depth = 0;
+        for (size_t match_offset = this->reverse_log.find(v0, v1, v2);
+            (match_offset != this->reverse_log.NONE) && (depth < this->max_chain_depth) && (literals_match_size < max_match_size);
+            match_offset = this->reverse_log.find_next(match_offset), depth++) {
+          check_candidate(match_offset);
+        }
       }
 
-      // If there are multiple matches of the longest length, use the latest one,
-      // since it's more likely that it can be expressed as a short copy instead
-      // of a long copy.
-      if (match_size >= (best_match_size + best_match_literals)) {
-        best_match_offset = match_offset;
-        best_match_size = match_size;
-        best_match_literals = num_literals;
+      // Backreferences of size 2 can only be encoded as short copies, so we
+      // only need to search nearby for them, and only if nothing longer was
+      // found (they're rarely worth using anyway)
+      if (literals_match_size < 2) {
+        size_t depth = 0;
+        for (size_t match_offset = this->reverse_log.find_near(v0, v1);
+            (match_offset != this->reverse_log.NONE) && (depth < this->max_chain_depth) && (literals_match_size < 2);
+            match_offset = this->reverse_log.find_near_next(match_offset), depth++) {
+          check_candidate(match_offset);
+        }
       }
     }
+
+    if ((literals_match_size > 0) && (literals_match_size >= (best_match_size + best_match_literals))) {
+      best_match_offset = literals_match_offset;
+      best_match_size = literals_match_size;
+      best_match_literals = num_literals;
+    }
+
     for (size_t z = 0; z < static_cast<size_t>(num_literals); z++) {
       this->reverse_log.pop_back();
     }
@@ -647,9 +883,14 @@ string prs_compress(
     size_t size,
     ssize_t compression_level,
     ProgressCallback progress_fn) {
+  uint64_t start_time = now();
   PRSCompressor prs(compression_level, progress_fn);
   prs.add(vdata, size);
-  return std::move(prs.close());
+  string ret = std::move(prs.close());
+  Metrics::add(metrics.prs_compressions);
+  Metrics::add(metrics.prs_compress_input_bytes, size);
+  Metrics::add(metrics.prs_compress_usecs, now() - start_time);
+  return ret;
 }
 
 string prs_compress(
@@ -659,8 +900,113 @@ string prs_compress(
   return prs_compress(data.data(), data.size(), compression_level, progress_fn);
 }
 
+// Copies all commands except the stop command from a PRS stream to w
+static void append_prs_commands(LZSSInterleavedWriter& w, const string& data) {
+  StringReader r(data);
+  ControlStreamReader cr(r);
+  for (;;) {
+    if (cr.read()) {
+      w.write_control(true);
+      w.write_data(r.get_u8());
+
+    } else if (cr.read()) {
+      uint8_t a_low = r.get_u8();
+      uint8_t a_high = r.get_u8();
+      if ((a_low < 8) && (a_high == 0)) {
+        break; // Stop command
+      }
+      w.write_control(false);
+      w.flush_if_ready();
+      w.write_control(true);
+      w.write_data(a_low);
+      w.write_data(a_high);
+      if (!(a_low & 7)) {
+        w.write_data(r.get_u8());
+      }
+
+    } else {
+      bool size_high = cr.read();
+      bool size_low = cr.read();
+      w.write_control(false);
+      w.flush_if_ready();
+      w.write_control(false);
+      w.flush_if_ready();
+      w.write_control(size_high);
+      w.flush_if_ready();
+      w.write_control(size_low);
+      w.write_data(r.get_u8());
+    }
+    w.flush_if_ready();
+  }
+}
+
+string prs_compress_parallel(
+    const void* vdata,
+    size_t size,
+    ssize_t compression_level,
+    size_t num_threads,
+    ProgressCallback progress_fn) {
+  // Segments smaller than this don't gain enough from parallelism to be worth
+  // the loss in compression ratio at the boundaries
+  static constexpr size_t MIN_SEGMENT_SIZE = 0x40000;
+
+  if (num_threads == 0) {
+    num_threads = thread::hardware_concurrency();
+  }
+  size_t num_segments = min<size_t>(num_threads, size / MIN_SEGMENT_SIZE);
+  if (num_segments < 2) {
+    return prs_compress(vdata, size, compression_level, progress_fn);
+  }
+
+  uint64_t start_time = now();
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  size_t segment_size = (size + num_segments - 1) / num_segments;
+  vector<string> compressed_segments(num_segments);
+  parallel_range<size_t>([&](size_t segment_index, size_t) -> bool {
+    size_t segment_offset = segment_index * segment_size;
+    size_t dictionary_size = min<size_t>(segment_offset, 0x1FFF);
+    PRSCompressor prs(compression_level);
+    prs.add_dictionary(data + segment_offset - dictionary_size, dictionary_size);
+    prs.add(data + segment_offset, min<size_t>(segment_size, size - segment_offset));
+    compressed_segments[segment_index] = std::move(prs.close());
+    return false;
+  },
+      0, num_segments, num_threads);
+
+  LZSSInterleavedWriter w;
+  for (size_t z = 0; z < num_segments; z++) {
+    append_prs_commands(w, compressed_segments[z]);
+    compressed_segments[z].clear();
+    if (progress_fn) {
+      progress_fn(CompressPhase::GENERATE_RESULT, min<size_t>((z + 1) * segment_size, size), size, w.size());
+    }
+  }
+
+  // Write stop command
+  w.write_control(false);
+  w.flush_if_ready();
+  w.write_control(true);
+  w.write_data(0);
+  w.write_data(0);
+
+  string ret = std::move(w.close());
+  Metrics::add(metrics.prs_compressions);
+  Metrics::add(metrics.prs_compress_input_bytes, size);
+  Metrics::add(metrics.prs_compress_usecs, now() - start_time);
+  return ret;
+}
+
+string prs_compress_parallel(
+    const string& data,
+    ssize_t compression_level,
+    size_t num_threads,
+    ProgressCallback progress_fn) {
+  return prs_compress_parallel(data.data(), data.size(), compression_level, num_threads, progress_fn);
+}
+
 string prs_compress_indexed(
     const void* in_data_v, size_t in_size, ProgressCallback progress_fn) {
+  uint64_t start_time = now();
   const uint8_t* in_data = reinterpret_cast<const uint8_t*>(in_data_v);
 
   LZSSInterleavedWriter w;
@@ -790,15 +1136,62 @@ string prs_compress_indexed(
   w.write_data(0);
   w.write_data(0);
 
-  return std::move(w.close());
+  string ret = std::move(w.close());
+  Metrics::add(metrics.prs_compressions);
+  Metrics::add(metrics.prs_compress_input_bytes, in_size);
+  Metrics::add(metrics.prs_compress_usecs, now() - start_time);
+  return ret;
 }
 
 string prs_compress_indexed(const string& data, ProgressCallback progress_fn) {
   return prs_compress_indexed(data.data(), data.size(), progress_fn);
 }
 
-PRSDecompressResult prs_decompress_with_meta(
-    const void* data, size_t size, size_t max_output_size, bool allow_unterminated) {
+// Output buffers for the decompression functions below. reserve() returns a
+// pointer to the beginning of the output, which has space for at least the
+// given number of bytes.
+struct DecompressStringOutput {
+  string data;
+
+  uint8_t* reserve(size_t size) {
+    if (this->data.size() < size) {
+      this->data.resize(max<size_t>(size, this->data.size() * 2));
+    }
+    return reinterpret_cast<uint8_t*>(this->data.data());
+  }
+};
+
+struct DecompressBufferOutput {
+  uint8_t* data;
+  size_t size;
+
+  uint8_t* reserve(size_t size) {
+    if (this->size < size) {
+      throw out_of_range("output buffer is too small");
+    }
+    return this->data;
+  }
+};
+
+// Copies count bytes that begin distance bytes before out + offset to out +
+// offset. If distance is less than count, the source overlaps the destination,
+// so the bytes between the source and destination are repeated; this copies
+// them in chunks of distance bytes, so each chunk's source is already written.
+static inline void copy_backreference(uint8_t* out, size_t offset, size_t distance, size_t count) {
+  if (distance == 1) {
+    memset(out + offset, out[offset - 1], count);
+  } else {
+    for (size_t z = 0; z < count;) {
+      size_t chunk_size = min<size_t>(distance, count - z);
+      memcpy(out + offset + z, out + offset + z - distance, chunk_size);
+      z += chunk_size;
+    }
+  }
+}
+
+template <typename OutputT>
+static pair<size_t, size_t> prs_decompress_t(
+    OutputT& out, const void* data, size_t size, size_t max_output_size, bool allow_unterminated) {
   // PRS is an LZ77-based compression algorithm. Compressed data is split into
   // two streams: a control stream and a data stream. The control stream is read
   // one bit at a time, and the data stream is read one byte at a time. The
@@ -835,21 +1228,22 @@ PRSDecompressResult prs_decompress_with_meta(
   // is encountered partway through an opcode, we throw instead, because it's
   // likely the input has been truncated or is malformed in some way.
 
-  StringWriter w;
   StringReader r(data, size);
   ControlStreamReader cr(r);
+  size_t out_size = 0;
 
   while (!r.eof()) {
     // Control 1 = literal byte
     if (cr.read()) {
-      if (max_output_size && w.size() == max_output_size) {
+      if (max_output_size && out_size == max_output_size) {
         if (allow_unterminated) {
-          return {std::move(w.str()), r.where()};
+          return make_pair(out_size, r.where());
         } else {
           throw runtime_error("maximum output size exceeded");
         }
       }
-      w.put_u8(r.get_u8());
+      out.reserve(out_size + 1)[out_size] = r.get_u8();
+      out_size++;
 
     } else {
       ssize_t offset;
@@ -881,27 +1275,38 @@ PRSDecompressResult prs_decompress_with_meta(
         offset = r.get_u8() | (~0xFF);
       }
 
-      // Copy bytes from the referenced location in the output. Importantly,
-      // copy only one byte at a time, in order to support ranges that cover the
-      // current end of the output.
-      size_t read_offset = w.size() + offset;
-      if (read_offset >= w.size()) {
+      // Copy bytes from the referenced location in the output. If the maximum
+      // output size is reached partway through the copy, the bytes before the
+      // limit are still written.
+      size_t distance = -offset;
+      if (distance > out_size) {
         throw runtime_error("backreference offset beyond beginning of output");
       }
-      for (size_t z = 0; z < count; z++) {
-        if (max_output_size && w.size() == max_output_size) {
-          if (allow_unterminated) {
-            return {std::move(w.str()), r.where()};
-          } else {
-            throw out_of_range("maximum output size exceeded");
-          }
+      size_t copy_count = count;
+      if (max_output_size && (out_size + count > max_output_size)) {
+        copy_count = max_output_size - out_size;
+      }
+      copy_backreference(out.reserve(out_size + copy_count), out_size, distance, copy_count);
+      out_size += copy_count;
+      if (copy_count < count) {
+        if (allow_unterminated) {
+          return make_pair(out_size, r.where());
+        } else {
+          throw out_of_range("maximum output size exceeded");
         }
-        w.put_u8(w.str()[read_offset + z]);
       }
     }
   }
 
-  return {std::move(w.str()), r.where()};
+  return make_pair(out_size, r.where());
+}
+
+PRSDecompressResult prs_decompress_with_meta(
+    const void* data, size_t size, size_t max_output_size, bool allow_unterminated) {
+  DecompressStringOutput out;
+  auto ret = prs_decompress_t(out, data, size, max_output_size, allow_unterminated);
+  out.data.resize(ret.first);
+  return {std::move(out.data), ret.second};
 }
 
 PRSDecompressResult prs_decompress_with_meta(const string& data, size_t max_output_size, bool allow_unterminated) {
@@ -918,6 +1323,11 @@ string prs_decompress(const string& data, size_t max_output_size, bool allow_unt
   return std::move(ret.data);
 }
 
+size_t prs_decompress_into(void* out, size_t out_size, const void* data, size_t size, bool allow_unterminated) {
+  DecompressBufferOutput output = {reinterpret_cast<uint8_t*>(out), out_size};
+  return prs_decompress_t(output, data, size, out_size, allow_unterminated).first;
+}
+
 size_t prs_decompress_size(const void* data, size_t size, size_t max_output_size, bool allow_unterminated) {
   size_t ret = 0;
   StringReader r(data, size);
@@ -1041,7 +1451,7 @@ struct BC0PathNode {
   size_t to_offset = 0;
 };
 
-string bc0_compress_optimal(
+static string bc0_compress_optimal_uncached(
     const void* in_data_v, size_t in_size, ProgressCallback progress_fn) {
   const uint8_t* in_data = reinterpret_cast<const uint8_t*>(in_data_v);
 
@@ -1139,6 +1549,13 @@ string bc0_compress_optimal(
   return std::move(w.close());
 }
 
+string bc0_compress_optimal(const void* in_data_v, size_t in_size, ProgressCallback progress_fn) {
+  return compress_with_cache(
+      BC0_OPTIMAL_CACHE_PREFIX, in_data_v, in_size,
+      [](const string& data) -> string { return bc0_decompress(data); },
+      [&]() -> string { return bc0_compress_optimal_uncached(in_data_v, in_size, progress_fn); });
+}
+
 string bc0_compress(const string& data, ProgressCallback progress_fn) {
   return bc0_compress(data.data(), data.size(), progress_fn);
 }
@@ -1198,13 +1615,10 @@ string bc0_encode(const void* in_data_v, size_t in_size) {
 // is loaded from memory before every byte is written, so we cannot change the
 // output pointer to any arbitrary address.
 
-string bc0_decompress(const string& data) {
-  return bc0_decompress(data.data(), data.size());
-}
-
-string bc0_decompress(const void* data, size_t size) {
+template <typename OutputT>
+static size_t bc0_decompress_t(OutputT& out, const void* data, size_t size) {
   StringReader r(data, size);
-  StringWriter w;
+  size_t out_size = 0;
 
   // Unlike PRS, BC0 uses a memo which "rolls over" every 0x1000 bytes. The
   // boundaries of these "memo pages" are offset by -0x12 bytes for some reason,
@@ -1216,8 +1630,9 @@ string bc0_decompress(const void* data, size_t size) {
   // 0x1000 bytes and the first memo byte was 0x12 bytes before the beginning of
   // the next page). The memo is initially zeroed from 0 to 0xFEE; it seems PSO
   // GC doesn't initialize the last 0x12 bytes of the first memo page.
-  parray<uint8_t, 0x1000> memo;
-  uint16_t memo_offset = 0x0FEE;
+  // The memo always contains the most recent 0x1000 bytes of output (or zeroes,
+  // if less than 0x1000 bytes have been written), so instead of maintaining
+  // it, we compute where each backreference points to in the output.
 
   // The low byte of this value contains the control stream data; the high bits
   // specify which low bits are valid. When the last 1 is shifted out of the
@@ -1251,24 +1666,46 @@ string bc0_decompress(const void* data, size_t size) {
       uint8_t a2 = r.get_u8();
       size_t count = (a2 & 0x0F) + 3;
       size_t backreference_offset = a1 | ((a2 << 4) & 0xF00);
-      for (size_t z = 0; z < count; z++) {
-        uint8_t v = memo[(backreference_offset + z) & 0x0FFF];
-        w.put_u8(v);
-        memo[memo_offset] = v;
-        memo_offset = (memo_offset + 1) & 0x0FFF;
+      // If the memo position is the one about to be written, it refers to the
+      // byte written 0x1000 bytes ago
+      size_t distance = (out_size + 0x0FEE - backreference_offset) & 0x0FFF;
+      if (distance == 0) {
+        distance = 0x1000;
+      }
+      uint8_t* out_data = out.reserve(out_size + count);
+      if (distance <= out_size) {
+        copy_backreference(out_data, out_size, distance, count);
+      } else {
+        for (size_t z = 0; z < count; z++) {
+          out_data[out_size + z] = (out_size + z >= distance) ? out_data[out_size + z - distance] : 0;
+        }
       }
+      out_size += count;
 
       // Control bit 1 means to write a byte directly from the input to the
       // output. As above, the byte is also written to the memo.
     } else {
-      uint8_t v = r.get_u8();
-      w.put_u8(v);
-      memo[memo_offset] = v;
-      memo_offset = (memo_offset + 1) & 0x0FFF;
+      out.reserve(out_size + 1)[out_size] = r.get_u8();
+      out_size++;
     }
   }
 
-  return std::move(w.str());
+  return out_size;
+}
+
+string bc0_decompress(const string& data) {
+  return bc0_decompress(data.data(), data.size());
+}
+
+string bc0_decompress(const void* data, size_t size) {
+  DecompressStringOutput out;
+  out.data.resize(bc0_decompress_t(out, data, size));
+  return std::move(out.data);
+}
+
+size_t bc0_decompress_into(void* out, size_t out_size, const void* data, size_t size) {
+  DecompressBufferOutput output = {reinterpret_cast<uint8_t*>(out), out_size};
+  return bc0_decompress_t(output, data, size);
 }
 
 void bc0_disassemble(FILE* stream, const string& data) {
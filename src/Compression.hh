@@ -7,6 +7,7 @@
 #include <functional>
 #include <phosg/Tools.hh>
 #include <string>
+#include <vector>
 
 #include "Text.hh"
 
@@ -22,6 +23,16 @@ const char* name_for_enum<CompressPhase>(CompressPhase v);
 
 typedef std::function<void(CompressPhase phase, size_t input_progress, size_t input_size, size_t output_size)> ProgressCallback;
 
+// Sets the directory where the results of prs_compress_optimal and
+// bc0_compress_optimal are cached. Cache files are named by a hash of the input
+// data and the compressor version, so the same data is only compressed once,
+// even across server restarts. If the directory is empty (the default), the
+// results are not cached. When the files in the directory exceed max_size
+// bytes, the least recently used ones are deleted; results from older
+// compressor versions are also deleted. This is safe to call while other
+// threads are compressing.
+void set_compression_cache_directory(const std::string& directory, size_t max_size);
+
 ////////////////////////////////////////////////////////////////////////////////
 // PRS compression
 ////////////////////////////////////////////////////////////////////////////////
@@ -44,6 +55,9 @@ public:
   //       the backreference or ignoring it.
   //   2+: Consider further chains of paths at each point. Using values 2 or
   //       greater for compression_level generally yields diminishing returns.
+  // The compression level also determines how many earlier occurrences of each
+  // sequence are checked when searching for a backreference; at level 0, only
+  // the 128 most recent are checked, and this doubles with each level.
   explicit PRSCompressor(ssize_t compression_level = 0, ProgressCallback progress_fn = nullptr);
   ~PRSCompressor() = default;
 
@@ -53,6 +67,14 @@ public:
   void add(const void* data, size_t size);
   void add(const std::string& data);
 
+  // Adds data that logically comes before the data to be compressed, so that
+  // the output can contain backreferences to it, but doesn't write any
+  // commands for it. The output can then only be decompressed by appending it
+  // to the commands that produce this data (this is how prs_compress_parallel
+  // works). Only the last 0x1FFF bytes of the data can be referenced. Must be
+  // called before add() is called.
+  void add_dictionary(const void* data, size_t size);
+
   // Ends compression and returns the complete compressed result. It's OK to
   // std::move() from the returned string reference.
   std::string& close();
@@ -78,18 +100,42 @@ private:
     }
   };
 
+  // IndexedLog maintains hash chains that link each position in the log to the
+  // previous position at which the same three bytes occurred. There is also a
+  // separate set of chains for two-byte sequences, which only covers the last
+  // NEAR_DISTANCE positions, since two-byte backreferences can only be encoded
+  // as short copies. Positions that have moved out of the log are not removed
+  // from the chains; instead, the find functions stop when they reach one.
   template <size_t Size>
   struct IndexedLog : WrappedLog<Size> {
+    static constexpr size_t NONE = static_cast<size_t>(-1);
+    static constexpr size_t HASH_SIZE = 0x1000;
+    static constexpr size_t NEAR_DISTANCE = 0x100;
+
     size_t offset;
     size_t size;
-    std::array<std::deque<size_t>, 0x100> index;
+    std::vector<size_t> heads; // [hash] -> latest position
+    std::vector<size_t> prev; // [position % Size] -> previous position
+    std::vector<size_t> near_heads; // [hash] -> latest position
+    std::vector<size_t> near_prev; // [position % NEAR_DISTANCE] -> previous position
 
     IndexedLog()
         : WrappedLog<Size>(),
           offset(0),
-          size(0) {}
+          size(0),
+          heads(HASH_SIZE, NONE),
+          prev(Size, NONE),
+          near_heads(HASH_SIZE, NONE),
+          near_prev(NEAR_DISTANCE, NONE) {}
     ~IndexedLog() = default;
 
+    static inline size_t hash(uint8_t a, uint8_t b, uint8_t c) {
+      return (((a << 16) | (b << 8) | c) * 0x9E3779B1) >> 20;
+    }
+    static inline size_t near_hash(uint8_t a, uint8_t b) {
+      return (((a << 8) | b) * 0x9E3779B1) >> 20;
+    }
+
     inline size_t end_offset() const {
       return this->offset + this->size;
     }
@@ -100,8 +146,19 @@ private:
       }
       size_t write_offset = this->offset + this->size;
       this->at(write_offset) = v;
-      this->index[v].push_back(write_offset);
       this->size++;
+      if (this->size >= 2) {
+        size_t pos = write_offset - 1;
+        size_t& head = this->near_heads[this->near_hash(this->at(pos), v)];
+        this->near_prev[pos % NEAR_DISTANCE] = head;
+        head = pos;
+      }
+      if (this->size >= 3) {
+        size_t pos = write_offset - 2;
+        size_t& head = this->heads[this->hash(this->at(pos), this->at(pos + 1), v)];
+        this->prev[pos % Size] = head;
+        head = pos;
+      }
     }
     uint8_t pop_back() {
       if (!this->size) {
@@ -110,22 +167,55 @@ private:
       this->size--;
       size_t offset = this->offset + this->size;
       uint8_t v = this->at(offset);
-      this->index[v].pop_back();
+      // Positions are always removed in the reverse of the order they were
+      // added, so the removed position is always at the head of its chain
+      if (this->size >= 2) {
+        size_t pos = offset - 2;
+        this->heads[this->hash(this->at(pos), this->at(pos + 1), v)] = this->prev[pos % Size];
+      }
+      if (this->size >= 1) {
+        size_t pos = offset - 1;
+        this->near_heads[this->near_hash(this->at(pos), v)] = this->near_prev[pos % NEAR_DISTANCE];
+      }
       return v;
     }
     uint8_t pop_front() {
       uint8_t v = this->at(this->offset);
-      this->index[v].pop_front();
       this->offset++;
       this->size--;
       return v;
     }
-    const std::deque<size_t>& find(uint8_t v) {
-      return this->index[v];
+
+    // These functions return candidate positions in order from latest to
+    // earliest, or NONE when there are no more candidates. Since different
+    // sequences can have the same hash, the caller must check the data at
+    // each returned position. The last two positions in the log (or the last
+    // position, for the near chains) are never returned, since the sequences
+    // that begin there aren't complete yet.
+    inline size_t find(uint8_t a, uint8_t b, uint8_t c) const {
+      return this->valid_or_none(this->heads[this->hash(a, b, c)]);
+    }
+    inline size_t find_next(size_t pos) const {
+      return this->valid_or_none(this->prev[pos % Size]);
+    }
+    inline size_t find_near(uint8_t a, uint8_t b) const {
+      return this->near_valid_or_none(this->near_heads[this->near_hash(a, b)]);
+    }
+    inline size_t find_near_next(size_t pos) const {
+      return this->near_valid_or_none(this->near_prev[pos % NEAR_DISTANCE]);
+    }
+
+  private:
+    inline size_t valid_or_none(size_t pos) const {
+      return ((pos != NONE) && (pos >= this->offset)) ? pos : NONE;
+    }
+    inline size_t near_valid_or_none(size_t pos) const {
+      return ((pos != NONE) && (pos >= this->offset) && (this->end_offset() - pos <= NEAR_DISTANCE)) ? pos : NONE;
     }
   };
 
   void add_byte(uint8_t v);
+  size_t match_size(size_t match_offset, size_t compression_offset, size_t max_size) const;
   void advance();
   void move_forward_data_to_reverse_log(size_t size);
   void advance_literal();
@@ -136,6 +226,7 @@ private:
   void flush_control();
 
   ssize_t compression_level;
+  size_t max_chain_depth;
   ProgressCallback progress_fn;
   bool closed;
 
@@ -162,6 +253,23 @@ std::string prs_compress(
     ssize_t compression_level = 0,
     ProgressCallback progress_fn = nullptr);
 
+// Like prs_compress, but splits the input into segments and compresses them
+// on multiple threads, then combines the results into a single PRS stream. The
+// result is slightly larger than prs_compress would produce, since matches
+// can't span segment boundaries. If num_threads is 0, the number of threads is
+// the number of CPU cores. Small inputs are compressed on a single thread.
+std::string prs_compress_parallel(
+    const void* vdata,
+    size_t size,
+    ssize_t compression_level = 0,
+    size_t num_threads = 0,
+    ProgressCallback progress_fn = nullptr);
+std::string prs_compress_parallel(
+    const std::string& data,
+    ssize_t compression_level = 0,
+    size_t num_threads = 0,
+    ProgressCallback progress_fn = nullptr);
+
 // A faster form of prs_compress that doesn't have a tunable compression level.
 std::string prs_compress_indexed(
     const void* vdata,
@@ -187,6 +295,13 @@ PRSDecompressResult prs_decompress_with_meta(const std::string& data, size_t max
 std::string prs_decompress(const void* data, size_t size, size_t max_output_size = 0, bool allow_unterminated = false);
 std::string prs_decompress(const std::string& data, size_t max_output_size = 0, bool allow_unterminated = false);
 
+// Decompresses PRS-compressed data into a caller-provided buffer, and returns
+// the number of bytes written. Use this when the decompressed size is known in
+// advance (e.g. from a file header) to avoid an extra allocation and copy. If
+// the data doesn't fit in the buffer, throws unless allow_unterminated is true,
+// in which case decompression stops when the buffer is full.
+size_t prs_decompress_into(void* out, size_t out_size, const void* data, size_t size, bool allow_unterminated = false);
+
 // Returns the decompressed size of PRS-compressed data, without actually
 // decompressing it.
 size_t prs_decompress_size(const void* data, size_t size, size_t max_output_size = 0, bool allow_unterminated = false);
@@ -216,6 +331,9 @@ std::string bc0_encode(const void* in_data_v, size_t in_size);
 // Decompresses BC0-compressed data.
 std::string bc0_decompress(const std::string& data);
 std::string bc0_decompress(const void* data, size_t size);
+// Like prs_decompress_into, but for BC0. Throws if the data doesn't fit in the
+// buffer.
+size_t bc0_decompress_into(void* out, size_t out_size, const void* data, size_t size);
 
 // Prints the command stream from a BC0-compressed buffer.
 void bc0_disassemble(FILE* stream, const std::string& data);
@@ -2385,13 +2385,15 @@ MapIndex::VersionedMap::VersionedMap(shared_ptr<const MapDefinition> map, uint8_
 MapIndex::VersionedMap::VersionedMap(std::string&& compressed_data, uint8_t language)
     : language(language),
       compressed_data(std::move(compressed_data)) {
-  string decompressed = prs_decompress(this->compressed_data);
-  if (decompressed.size() != sizeof(MapDefinition)) {
+  auto map = make_shared<MapDefinition>();
+  size_t decompressed_size = prs_decompress_into(
+      map.get(), sizeof(MapDefinition), this->compressed_data.data(), this->compressed_data.size());
+  if (decompressed_size != sizeof(MapDefinition)) {
     throw runtime_error(string_printf(
         "decompressed data size is incorrect (expected %zu bytes, read %zu bytes)",
-        sizeof(MapDefinition), decompressed.size()));
+        sizeof(MapDefinition), decompressed_size));
   }
-  this->map = make_shared<MapDefinition>(*reinterpret_cast<const MapDefinition*>(decompressed.data()));
+  this->map = std::move(map);
 }
 
 shared_ptr<const MapDefinitionTrial> MapIndex::VersionedMap::trial() const {
@@ -0,0 +1,187 @@
+#include "EventLoopStats.hh"
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+#include <vector>
+
+#include "Loggers.hh"
+
+using namespace std;
+
+shared_ptr<EventLoopStats> event_loop_stats;
+
+void EventLoopStats::Histogram::add(uint64_t usecs, size_t bytes) {
+  this->count++;
+  this->total_bytes += bytes;
+  this->total_usecs += usecs;
+  this->max_usecs = max<uint64_t>(this->max_usecs, usecs);
+  size_t bucket = (usecs == 0) ? 0 : (64 - __builtin_clzll(usecs));
+  this->buckets[min<size_t>(bucket, NUM_BUCKETS - 1)]++;
+}
+
+uint64_t EventLoopStats::Histogram::percentile_usecs(double p) const {
+  if (this->count == 0) {
+    return 0;
+  }
+  uint64_t target = static_cast<uint64_t>(this->count * p);
+  uint64_t seen = 0;
+  for (size_t z = 0; z < NUM_BUCKETS; z++) {
+    seen += this->buckets[z];
+    if (seen > target) {
+      return min<uint64_t>(1ULL << z, this->max_usecs);
+    }
+  }
+  return this->max_usecs;
+}
+
+JSON EventLoopStats::Histogram::json() const {
+  auto buckets_json = JSON::list();
+  for (uint64_t bucket : this->buckets) {
+    buckets_json.emplace_back(bucket);
+  }
+  return JSON::dict({
+      {"Count", this->count},
+      {"TotalBytes", this->total_bytes},
+      {"TotalUsecs", this->total_usecs},
+      {"MaxUsecs", this->max_usecs},
+      {"P50Usecs", this->percentile_usecs(0.5)},
+      {"P99Usecs", this->percentile_usecs(0.99)},
+      {"Buckets", std::move(buckets_json)},
+  });
+}
+
+EventLoopStats::EventLoopStats(shared_ptr<struct event_base> base, const Options& options)
+    : base(base),
+      options(options),
+      start_time(now()),
+      lag_probe_event(event_new(this->base.get(), -1, EV_TIMEOUT, &EventLoopStats::dispatch_on_lag_probe, this), event_free),
+      lag_probe_expected_time(0) {
+  this->schedule_lag_probe();
+}
+
+void EventLoopStats::add_command(Version version, uint16_t command, size_t bytes, uint64_t usecs) {
+  auto& h = this->commands[command & 0xFF][static_cast<size_t>(version)];
+  if (!h) {
+    h = make_unique<Histogram>();
+  }
+  h->add(usecs, bytes);
+  if (usecs >= this->options.slow_handler_threshold_usecs) {
+    server_log.warning("Slow handler: command %02hX on %s took %" PRIu64 " usecs (%zu bytes)",
+        command, name_for_enum(version), usecs, bytes);
+  }
+}
+
+void EventLoopStats::add_subcommand(Version version, uint8_t subcommand, size_t bytes, uint64_t usecs) {
+  auto& h = this->subcommands[subcommand][static_cast<size_t>(version)];
+  if (!h) {
+    h = make_unique<Histogram>();
+  }
+  h->add(usecs, bytes);
+  if (usecs >= this->options.slow_handler_threshold_usecs) {
+    server_log.warning("Slow handler: subcommand 6x%02hhX on %s took %" PRIu64 " usecs (%zu bytes)",
+        subcommand, name_for_enum(version), usecs, bytes);
+  }
+}
+
+void EventLoopStats::reset() {
+  for (auto& version_hists : this->commands) {
+    for (auto& h : version_hists) {
+      h.reset();
+    }
+  }
+  for (auto& version_hists : this->subcommands) {
+    for (auto& h : version_hists) {
+      h.reset();
+    }
+  }
+  this->loop_lag = Histogram();
+  this->start_time = now();
+}
+
+string EventLoopStats::str() const {
+  struct Entry {
+    string name;
+    const Histogram* h;
+  };
+  vector<Entry> entries;
+  for (size_t cmd = 0; cmd < 0x100; cmd++) {
+    for (size_t v = 0; v < NUM_VERSIONS; v++) {
+      const auto& h = this->commands[cmd][v];
+      if (h) {
+        entries.emplace_back(Entry{string_printf("%02zX %s", cmd, name_for_enum(static_cast<Version>(v))), h.get()});
+      }
+    }
+  }
+  for (size_t subcmd = 0; subcmd < 0x100; subcmd++) {
+    for (size_t v = 0; v < NUM_VERSIONS; v++) {
+      const auto& h = this->subcommands[subcmd][v];
+      if (h) {
+        entries.emplace_back(Entry{string_printf("6x%02zX %s", subcmd, name_for_enum(static_cast<Version>(v))), h.get()});
+      }
+    }
+  }
+  sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) -> bool {
+    return a.h->total_usecs > b.h->total_usecs;
+  });
+
+  string ret = string_printf("Statistics for the last %s\n", format_duration(now() - this->start_time).c_str());
+  ret += string_printf("Loop lag: %" PRIu64 " probes, p50 %" PRIu64 " usecs, p99 %" PRIu64 " usecs, max %" PRIu64 " usecs\n",
+      this->loop_lag.count, this->loop_lag.percentile_usecs(0.5), this->loop_lag.percentile_usecs(0.99), this->loop_lag.max_usecs);
+  ret += string_printf("%-20s %8s %12s %13s %9s %9s %9s %9s\n",
+      "HANDLER", "COUNT", "BYTES", "TOTAL(ms)", "AVG(us)", "P50(us)", "P99(us)", "MAX(us)");
+  for (const auto& e : entries) {
+    ret += string_printf("%-20s %8" PRIu64 " %12" PRIu64 " %13.3f %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 "\n",
+        e.name.c_str(), e.h->count, e.h->total_bytes, static_cast<double>(e.h->total_usecs) / 1000.0,
+        e.h->total_usecs / e.h->count, e.h->percentile_usecs(0.5), e.h->percentile_usecs(0.99), e.h->max_usecs);
+  }
+  return ret;
+}
+
+JSON EventLoopStats::json() const {
+  auto commands_json = JSON::dict();
+  for (size_t cmd = 0; cmd < 0x100; cmd++) {
+    for (size_t v = 0; v < NUM_VERSIONS; v++) {
+      const auto& h = this->commands[cmd][v];
+      if (h) {
+        commands_json.emplace(string_printf("%02zX:%s", cmd, name_for_enum(static_cast<Version>(v))), h->json());
+      }
+    }
+  }
+  auto subcommands_json = JSON::dict();
+  for (size_t subcmd = 0; subcmd < 0x100; subcmd++) {
+    for (size_t v = 0; v < NUM_VERSIONS; v++) {
+      const auto& h = this->subcommands[subcmd][v];
+      if (h) {
+        subcommands_json.emplace(string_printf("6x%02zX:%s", subcmd, name_for_enum(static_cast<Version>(v))), h->json());
+      }
+    }
+  }
+  return JSON::dict({
+      {"StartTime", this->start_time},
+      {"Time", now()},
+      {"LoopLag", this->loop_lag.json()},
+      {"Commands", std::move(commands_json)},
+      {"Subcommands", std::move(subcommands_json)},
+  });
+}
+
+void EventLoopStats::dispatch_on_lag_probe(evutil_socket_t, short, void* ctx) {
+  reinterpret_cast<EventLoopStats*>(ctx)->on_lag_probe();
+}
+
+void EventLoopStats::on_lag_probe() {
+  uint64_t t = now();
+  this->loop_lag.add((t > this->lag_probe_expected_time) ? (t - this->lag_probe_expected_time) : 0, 0);
+  this->schedule_lag_probe();
+}
+
+void EventLoopStats::schedule_lag_probe() {
+  if (this->options.lag_probe_interval_usecs) {
+    this->lag_probe_expected_time = now() + this->options.lag_probe_interval_usecs;
+    struct timeval tv = usecs_to_timeval(this->options.lag_probe_interval_usecs);
+    event_add(this->lag_probe_event.get(), &tv);
+  }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <event2/event.h>
+#include <stdint.h>
+
+#include <array>
+#include <memory>
+#include <phosg/JSON.hh>
+#include <string>
+
+#include "Version.hh"
+
+// EventLoopStats measures how much time the main event loop spends in each
+// command and subcommand handler, and how late the loop is in running timer
+// callbacks (which indicates how long it was blocked). Like the handlers
+// themselves, all methods must be called on the main thread.
+//
+// Subcommands are dispatched from within the handlers for the commands that
+// contain them (60, 62, 6C, 6D, C9, and CB), so the time recorded for those
+// commands includes the time recorded for their subcommands. Totals of command
+// and subcommand times therefore count subcommand time twice.
+class EventLoopStats {
+public:
+  struct Options {
+    // Handlers that take longer than this are logged
+    uint64_t slow_handler_threshold_usecs = 50000;
+    // How often to measure loop lag. If zero, lag is not measured
+    uint64_t lag_probe_interval_usecs = 100000;
+  };
+
+  // Histogram bucket i counts samples less than 2^i microseconds (and not in a
+  // lower bucket). The last bucket also counts all larger samples.
+  struct Histogram {
+    static constexpr size_t NUM_BUCKETS = 28;
+
+    uint64_t count = 0;
+    uint64_t total_bytes = 0;
+    uint64_t total_usecs = 0;
+    uint64_t max_usecs = 0;
+    std::array<uint64_t, NUM_BUCKETS> buckets = {};
+
+    void add(uint64_t usecs, size_t bytes);
+    // Returns the upper bound of the bucket containing the given percentile.
+    // This is exact to within a factor of 2.
+    uint64_t percentile_usecs(double p) const;
+    JSON json() const;
+  };
+
+  EventLoopStats(std::shared_ptr<struct event_base> base, const Options& options);
+  EventLoopStats(const EventLoopStats&) = delete;
+  EventLoopStats(EventLoopStats&&) = delete;
+  EventLoopStats& operator=(const EventLoopStats&) = delete;
+  EventLoopStats& operator=(EventLoopStats&&) = delete;
+  ~EventLoopStats() = default;
+
+  void add_command(Version version, uint16_t command, size_t bytes, uint64_t usecs);
+  void add_subcommand(Version version, uint8_t subcommand, size_t bytes, uint64_t usecs);
+
+  inline const Histogram& get_loop_lag() const {
+    return this->loop_lag;
+  }
+
+  void reset();
+  // Returns a human-readable table of all handlers that have been called,
+  // sorted by total time spent in each handler
+  std::string str() const;
+  JSON json() const;
+
+private:
+  std::shared_ptr<struct event_base> base;
+  Options options;
+  uint64_t start_time;
+
+  // Indexed as [command & 0xFF][version], like the handler table
+  std::array<std::array<std::unique_ptr<Histogram>, NUM_VERSIONS>, 0x100> commands;
+  std::array<std::array<std::unique_ptr<Histogram>, NUM_VERSIONS>, 0x100> subcommands;
+  Histogram loop_lag;
+
+  std::unique_ptr<struct event, void (*)(struct event*)> lag_probe_event;
+  uint64_t lag_probe_expected_time;
+
+  static void dispatch_on_lag_probe(evutil_socket_t fd, short events, void* ctx);
+  void on_lag_probe();
+  void schedule_lag_probe();
+};
+
+// Null unless EventLoopStats is enabled in the configuration
+extern std::shared_ptr<EventLoopStats> event_loop_stats;
@@ -45,7 +45,7 @@ ItemCreator::ItemCreator(
 
 void ItemCreator::set_random_state(uint32_t seed, uint32_t absolute_offset) {
   if ((this->random_crypt.seed() != seed) || (this->random_crypt.absolute_offset() > absolute_offset)) {
-    this->random_crypt = PSOV2Encryption(seed);
+    this->random_crypt = PSOV2LFG(seed);
   }
   while (this->random_crypt.absolute_offset() < absolute_offset) {
     this->random_crypt.next();
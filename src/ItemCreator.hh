@@ -77,7 +77,7 @@ private:
 
   // Note: The original implementation uses 17 different random states for some
   // reason. We forego that and use only one for simplicity.
-  PSOV2Encryption random_crypt;
+  PSOV2LFG random_crypt;
 
   inline bool is_v3() const {
     return !is_v1_or_v2(this->version);
@@ -98,8 +98,10 @@ LevelTableV3BE::LevelTableV3BE(const string& data, bool encrypted) {
   string decompressed_data;
   if (encrypted) {
     auto decrypted = decrypt_pr2_data<true>(data);
-    decompressed_data = prs_decompress(decrypted.compressed_data);
-    if (decompressed_data.size() != decrypted.decompressed_size) {
+    decompressed_data.resize(decrypted.decompressed_size);
+    size_t decompressed_size = prs_decompress_into(
+        decompressed_data.data(), decompressed_data.size(), decrypted.compressed_data.data(), decrypted.compressed_data.size());
+    if (decompressed_size != decrypted.decompressed_size) {
       throw runtime_error("decompressed data size does not match expected size");
     }
     r = StringReader(decompressed_data);
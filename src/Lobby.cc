@@ -2,7 +2,10 @@
 
 #include <string.h>
 
+#include <map>
+#include <mutex>
 #include <phosg/Random.hh>
+#include <tuple>
 
 #include "Compression.hh"
 #include "Loggers.hh"
@@ -284,6 +287,57 @@ shared_ptr<Map> Lobby::load_maps(
   return map;
 }
 
+// Returns the parsed form of an enemy or object map file. Templates are cached
+// by the address of the map data (and the parameters that affect parsing), and
+// are dropped when the map data object is destroyed (e.g. if the map file cache
+// is cleared when map files are reloaded).
+static shared_ptr<const Map::FloorTemplate> get_map_template(
+    Version version,
+    Episode episode,
+    uint8_t difficulty,
+    uint8_t event,
+    uint8_t floor,
+    bool is_enemies,
+    shared_ptr<const string> map_data) {
+  using KeyT = tuple<const string*, Version, Episode, uint8_t, uint8_t, uint8_t, bool>;
+  struct CacheEntry {
+    weak_ptr<const string> map_data;
+    shared_ptr<const Map::FloorTemplate> map_template;
+  };
+  static mutex cache_lock;
+  static map<KeyT, CacheEntry> cache;
+
+  // Difficulty and event don't affect object lists, so don't make separate
+  // entries for them
+  if (!is_enemies) {
+    difficulty = 0;
+    event = 0;
+  }
+  KeyT key(map_data.get(), version, episode, difficulty, event, floor, is_enemies);
+  {
+    lock_guard<mutex> g(cache_lock);
+    auto it = cache.find(key);
+    if ((it != cache.end()) && (it->second.map_data.lock() == map_data)) {
+      return it->second.map_template;
+    }
+  }
+
+  auto ret = is_enemies
+      ? Map::enemies_template(version, episode, difficulty, event, floor, map_data->data(), map_data->size())
+      : Map::objects_template(floor, map_data->data(), map_data->size());
+
+  lock_guard<mutex> g(cache_lock);
+  for (auto it = cache.begin(); it != cache.end();) {
+    if (it->second.map_data.expired()) {
+      it = cache.erase(it);
+    } else {
+      it++;
+    }
+  }
+  cache[key] = CacheEntry{map_data, ret};
+  return ret;
+}
+
 shared_ptr<Map> Lobby::load_maps(
     Version version,
     Episode episode,
@@ -317,14 +371,8 @@ shared_ptr<Map> Lobby::load_maps(
       for (const string& filename : enemy_filenames) {
         auto map_data = get_file_data(version, filename);
         if (map_data) {
-          map->add_enemies_from_map_data(
-              episode,
-              difficulty,
-              event,
-              floor,
-              map_data->data(),
-              map_data->size(),
-              rare_rates);
+          auto enemies_template = get_map_template(version, episode, difficulty, event, floor, true, map_data);
+          map->add_from_template(*enemies_template, rare_rates);
           any_map_loaded = true;
           break;
         }
@@ -347,7 +395,8 @@ shared_ptr<Map> Lobby::load_maps(
       for (const string& filename : object_filenames) {
         auto map_data = get_file_data(version, filename);
         if (map_data) {
-          map->add_objects_from_map_data(floor, map_data->data(), map_data->size());
+          auto objects_template = get_map_template(version, episode, difficulty, event, floor, false, map_data);
+          map->add_from_template(*objects_template, rare_rates);
           any_map_loaded = true;
           break;
         }
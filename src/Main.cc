@@ -3,6 +3,7 @@
 #include <signal.h>
 #include <string.h>
 
+#include <algorithm>
 #include <mutex>
 #include <phosg/Arguments.hh>
 #include <phosg/Filesystem.hh>
@@ -22,6 +23,7 @@
 #endif
 #include "BMLArchive.hh"
 #include "CatSession.hh"
+#include "CommandTrace.hh"
 #include "Compression.hh"
 #include "DCSerialNumbers.hh"
 #include "DNSServer.hh"
@@ -29,12 +31,14 @@
 #include "GVMEncoder.hh"
 #include "IPStackSimulator.hh"
 #include "Loggers.hh"
+#include "Metrics.hh"
 #include "NetworkAddresses.hh"
 #include "PSOGCObjectGraph.hh"
 #include "PSOProtocol.hh"
 #include "ProxyServer.hh"
 #include "Quest.hh"
 #include "QuestScript.hh"
+#include "RareEnemySeedIndex.hh"
 #include "ReplaySession.hh"
 #include "Revision.hh"
 #include "SaveFileFormats.hh"
@@ -45,6 +49,7 @@
 #include "StaticGameData.hh"
 #include "Text.hh"
 #include "TextIndex.hh"
+#include "WorkerPool.hh"
 
 using namespace std;
 
@@ -264,6 +269,7 @@ static void a_compress_decompress_fn(Arguments& args) {
   bool is_big_endian = args.get<bool>("big-endian");
   bool is_optimal = args.get<bool>("optimal");
   int8_t compression_level = args.get<int8_t>("compression-level", 0);
+  size_t num_threads = args.get<size_t>("threads", 1);
   size_t bytes = args.get<size_t>("bytes", 0);
   string seed = args.get<string>("seed");
 
@@ -295,6 +301,8 @@ static void a_compress_decompress_fn(Arguments& args) {
   if (!is_decompress && (is_prs || is_pr2 || is_prc)) {
     if (is_optimal) {
       data = prs_compress_optimal(data.data(), data.size(), optimal_progress_fn);
+    } else if (num_threads != 1) {
+      data = prs_compress_parallel(data, compression_level, num_threads, progress_fn);
     } else {
       data = prs_compress(data, compression_level, progress_fn);
     }
@@ -369,7 +377,11 @@ Action a_compress_prc("compress-prc", "\
     in valid PRS data which is about 9/8 the size of the input.\n\
     There is also a compressor which produces the absolute smallest output\n\
     size, but uses much more memory and CPU time. To use this compressor, use\n\
-    the --optimal option.\n",
+    the --optimal option.\n\
+    For PRS and PR2, large inputs can be compressed on multiple threads with\n\
+    the --threads=NUM-THREADS option (0 means one thread per CPU core). This\n\
+    splits the input into segments that are compressed independently, so the\n\
+    output is slightly larger than with a single thread.\n",
     a_compress_decompress_fn);
 Action a_decompress_prs("decompress-prs", nullptr, a_compress_decompress_fn);
 Action a_decompress_bc0("decompress-bc0", nullptr, a_compress_decompress_fn);
@@ -492,6 +504,63 @@ Action a_decrypt_data("decrypt-data", "\
     file formats.\n",
     a_encrypt_decrypt_fn);
 
+Action a_bench_crypto(
+    "bench-crypto", "\
+  bench-crypto [OPTIONS...]\n\
+    Measure the throughput of the network protocol ciphers. Each cipher\n\
+    encrypts (and for BB, also decrypts) a buffer repeatedly, and the speed is\n\
+    reported in MB/sec. The --size=BYTES option specifies the buffer size\n\
+    (default 0x1000; must be a multiple of 8), and --total-size=BYTES specifies\n\
+    how much data each cipher should process (default 0x10000000). BB uses a\n\
+    random key unless the --key=KEY-NAME option is given, which refers to a\n\
+    .nsk file in system/blueburst/keys (without the directory or extension).\n",
+    +[](Arguments& args) {
+      size_t block_size = args.get<size_t>("size", 0x1000);
+      size_t total_size = args.get<size_t>("total-size", 0x10000000);
+      if ((block_size == 0) || (block_size & 7)) {
+        throw runtime_error("--size must be a nonzero multiple of 8");
+      }
+
+      string key_name = args.get<string>("key");
+      auto bb_key = key_name.empty()
+          ? random_object<PSOBBEncryption::KeyFile>()
+          : load_object_file<PSOBBEncryption::KeyFile>("system/blueburst/keys/" + key_name + ".nsk");
+      if (key_name.empty()) {
+        bb_key.subtype = PSOBBEncryption::Subtype::STANDARD;
+      }
+      string bb_seed(0x30, '\0');
+      for (size_t z = 0; z < bb_seed.size(); z++) {
+        bb_seed[z] = z;
+      }
+
+      string data(block_size, '\0');
+      auto run = [&](const char* name, PSOEncryption& crypt, bool is_decrypt) -> void {
+        size_t bytes_processed = 0;
+        uint64_t start = now();
+        while (bytes_processed < total_size) {
+          if (is_decrypt) {
+            crypt.decrypt(data.data(), data.size());
+          } else {
+            crypt.encrypt(data.data(), data.size());
+          }
+          bytes_processed += data.size();
+        }
+        uint64_t usecs = max<uint64_t>(now() - start, 1);
+        double mb_per_sec = (static_cast<double>(bytes_processed) / 1048576.0) / (static_cast<double>(usecs) / 1000000.0);
+        string time_str = format_duration(usecs);
+        log_info("%-12s %zu bytes in %s (%.1f MB/sec)", name, bytes_processed, time_str.c_str(), mb_per_sec);
+      };
+
+      PSOV2Encryption v2_crypt(0x12345678);
+      run("V2", v2_crypt, false);
+      PSOV3Encryption v3_crypt(0x12345678);
+      run("V3", v3_crypt, false);
+      PSOBBEncryption bb_encrypt(bb_key, bb_seed.data(), bb_seed.size());
+      run("BB encrypt", bb_encrypt, false);
+      PSOBBEncryption bb_decrypt(bb_key, bb_seed.data(), bb_seed.size());
+      run("BB decrypt", bb_decrypt, true);
+    });
+
 static void a_encrypt_decrypt_trivial_fn(Arguments& args) {
   bool is_decrypt = (args.get<string>(0) == "decrypt-trivial-data");
   string seed = args.get<string>("seed");
@@ -917,61 +986,59 @@ Action a_find_decryption_seed(
       bool skip_big_endian = args.get<bool>("skip-big-endian");
       size_t num_threads = args.get<size_t>("threads", 0);
 
-      size_t max_plaintext_size = 0;
-      vector<pair<string, string>> plaintexts;
+      string ciphertext = parse_data_string(ciphertext_ascii, nullptr, ParseDataFlags::ALLOW_FILES);
+
+      // Decrypting is an XOR with the keystream, so a seed is correct if its
+      // keystream matches (ciphertext ^ plaintext) in the unmasked bits. Each
+      // plaintext yields one pattern per byte order, since the keystream words
+      // may be applied to the data as either little-endian or big-endian.
+      vector<PSOLFGSeedMatcher::Pattern> patterns;
       for (const auto& plaintext_ascii : plaintexts_ascii) {
         string mask;
         string data = parse_data_string(plaintext_ascii, &mask, ParseDataFlags::ALLOW_FILES);
         if (data.size() != mask.size()) {
           throw logic_error("plaintext and mask are not the same size");
         }
-        max_plaintext_size = max<size_t>(max_plaintext_size, data.size());
-        plaintexts.emplace_back(std::move(data), std::move(mask));
-      }
-      string ciphertext = parse_data_string(ciphertext_ascii, nullptr, ParseDataFlags::ALLOW_FILES);
-
-      auto mask_match = +[](const void* a, const void* b, const void* m, size_t size) -> bool {
-        const uint8_t* a8 = reinterpret_cast<const uint8_t*>(a);
-        const uint8_t* b8 = reinterpret_cast<const uint8_t*>(b);
-        const uint8_t* m8 = reinterpret_cast<const uint8_t*>(m);
-        for (size_t z = 0; z < size; z++) {
-          if ((a8[z] & m8[z]) != (b8[z] & m8[z])) {
-            return false;
-          }
-        }
-        return true;
-      };
-
-      uint64_t seed = parallel_range<uint64_t>([&](uint64_t seed, size_t) -> bool {
-        string be_decrypt_buf = ciphertext.substr(0, max_plaintext_size);
-        string le_decrypt_buf = ciphertext.substr(0, max_plaintext_size);
-        if (uses_v3_encryption(version)) {
-          PSOV3Encryption(seed).encrypt_both_endian(
-              le_decrypt_buf.data(),
-              be_decrypt_buf.data(),
-              be_decrypt_buf.size());
-        } else {
-          PSOV2Encryption(seed).encrypt_both_endian(
-              le_decrypt_buf.data(),
-              be_decrypt_buf.data(),
-              be_decrypt_buf.size());
+        if (data.size() > ciphertext.size()) {
+          throw runtime_error("plaintext is longer than ciphertext");
         }
-
-        for (const auto& plaintext : plaintexts) {
-          if (!skip_little_endian) {
-            if (mask_match(le_decrypt_buf.data(), plaintext.first.data(), plaintext.second.data(), plaintext.second.size())) {
-              return true;
-            }
+        for (bool is_big_endian : {false, true}) {
+          if (is_big_endian ? skip_big_endian : skip_little_endian) {
+            continue;
           }
-          if (!skip_big_endian) {
-            if (mask_match(be_decrypt_buf.data(), plaintext.first.data(), plaintext.second.data(), plaintext.second.size())) {
-              return true;
+          auto& pattern = patterns.emplace_back();
+          for (size_t offset = 0; offset < data.size(); offset += 4) {
+            uint32_t value = 0;
+            uint32_t word_mask = 0;
+            for (size_t z = 0; z < 4; z++) {
+              size_t shift = is_big_endian ? (24 - 8 * z) : (8 * z);
+              if (offset + z < data.size()) {
+                uint8_t m = mask[offset + z];
+                value |= static_cast<uint32_t>((data[offset + z] ^ ciphertext[offset + z]) & m) << shift;
+                word_mask |= static_cast<uint32_t>(m) << shift;
+              }
             }
+            pattern.values.emplace_back(value);
+            pattern.masks.emplace_back(word_mask);
+          }
+          // Trailing unmasked words don't need to be generated
+          while (!pattern.masks.empty() && !pattern.masks.back()) {
+            pattern.values.pop_back();
+            pattern.masks.pop_back();
           }
         }
-        return false;
+      }
+      PSOLFGSeedMatcher matcher(uses_v3_encryption(version), std::move(patterns));
+
+      // Each parallel_range job searches a block of 0x10000 seeds
+      uint64_t block_index = parallel_range<uint64_t>([&](uint64_t block_index, size_t) -> bool {
+        uint64_t start = block_index << 16;
+        return (matcher.find(start, start + 0x10000) < start + 0x10000);
       },
-          0, 0x100000000, num_threads);
+          0, 0x10000, num_threads);
+      uint64_t seed = (block_index < 0x10000)
+          ? matcher.find(block_index << 16, (block_index + 1) << 16)
+          : 0x100000000;
 
       if (seed < 0x100000000) {
         log_info("Found seed %08" PRIX64, seed);
@@ -1131,6 +1198,45 @@ Action a_assemble_quest_script(
       write_output_data(args, result.data(), result.size(), compress ? "bin" : "bind");
     });
 
+Action a_index_quests(
+    "index-quests", "\
+  index-quests DIRECTORY\n\
+    Build a quest index from the quests in DIRECTORY, which must be laid out\n\
+    like system/quests (or like system/ep3/maps-download, if --ep3 is given).\n\
+    For each build, prints how many files and quest versions were reused from\n\
+    the previous build instead of being loaded again. The quest categories are read from the config file given by\n\
+    --config=FILENAME (default system/config.json). --threads=COUNT controls\n\
+    how many threads are used; by default, one thread per CPU core is used. If\n\
+    --modify=FILENAME is given, a newline is appended to that file (relative to\n\
+    DIRECTORY) after the index is built, and the index is built again, reusing\n\
+    the unchanged files and quests from the first index.\n",
+    +[](Arguments& args) {
+      const string& directory = args.get<string>(1);
+      bool is_ep3 = args.get<bool>("ep3");
+      string config_filename = args.get<string>("config", false);
+      size_t num_threads = args.get<size_t>("threads", 0);
+      string modify_filename = args.get<string>("modify", false);
+      if (config_filename.empty()) {
+        config_filename = "system/config.json";
+      }
+
+      auto config_json = JSON::parse(load_file(config_filename));
+      auto category_index = make_shared<QuestCategoryIndex>(config_json.at("QuestCategories"));
+
+      auto build_index = [&](shared_ptr<const QuestIndex> previous) -> shared_ptr<const QuestIndex> {
+        auto index = make_shared<QuestIndex>(directory, category_index, is_ep3, previous, num_threads);
+        fprintf(stdout, "%zu files reused\n%zu quest versions reused\n", index->num_files_reused, index->num_quests_reused);
+        return index;
+      };
+
+      auto index = build_index(nullptr);
+      if (!modify_filename.empty()) {
+        string path = directory + "/" + modify_filename;
+        save_file(path, load_file(path) + "\n");
+        build_index(index);
+      }
+    });
+
 Action a_assemble_all_patches(
     "assemble-all-patches", "\
   assemble-all-patches\n\
@@ -1831,18 +1937,31 @@ Action a_find_rare_enemy_seeds(
     affects which rare rates from config.json are used if --bb was given.\n\
     Similarly, --battle, --challenge, or --solo may also be given; this affects\n\
     which variations are used on all versions and which rare rates to use for\n\
-    BB. --threads=COUNT controls the number of threads to use for the search\n\
-    by default, one thread per CPU core is used. --min-count specifies how many\n\
-    rare enemies must be found to output the seed. Finally, --quest=NAME may be\n\
-    given to use that quest\'s map instead of the free-roam maps.\n",
+    BB. --event=NUMBER specifies the game event, which affects which rare\n\
+    enemies appear (the default is 0, for no event). --threads=COUNT controls\n\
+    the number of threads to use for the search; by default, one thread per\n\
+    CPU core is used. --min-count specifies how many rare enemies must be\n\
+    found to output the seed. --quest=NAME may be given to use that quest\'s\n\
+    map instead of the free-roam maps. Finally, --index=FILENAME writes all\n\
+    found seeds to a rare enemy seed index file, which the server can use to\n\
+    choose seeds for new games (see RareEnemySeedIndexes in\n\
+    config.example.json). The index records the event and rare enemy rates\n\
+    used, and the server won\'t use it if its configured rates differ. Indexes\n\
+    can only be made for free-roam maps. Use --min-count to keep the index to a\n\
+    reasonable size.\n",
     +[](Arguments& args) {
       auto version = get_cli_version(args);
       auto episode = get_cli_episode(args);
       auto difficulty = get_cli_difficulty(args);
       auto mode = get_cli_game_mode(args);
+      uint8_t event = args.get<uint8_t>("event", 0);
       size_t num_threads = args.get<size_t>("threads", 0);
       size_t min_count = args.get<size_t>("min-count", 1);
       string quest_name = args.get<string>("quest", false);
+      string index_filename = args.get<string>("index", false);
+      if (!quest_name.empty() && !index_filename.empty()) {
+        throw invalid_argument("--index cannot be used with --quest");
+      }
 
       ServerState s("system/config.json");
       shared_ptr<const VersionedQuest> vq;
@@ -1873,14 +1992,60 @@ Action a_find_rare_enemy_seeds(
         rare_rates = s.rare_enemy_rates_by_difficulty[difficulty];
       }
 
+      // Quests with random enemy sections can't be evaluated without parsing
+      // the map for each seed, so we use the much slower full map load for them
+      shared_ptr<const RareEnemySeedEvaluator> evaluator;
+      if (!vq) {
+        evaluator = make_shared<RareEnemySeedEvaluator>(
+            version,
+            episode,
+            mode,
+            difficulty,
+            event,
+            bind(&ServerState::load_map_file, &s, placeholders::_1, placeholders::_2),
+            rare_rates);
+      } else if (!vq->dat_contents_decompressed) {
+        throw runtime_error("quest does not have DAT data");
+      } else if (!Map::quest_data_has_random_enemies(vq->dat_contents_decompressed->data(), vq->dat_contents_decompressed->size())) {
+        evaluator = make_shared<RareEnemySeedEvaluator>(
+            version,
+            episode,
+            difficulty,
+            event,
+            vq->dat_contents_decompressed->data(),
+            vq->dat_contents_decompressed->size(),
+            rare_rates);
+      } else {
+        log_warning("Quest has random enemies; using slow search");
+      }
+
       mutex output_lock;
+      vector<RareEnemySeedIndex::Entry> index_entries;
+      vector<vector<RareEnemySeedEvaluator::RareEnemy>> thread_rares(num_threads ? num_threads : thread::hardware_concurrency());
+      auto fast_thread_fn = [&](uint64_t seed, size_t thread_num) -> bool {
+        auto& rares = thread_rares.at(thread_num);
+        evaluator->evaluate(seed, rares);
+        if (rares.size() >= min_count) {
+          lock_guard g(output_lock);
+          fprintf(stdout, "%08" PRIX64 ":", seed);
+          for (const auto& rare : rares) {
+            fprintf(stdout, " E-%zX:%s", rare.enemy_index, name_for_enum(rare.type));
+          }
+          fprintf(stdout, "\n");
+          if (!index_filename.empty()) {
+            index_entries.emplace_back(seed, rares);
+          }
+        }
+        return false;
+      };
+
       auto thread_fn = [&](uint64_t seed, size_t) -> bool {
         auto random_crypt = make_shared<PSOV2Encryption>(seed);
         parray<le_uint32_t, 0x20> variations;
 
         shared_ptr<Map> map;
         if (vq) {
-          map = Lobby::load_maps(version, episode, difficulty, 0, 0, rare_rates, random_crypt, vq);
+          map = Lobby::load_maps(version, episode, difficulty, event, 0, rare_rates, random_crypt, vq);
 
         } else {
           generate_variations(variations, random_crypt, version, episode, (mode == GameMode::SOLO));
@@ -1889,7 +2054,7 @@ Action a_find_rare_enemy_seeds(
               episode,
               mode,
               difficulty,
-              0,
+              event,
               0,
               bind(&ServerState::load_map_file, &s, placeholders::_1, placeholders::_2),
               rare_rates,
@@ -1916,7 +2081,123 @@ Action a_find_rare_enemy_seeds(
         return false;
       };
 
-      parallel_range<uint64_t>(thread_fn, 0, 0x100000000, num_threads, nullptr);
+      if (evaluator) {
+        parallel_range<uint64_t>(fast_thread_fn, 0, 0x100000000, num_threads, nullptr);
+      } else {
+        parallel_range<uint64_t>(thread_fn, 0, 0x100000000, num_threads, nullptr);
+      }
+
+      if (!index_filename.empty()) {
+        if (index_entries.size() > 0xFFFFFFFF) {
+          throw runtime_error("too many seeds found; use a larger --min-count");
+        }
+        sort(index_entries.begin(), index_entries.end(), [](const auto& a, const auto& b) -> bool {
+          return a.seed < b.seed;
+        });
+        save_file(index_filename, RareEnemySeedIndex::serialize(version, episode, mode, difficulty, event, *rare_rates, index_entries));
+        log_info("Wrote %zu seeds to %s", index_entries.size(), index_filename.c_str());
+      }
+    });
+
+Action a_check_rare_enemy_maps(
+    "check-rare-enemy-maps", "\
+  check-rare-enemy-maps OPTIONS...\n\
+    Build the free-roam maps for a sample of random seeds both from cached map\n\
+    templates (as the server does) and by parsing the map files directly, and\n\
+    check that the enemy lists and rare enemies match. Also checks that the\n\
+    rare enemies find-rare-enemy-seeds reports for each seed are the same as\n\
+    those in the maps. The version, episode, difficulty, and mode options are\n\
+    the same as for find-rare-enemy-seeds. --seeds=COUNT specifies how many\n\
+    seeds to check (default 256). A high rare enemy rate is used on BB so that\n\
+    most rare enemy checks succeed for some seed.\n",
+    +[](Arguments& args) {
+      auto version = get_cli_version(args);
+      auto episode = get_cli_episode(args);
+      auto difficulty = get_cli_difficulty(args);
+      auto mode = get_cli_game_mode(args);
+      size_t num_seeds = args.get<size_t>("seeds", 256);
+
+      ServerState s;
+      if (version == Version::PC_V2) {
+        s.load_objects_and_upstream_dependents("patch_indexes");
+      } else {
+        s.load_objects_and_upstream_dependents("map_file_caches");
+      }
+      auto get_file_data = bind(&ServerState::load_map_file, &s, placeholders::_1, placeholders::_2);
+      auto rare_rates = make_shared<Map::RareEnemyRates>(0x40000000, 0x40000000);
+      RareEnemySeedEvaluator evaluator(version, episode, mode, difficulty, 0, get_file_data, rare_rates);
+
+      size_t num_rares = 0;
+      vector<RareEnemySeedEvaluator::RareEnemy> evaluator_rares;
+      for (size_t z = 0; z < num_seeds; z++) {
+        uint32_t seed = z * 0x9E3779B9;
+        parray<le_uint32_t, 0x20> variations;
+
+        auto template_crypt = make_shared<PSOV2Encryption>(seed);
+        generate_variations(variations, template_crypt, version, episode, (mode == GameMode::SOLO));
+        auto template_map = Lobby::load_maps(
+            version, episode, mode, difficulty, 0, 0, get_file_data, rare_rates, template_crypt, variations);
+
+        auto direct_crypt = make_shared<PSOV2Encryption>(seed);
+        generate_variations(variations, direct_crypt, version, episode, (mode == GameMode::SOLO));
+        Map direct_map(version, 0, direct_crypt);
+        for (size_t floor = 0; (mode != GameMode::CHALLENGE) && (floor < 0x10); floor++) {
+          auto filenames = map_filenames_for_variation(
+              version, episode, mode, floor, variations[floor * 2], variations[floor * 2 + 1], true);
+          for (const string& filename : filenames) {
+            auto map_data = get_file_data(version, filename);
+            if (map_data) {
+              direct_map.add_enemies_from_map_data(
+                  episode, difficulty, 0, floor, map_data->data(), map_data->size(), rare_rates);
+              break;
+            }
+          }
+        }
+
+        if (template_map->enemies.size() != direct_map.enemies.size()) {
+          throw runtime_error(string_printf("seed %08" PRIX32 ": template map has %zu enemies; direct map has %zu enemies",
+              seed, template_map->enemies.size(), direct_map.enemies.size()));
+        }
+        for (size_t enemy_index = 0; enemy_index < direct_map.enemies.size(); enemy_index++) {
+          const auto& template_e = template_map->enemies[enemy_index];
+          const auto& direct_e = direct_map.enemies[enemy_index];
+          if ((template_e.type != direct_e.type) ||
+              (template_e.floor != direct_e.floor) ||
+              (template_e.source_index != direct_e.source_index)) {
+            string template_str = template_e.str();
+            string direct_str = direct_e.str();
+            throw runtime_error(string_printf("seed %08" PRIX32 ": E-%zX differs: template map has %s; direct map has %s",
+                seed, enemy_index, template_str.c_str(), direct_str.c_str()));
+          }
+          if (enemy_type_is_rare(direct_e.type)) {
+            num_rares++;
+          }
+        }
+        if (template_map->rare_enemy_indexes != direct_map.rare_enemy_indexes) {
+          throw runtime_error(string_printf("seed %08" PRIX32 ": rare enemy indexes differ", seed));
+        }
+
+        evaluator.evaluate(seed, evaluator_rares);
+        auto evaluator_it = evaluator_rares.begin();
+        for (size_t enemy_index = 0; enemy_index < direct_map.enemies.size(); enemy_index++) {
+          EnemyType type = direct_map.enemies[enemy_index].type;
+          if (!enemy_type_is_rare(type)) {
+            continue;
+          }
+          if ((evaluator_it == evaluator_rares.end()) ||
+              (evaluator_it->enemy_index != enemy_index) ||
+              (evaluator_it->type != type)) {
+            throw runtime_error(string_printf("seed %08" PRIX32 ": evaluator did not find rare enemy E-%zX:%s",
+                seed, enemy_index, name_for_enum(type)));
+          }
+          evaluator_it++;
+        }
+        if (evaluator_it != evaluator_rares.end()) {
+          throw runtime_error(string_printf("seed %08" PRIX32 ": evaluator found extra rare enemy E-%zX:%s",
+              seed, evaluator_it->enemy_index, name_for_enum(evaluator_it->type)));
+        }
+      }
+      log_info("Checked %zu seeds (%zu rare enemies); all maps match", num_seeds, num_rares);
     });
 
 Action a_parse_object_graph(
@@ -2094,6 +2375,19 @@ Action a_run_server_replay_log(
       auto state = make_shared<ServerState>(base, config_filename, is_replay);
       state->load_objects_and_downstream_dependents("all");
 
+      state->main_thread_calls = make_shared<CrossThreadCallQueue>(base);
+      if (!state->command_trace_options.filename.empty() && !is_replay) {
+        config_log.info("Writing command trace to %s", state->command_trace_options.filename.c_str());
+        command_trace = make_shared<CommandTrace>(state->command_trace_options);
+      }
+      if (state->event_loop_stats_enabled && !is_replay) {
+        event_loop_stats = make_shared<EventLoopStats>(base, state->event_loop_stats_options);
+      }
+      if (state->num_worker_threads && !is_replay) {
+        config_log.info("Starting %zu worker threads", state->num_worker_threads);
+        state->worker_pool = make_shared<WorkerPool>(state->num_worker_threads);
+      }
+
       shared_ptr<DNSServer> dns_server;
       if (state->dns_server_port && !is_replay) {
         if (!state->dns_server_addr.empty()) {
@@ -2107,6 +2401,13 @@ Action a_run_server_replay_log(
         config_log.info("DNS server is disabled");
       }
 
+      shared_ptr<MetricsServer> metrics_server;
+      if (state->metrics_server_port && !is_replay) {
+        config_log.info("Starting metrics server on port %hu", state->metrics_server_port);
+        metrics_server = make_shared<MetricsServer>(base, state);
+        metrics_server->listen(state->metrics_server_addr, state->metrics_server_port);
+      }
+
       shared_ptr<Shell> shell;
       shared_ptr<ReplaySession> replay_session;
       shared_ptr<IPStackSimulator> ip_stack_simulator;
@@ -2212,6 +2513,16 @@ Action a_run_server_replay_log(
       }
 
       config_log.info("Normal shutdown");
+      if (state->worker_pool) {
+        state->worker_pool->stop();
+      }
+      if (command_trace) {
+        uint64_t num_written = command_trace->records_written();
+        uint64_t num_dropped = command_trace->records_dropped();
+        config_log.info("Command trace: %" PRIu64 " records written, %" PRIu64 " dropped", num_written, num_dropped);
+        command_trace.reset();
+      }
+      event_loop_stats.reset();
       state->proxy_server.reset(); // Break reference cycle
     });
 
@@ -725,7 +725,25 @@ void Map::add_objects_from_map_data(uint8_t floor, const void* data, size_t size
   }
 }
 
+// See enemies_template for why this is needed
+static const array<uint32_t Map::RareEnemyRates::*, 8> rare_enemy_rate_fields = {
+    &Map::RareEnemyRates::hildeblue,
+    &Map::RareEnemyRates::rappy,
+    &Map::RareEnemyRates::nar_lily,
+    &Map::RareEnemyRates::pouilly_slime,
+    &Map::RareEnemyRates::merissa_aa,
+    &Map::RareEnemyRates::pazuzu,
+    &Map::RareEnemyRates::dorphon_eclair,
+    &Map::RareEnemyRates::kondrieu,
+};
+
 bool Map::check_and_log_rare_enemy(bool default_is_rare, uint32_t rare_rate) {
+  if (this->template_rare_enemy_checks) {
+    this->template_rare_enemy_checks->emplace_back(FloorTemplate::RareEnemyCheck{
+        this->enemies.size(), default_is_rare, rare_enemy_rate_fields.at(rare_rate), EnemyType::UNKNOWN, {}});
+    return default_is_rare || this->template_rare_enemy_result;
+  }
+
   if (default_is_rare) {
     return true;
   }
@@ -744,7 +762,7 @@ bool Map::check_and_log_rare_enemy(bool default_is_rare, uint32_t rare_rate) {
     // TODO: We only need the first value from this crypt, so it's unfortunate
     // that we have to initialize the entire thing. Find a way to make this
     // faster.
-    PSOV2Encryption crypt(this->random_crypt->seed() + 0x1000 + this->enemies.size());
+    PSOV2LFG crypt(this->random_crypt->seed() + 0x1000 + this->enemies.size());
     float det = (static_cast<float>((crypt.next() >> 16) & 0xFFFF) / 65536.0f);
     // On v1 and v2 (and GC NTE), the rare rate is 0.1% instead of 0.2%.
     float threshold = is_v1_or_v2(this->version) ? 0.001f : 0.002f;
@@ -1550,6 +1568,155 @@ void Map::add_enemies_and_objects_from_quest_data(
   }
 }
 
+shared_ptr<const Map::FloorTemplate> Map::objects_template(uint8_t floor, const void* data, size_t size) {
+  Map map(Version::UNKNOWN, 0, nullptr);
+  map.add_objects_from_map_data(floor, data, size);
+  auto ret = make_shared<FloorTemplate>();
+  ret->objects = std::move(map.objects);
+  return ret;
+}
+
+static shared_ptr<const Map::FloorTemplate> make_enemies_template(
+    Version version, function<void(Map&, shared_ptr<const Map::RareEnemyRates>)> add_enemies) {
+  // To find both the normal and rare type of each enemy that could be rare, we
+  // parse the map data twice: once as if no rare enemy checks succeed, and once
+  // as if all of them do. Each check is done immediately before the enemy it
+  // applies to is added, and the results of the checks only affect the enemy
+  // types (not the number of enemies), so the two results line up exactly. A
+  // check can also change the types of enemies added after it (for example,
+  // children of a parent enemy have the parent's type), so every enemy whose
+  // type differs between the two results is attributed to the most recent
+  // check before it. The rates passed in are the indexes of the rate fields,
+  // so that the recorded checks can refer to the correct field when the
+  // template is used.
+  auto index_rates = make_shared<Map::RareEnemyRates>(0, 0);
+  for (size_t z = 0; z < rare_enemy_rate_fields.size(); z++) {
+    (*index_rates).*rare_enemy_rate_fields[z] = z;
+  }
+
+  vector<Map::FloorTemplate::RareEnemyCheck> normal_checks;
+  Map normal_map(version, 0, nullptr);
+  normal_map.template_rare_enemy_checks = &normal_checks;
+  normal_map.template_rare_enemy_result = false;
+  add_enemies(normal_map, index_rates);
+
+  vector<Map::FloorTemplate::RareEnemyCheck> rare_checks;
+  Map rare_map(version, 0, nullptr);
+  rare_map.template_rare_enemy_checks = &rare_checks;
+  rare_map.template_rare_enemy_result = true;
+  add_enemies(rare_map, index_rates);
+
+  if ((normal_map.enemies.size() != rare_map.enemies.size()) || (normal_checks.size() != rare_checks.size())) {
+    throw logic_error("rare enemy checks changed the enemy list structure");
+  }
+  for (size_t z = 0; z < normal_checks.size(); z++) {
+    auto& check = normal_checks[z];
+    if (check.enemy_index != rare_checks[z].enemy_index) {
+      throw logic_error("rare enemy checks changed the enemy list structure");
+    }
+    check.rare_type = rare_map.enemies.at(check.enemy_index).type;
+  }
+  size_t num_checks_before = 0;
+  for (size_t z = 0; z < normal_map.enemies.size(); z++) {
+    while ((num_checks_before < normal_checks.size()) && (normal_checks[num_checks_before].enemy_index <= z)) {
+      num_checks_before++;
+    }
+    EnemyType rare_type = rare_map.enemies[z].type;
+    if (rare_type == normal_map.enemies[z].type) {
+      continue;
+    }
+    if (num_checks_before == 0) {
+      throw logic_error("enemy type changed without a rare enemy check");
+    }
+    auto& check = normal_checks[num_checks_before - 1];
+    if (check.enemy_index != z) {
+      check.other_rare_types.emplace_back(z, rare_type);
+    }
+  }
+
+  auto ret = make_shared<Map::FloorTemplate>();
+  ret->enemies = std::move(normal_map.enemies);
+  ret->rare_enemy_checks = std::move(normal_checks);
+  return ret;
+}
+
+shared_ptr<const Map::FloorTemplate> Map::enemies_template(
+    Version version,
+    Episode episode,
+    uint8_t difficulty,
+    uint8_t event,
+    uint8_t floor,
+    const void* data,
+    size_t size) {
+  return make_enemies_template(version, [&](Map& map, shared_ptr<const RareEnemyRates> rare_rates) -> void {
+    map.add_enemies_from_map_data(episode, difficulty, event, floor, data, size, rare_rates);
+  });
+}
+
+bool Map::quest_data_has_random_enemies(const void* data, size_t size) {
+  for (const auto& floor_sections : Map::collect_quest_map_data_sections(data, size)) {
+    if ((floor_sections.enemies == 0xFFFFFFFF) &&
+        (floor_sections.wave_events != 0xFFFFFFFF) &&
+        (floor_sections.random_enemy_locations != 0xFFFFFFFF) &&
+        (floor_sections.random_enemy_definitions != 0xFFFFFFFF)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+shared_ptr<const Map::FloorTemplate> Map::quest_enemies_template(
+    Version version,
+    Episode episode,
+    uint8_t difficulty,
+    uint8_t event,
+    const void* data,
+    size_t size) {
+  if (Map::quest_data_has_random_enemies(data, size)) {
+    throw runtime_error("quest map data contains random enemy sections");
+  }
+  // This also adds the objects to each map, but make_enemies_template ignores
+  // them
+  return make_enemies_template(version, [&](Map& map, shared_ptr<const RareEnemyRates> rare_rates) -> void {
+    map.add_enemies_and_objects_from_quest_data(episode, difficulty, event, data, size, rare_rates);
+  });
+}
+
+void Map::add_from_template(const FloorTemplate& t, shared_ptr<const RareEnemyRates> rare_rates) {
+  for (const auto& obj : t.objects) {
+    uint16_t object_id = this->objects.size();
+    this->objects.emplace_back(obj).object_id = object_id;
+  }
+
+  // The checks must be done in the same order (and with the same number of
+  // enemies already present) as when parsing the map data directly, but they
+  // can also affect enemies after the current one, so those are changed after
+  // all the enemies are added
+  size_t base_index = this->enemies.size();
+  vector<const FloorTemplate::RareEnemyCheck*> succeeded_checks;
+  auto check_it = t.rare_enemy_checks.begin();
+  for (size_t z = 0; z < t.enemies.size(); z++) {
+    const auto& e = t.enemies[z];
+    EnemyType type = e.type;
+    if ((check_it != t.rare_enemy_checks.end()) && (check_it->enemy_index == z)) {
+      if (this->check_and_log_rare_enemy(check_it->default_is_rare, (*rare_rates).*(check_it->rate))) {
+        type = check_it->rare_type;
+        if (!check_it->other_rare_types.empty()) {
+          succeeded_checks.emplace_back(&*check_it);
+        }
+      }
+      check_it++;
+    }
+    uint16_t enemy_id = this->enemies.size();
+    this->enemies.emplace_back(enemy_id, e.source_index, e.floor, type);
+  }
+  for (const auto* check : succeeded_checks) {
+    for (const auto& [enemy_index, rare_type] : check->other_rare_types) {
+      this->enemies[base_index + enemy_index].type = rare_type;
+    }
+  }
+}
+
 const Map::Enemy& Map::find_enemy(uint8_t floor, EnemyType type) const {
   return const_cast<Map*>(this)->find_enemy(floor, type);
 }
@@ -2014,5 +2181,195 @@ vector<string> map_filenames_for_variation(
   return ret;
 }
 
+RareEnemySeedEvaluator::RareEnemySeedEvaluator(
+    Version version,
+    Episode episode,
+    GameMode mode,
+    uint8_t difficulty,
+    uint8_t event,
+    function<shared_ptr<const string>(Version, const string&)> get_file_data,
+    shared_ptr<const Map::RareEnemyRates> rare_rates)
+    : version(version) {
+  this->init_non_bb_rare_limit();
+
+  // Like Lobby::load_maps, there are no free-roam enemies in Challenge mode.
+  // The variations are still drawn, though, so the floors must still be
+  // present here.
+  this->floors.resize(0x10);
+  for (size_t floor = 0; floor < 0x10; floor++) {
+    auto& f = this->floors[floor];
+    const auto& a = file_info_for_variation(version, episode, floor, (mode == GameMode::SOLO));
+    if (!a.name_token) {
+      continue;
+    }
+    f.num_variation1 = a.variation1_values.size();
+    f.num_variation2 = a.variation2_values.size();
+    if (mode == GameMode::CHALLENGE) {
+      continue;
+    }
+
+    size_t num_var1 = max<size_t>(f.num_variation1, 1);
+    size_t num_var2 = max<size_t>(f.num_variation2, 1);
+    for (size_t var1 = 0; var1 < num_var1; var1++) {
+      for (size_t var2 = 0; var2 < num_var2; var2++) {
+        auto filenames = map_filenames_for_variation(version, episode, mode, floor, var1, var2, true);
+        if (filenames.empty()) {
+          f.templates.emplace_back();
+          continue;
+        }
+        shared_ptr<const Map::FloorTemplate> t;
+        for (const string& filename : filenames) {
+          auto map_data = get_file_data(version, filename);
+          if (map_data) {
+            t = Map::enemies_template(version, episode, difficulty, event, floor, map_data->data(), map_data->size());
+            break;
+          }
+        }
+        if (!t) {
+          throw runtime_error(string_printf("no enemy maps loaded for floor %zu", floor));
+        }
+        f.templates.emplace_back(this->prepare_template(*t, *rare_rates));
+      }
+    }
+  }
+}
+
+RareEnemySeedEvaluator::RareEnemySeedEvaluator(
+    Version version,
+    Episode episode,
+    uint8_t difficulty,
+    uint8_t event,
+    const void* dat_data,
+    size_t dat_size,
+    shared_ptr<const Map::RareEnemyRates> rare_rates)
+    : version(version) {
+  this->init_non_bb_rare_limit();
+  auto t = Map::quest_enemies_template(version, episode, difficulty, event, dat_data, dat_size);
+  this->floors.resize(1);
+  this->floors[0].templates.emplace_back(this->prepare_template(*t, *rare_rates));
+}
+
+void RareEnemySeedEvaluator::init_non_bb_rare_limit() {
+  // The client's check is (float((value >> 16) & 0xFFFF) / 65536.0f) <
+  // threshold (see Map::check_and_log_rare_enemy). There are only 0x10000
+  // possible inputs, so we find the first one for which the check fails and
+  // compare against it as an integer instead.
+  float threshold = is_v1_or_v2(this->version) ? 0.001f : 0.002f;
+  uint32_t limit = 0;
+  while ((limit < 0x10000) && (static_cast<float>(limit) / 65536.0f < threshold)) {
+    limit++;
+  }
+  this->non_bb_rare_limit = limit;
+}
+
+RareEnemySeedEvaluator::PreparedTemplate RareEnemySeedEvaluator::prepare_template(
+    const Map::FloorTemplate& t, const Map::RareEnemyRates& rare_rates) {
+  PreparedTemplate ret;
+  ret.num_enemies = t.enemies.size();
+  // The enemies in each check's other_rare_types are all after that check's
+  // enemy and before the next check's enemy (see make_enemies_template), so
+  // they can be merged in order with the checks
+  auto check_it = t.rare_enemy_checks.begin();
+  const vector<pair<size_t, EnemyType>>* other_rare_types = nullptr;
+  size_t other_rare_types_offset = 0;
+  for (size_t z = 0; z < t.enemies.size(); z++) {
+    EnemyType type = t.enemies[z].type;
+    if ((check_it != t.rare_enemy_checks.end()) && (check_it->enemy_index == z)) {
+      ret.candidates.emplace_back(Candidate{
+          .enemy_index = z,
+          .has_check = true,
+          .follows_previous_check = false,
+          .default_is_rare = check_it->default_is_rare,
+          .rare_rate = rare_rates.*(check_it->rate),
+          .normal_type = type,
+          .rare_type = check_it->rare_type,
+      });
+      other_rare_types = &check_it->other_rare_types;
+      other_rare_types_offset = 0;
+      check_it++;
+    } else if (other_rare_types &&
+        (other_rare_types_offset < other_rare_types->size()) &&
+        ((*other_rare_types)[other_rare_types_offset].first == z)) {
+      ret.candidates.emplace_back(Candidate{
+          .enemy_index = z,
+          .has_check = false,
+          .follows_previous_check = true,
+          .default_is_rare = false,
+          .rare_rate = 0,
+          .normal_type = type,
+          .rare_type = (*other_rare_types)[other_rare_types_offset].second,
+      });
+      other_rare_types_offset++;
+    } else if (enemy_type_is_rare(type)) {
+      ret.candidates.emplace_back(Candidate{
+          .enemy_index = z,
+          .has_check = false,
+          .follows_previous_check = false,
+          .default_is_rare = true,
+          .rare_rate = 0,
+          .normal_type = type,
+          .rare_type = type,
+      });
+    }
+  }
+  return ret;
+}
+
+void RareEnemySeedEvaluator::evaluate(uint32_t seed, vector<RareEnemy>& ret) const {
+  ret.clear();
+
+  // The variations are drawn from the same generator as the BB rare enemy
+  // checks, before any of the checks are done (see generate_variations)
+  PSOV2LFG crypt(seed);
+  array<size_t, 0x10> template_indexes;
+  for (size_t floor = 0; floor < this->floors.size(); floor++) {
+    const auto& f = this->floors[floor];
+    size_t var1 = (f.num_variation1 <= 1) ? 0 : (crypt.next() % f.num_variation1);
+    size_t var2 = (f.num_variation2 <= 1) ? 0 : (crypt.next() % f.num_variation2);
+    template_indexes[floor] = var1 * max<size_t>(f.num_variation2, 1) + var2;
+  }
+
+  size_t num_bb_rares = 0;
+  size_t base_index = 0;
+  for (size_t floor = 0; floor < this->floors.size(); floor++) {
+    const auto& f = this->floors[floor];
+    if (f.templates.empty()) {
+      continue;
+    }
+    const auto& t = f.templates[template_indexes[floor]];
+    bool previous_check_succeeded = false;
+    for (const auto& c : t.candidates) {
+      size_t enemy_index = base_index + c.enemy_index;
+      EnemyType type = c.normal_type;
+      // This must match Map::check_and_log_rare_enemy and
+      // Map::add_from_template
+      if (c.follows_previous_check) {
+        if (previous_check_succeeded) {
+          type = c.rare_type;
+        }
+      } else if (!c.has_check) {
+        // The enemy is always rare; there's nothing to check
+      } else if (c.default_is_rare) {
+        previous_check_succeeded = true;
+      } else if (this->version == Version::BB_V4) {
+        previous_check_succeeded = (num_bb_rares < 0x10) && (crypt.next() < c.rare_rate);
+        if (previous_check_succeeded) {
+          num_bb_rares++;
+        }
+      } else {
+        PSOV2LFG enemy_crypt(seed + 0x1000 + enemy_index);
+        previous_check_succeeded = (((enemy_crypt.next() >> 16) & 0xFFFF) < this->non_bb_rare_limit);
+      }
+      if (c.has_check && previous_check_succeeded) {
+        type = c.rare_type;
+      }
+      if (enemy_type_is_rare(type)) {
+        ret.emplace_back(RareEnemy{enemy_index, type});
+      }
+    }
+    base_index += t.num_enemies;
+  }
+}
+
 const shared_ptr<const Map::RareEnemyRates> Map::NO_RARE_ENEMIES = make_shared<Map::RareEnemyRates>(0, 0);
 const shared_ptr<const Map::RareEnemyRates> Map::DEFAULT_RARE_ENEMIES = make_shared<Map::RareEnemyRates>(0x0083126E, 0x1999999A);
@@ -2,6 +2,7 @@
 
 #include <inttypes.h>
 
+#include <functional>
 #include <memory>
 #include <phosg/Encoding.hh>
 #include <phosg/JSON.hh>
@@ -243,8 +244,8 @@ struct Map {
   } __attribute__((packed));
 
   struct DATParserRandomState {
-    PSOV2Encryption random;
-    PSOV2Encryption location_table_random;
+    PSOV2LFG random;
+    PSOV2LFG location_table_random;
     std::array<uint32_t, 0x20> location_index_table;
     uint32_t location_indexes_populated;
     uint32_t location_indexes_used;
@@ -308,6 +309,50 @@ struct Map {
       size_t size,
       std::shared_ptr<const RareEnemyRates> rare_rates = Map::DEFAULT_RARE_ENEMIES);
 
+  // A parsed object or enemy list for one floor. Templates don't depend on
+  // any particular game, so they can be cached and added to many maps without
+  // parsing the map file again for each one. Rare enemies are not chosen until
+  // a template is added to a map (via add_from_template), so the result is the
+  // same as if the map file had been parsed for that map directly.
+  struct FloorTemplate {
+    struct RareEnemyCheck {
+      size_t enemy_index; // Index into enemies
+      bool default_is_rare;
+      uint32_t RareEnemyRates::* rate;
+      EnemyType rare_type;
+      // Other enemies whose types change if this check succeeds (for example,
+      // the children of a rare parent), as (index into enemies, rare type)
+      std::vector<std::pair<size_t, EnemyType>> other_rare_types;
+    };
+    std::vector<Object> objects;
+    std::vector<Enemy> enemies; // Types here are the non-rare types
+    std::vector<RareEnemyCheck> rare_enemy_checks; // Sorted by enemy_index
+  };
+  static std::shared_ptr<const FloorTemplate> objects_template(uint8_t floor, const void* data, size_t size);
+  static std::shared_ptr<const FloorTemplate> enemies_template(
+      Version version,
+      Episode episode,
+      uint8_t difficulty,
+      uint8_t event,
+      uint8_t floor,
+      const void* data,
+      size_t size);
+  // Returns true if any floor in the quest's map data uses random enemy
+  // sections instead of a fixed enemy list
+  static bool quest_data_has_random_enemies(const void* data, size_t size);
+  // Like enemies_template, but for all floors in a quest's map data. The
+  // enemies on random enemy floors depend on the game's random seed, so this
+  // throws if the quest has any.
+  static std::shared_ptr<const FloorTemplate> quest_enemies_template(
+      Version version,
+      Episode episode,
+      uint8_t difficulty,
+      uint8_t event,
+      const void* data,
+      size_t size);
+  void add_from_template(
+      const FloorTemplate& t, std::shared_ptr<const RareEnemyRates> rare_rates = DEFAULT_RARE_ENEMIES);
+
   const Enemy& find_enemy(uint8_t floor, EnemyType type) const;
   Enemy& find_enemy(uint8_t floor, EnemyType type);
 
@@ -319,6 +364,10 @@ struct Map {
   std::vector<Object> objects;
   std::vector<Enemy> enemies;
   std::vector<size_t> rare_enemy_indexes;
+
+  // Used only while building a FloorTemplate (see enemies_template)
+  std::vector<FloorTemplate::RareEnemyCheck>* template_rare_enemy_checks = nullptr;
+  bool template_rare_enemy_result = false;
 };
 
 // TODO: This class is currently unused. It would be nice if we could use this
@@ -361,3 +410,73 @@ std::vector<parray<le_uint32_t, 0x20>> generate_all_possible_variations(
 
 std::vector<std::string> map_filenames_for_variation(
     Version version, Episode episode, GameMode mode, uint8_t floor, uint32_t var1, uint32_t var2, bool is_enemies);
+
+// Finds the rare enemies that a game with a given random seed would have,
+// without constructing a Map. All map files are parsed in the constructor, so
+// evaluating a seed only requires drawing the variations and doing the rare
+// enemy checks. The results are the same as those from Lobby::load_maps with
+// the same parameters.
+class RareEnemySeedEvaluator {
+public:
+  struct RareEnemy {
+    size_t enemy_index;
+    EnemyType type;
+  };
+
+  // Evaluates the free-roam maps for the given game parameters
+  RareEnemySeedEvaluator(
+      Version version,
+      Episode episode,
+      GameMode mode,
+      uint8_t difficulty,
+      uint8_t event,
+      std::function<std::shared_ptr<const std::string>(Version, const std::string&)> get_file_data,
+      std::shared_ptr<const Map::RareEnemyRates> rare_rates);
+  // Evaluates a quest's map. Throws if the quest has random enemy sections
+  // (see Map::quest_data_has_random_enemies).
+  RareEnemySeedEvaluator(
+      Version version,
+      Episode episode,
+      uint8_t difficulty,
+      uint8_t event,
+      const void* dat_data,
+      size_t dat_size,
+      std::shared_ptr<const Map::RareEnemyRates> rare_rates);
+
+  // Replaces the contents of ret with the rare enemies for the given seed, in
+  // order of enemy index
+  void evaluate(uint32_t seed, std::vector<RareEnemy>& ret) const;
+
+private:
+  // An enemy that is either subject to a rare check, rare if the preceding
+  // check succeeded (e.g. a child of a parent with a check), or always rare
+  struct Candidate {
+    size_t enemy_index; // Relative to the start of the template
+    bool has_check;
+    bool follows_previous_check;
+    bool default_is_rare;
+    uint32_t rare_rate;
+    EnemyType normal_type;
+    EnemyType rare_type;
+  };
+  struct PreparedTemplate {
+    size_t num_enemies = 0;
+    std::vector<Candidate> candidates;
+  };
+  struct Floor {
+    // Variation counts of 0 or 1 don't consume a random value (as in
+    // generate_variations)
+    size_t num_variation1 = 0;
+    size_t num_variation2 = 0;
+    // Indexed as [var1 * max(num_variation2, 1) + var2]. Empty if the floor
+    // has no enemy maps.
+    std::vector<PreparedTemplate> templates;
+  };
+
+  Version version;
+  uint32_t non_bb_rare_limit;
+  std::vector<Floor> floors;
+
+  void init_non_bb_rare_limit();
+  static PreparedTemplate prepare_template(const Map::FloorTemplate& t, const Map::RareEnemyRates& rare_rates);
+};
@@ -0,0 +1,192 @@
+#include "Metrics.hh"
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <event2/util.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <array>
+#include <phosg/Network.hh>
+#include <phosg/Strings.hh>
+
+#include "CommandTrace.hh"
+#include "EventLoopStats.hh"
+#include "ServerState.hh"
+
+using namespace std;
+
+Metrics metrics;
+
+TrafficCounters::TrafficCounters(const string& port_name, uint16_t port)
+    : port_name(port_name),
+      port(port) {}
+
+TrafficCounters* Metrics::traffic_counters_for_port(const string& port_name, uint16_t port) {
+  lock_guard<mutex> g(this->traffic_counters_lock);
+  auto& ret = this->traffic_counters[port];
+  if (!ret) {
+    ret = make_unique<TrafficCounters>(port_name, port);
+  }
+  return ret.get();
+}
+
+static void add_metric_header(string& ret, const char* name, const char* type, const char* help) {
+  ret += string_printf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void add_metric(string& ret, const char* name, const char* type, const char* help, uint64_t value) {
+  add_metric_header(ret, name, type, help);
+  ret += string_printf("%s %" PRIu64 "\n", name, value);
+}
+
+static void add_metric(string& ret, const char* name, const char* type, const char* help, double value) {
+  add_metric_header(ret, name, type, help);
+  ret += string_printf("%s %g\n", name, value);
+}
+
+// Label values may contain any characters, but backslashes, double quotes,
+// and newlines must be escaped in the text format
+static string escape_label_value(const string& value) {
+  string ret;
+  for (char ch : value) {
+    if (ch == '\\') {
+      ret += "\\\\";
+    } else if (ch == '"') {
+      ret += "\\\"";
+    } else if (ch == '\n') {
+      ret += "\\n";
+    } else {
+      ret.push_back(ch);
+    }
+  }
+  return ret;
+}
+
+string Metrics::prometheus_text() {
+  string ret;
+  add_metric(ret, "newserv_clients_connected_total", "counter",
+      "Number of client connections accepted", this->clients_connected.load());
+  add_metric(ret, "newserv_clients_disconnected_total", "counter",
+      "Number of client connections closed", this->clients_disconnected.load());
+  add_metric(ret, "newserv_item_drop_checks_total", "counter",
+      "Number of server-side item drop checks", this->item_drop_checks.load());
+  add_metric(ret, "newserv_bb_saves_total", "counter",
+      "Number of times BB player data was saved", this->bb_saves.load());
+  add_metric(ret, "newserv_bb_save_seconds_total", "counter",
+      "Total time spent saving BB player data", static_cast<double>(this->bb_save_usecs.load()) / 1000000.0);
+  add_metric(ret, "newserv_prs_compressions_total", "counter",
+      "Number of PRS compression operations", this->prs_compressions.load());
+  add_metric(ret, "newserv_prs_compress_input_bytes_total", "counter",
+      "Total size of data compressed with PRS", this->prs_compress_input_bytes.load());
+  add_metric(ret, "newserv_prs_compress_seconds_total", "counter",
+      "Total time spent in PRS compression", static_cast<double>(this->prs_compress_usecs.load()) / 1000000.0);
+  add_metric(ret, "newserv_quest_files_sent_total", "counter",
+      "Number of quest files sent to clients", this->quest_files_sent.load());
+  add_metric(ret, "newserv_download_quest_cache_hits_total", "counter",
+      "Number of download quest requests served from the cache", this->download_quest_cache_hits.load());
+  add_metric(ret, "newserv_download_quest_cache_misses_total", "counter",
+      "Number of download quests generated", this->download_quest_cache_misses.load());
+
+  lock_guard<mutex> g(this->traffic_counters_lock);
+  static const struct {
+    const char* name;
+    const char* help;
+    atomic<uint64_t> TrafficCounters::* field;
+  } traffic_fields[] = {
+      {"newserv_commands_received_total", "Number of commands received from clients", &TrafficCounters::commands_received},
+      {"newserv_received_bytes_total", "Number of bytes received from clients", &TrafficCounters::bytes_received},
+      {"newserv_commands_sent_total", "Number of commands sent to clients", &TrafficCounters::commands_sent},
+      {"newserv_sent_bytes_total", "Number of bytes sent to clients", &TrafficCounters::bytes_sent},
+  };
+  for (const auto& field : traffic_fields) {
+    add_metric_header(ret, field.name, "counter", field.help);
+    for (const auto& it : this->traffic_counters) {
+      const auto& tc = *it.second;
+      ret += string_printf("%s{port=\"%hu\",name=\"%s\"} %" PRIu64 "\n",
+          field.name, tc.port, escape_label_value(tc.port_name).c_str(), (tc.*field.field).load());
+    }
+  }
+  return ret;
+}
+
+MetricsServer::MetricsServer(shared_ptr<struct event_base> base, shared_ptr<ServerState> state)
+    : base(base),
+      state(state),
+      http(evhttp_new(base.get()), evhttp_free) {
+  evhttp_set_allowed_methods(this->http.get(), EVHTTP_REQ_GET);
+  evhttp_set_cb(this->http.get(), "/metrics", &MetricsServer::dispatch_on_request, this);
+}
+
+void MetricsServer::listen(const string& addr, int port) {
+  int fd = ::listen(addr, port, SOMAXCONN);
+  evutil_make_socket_nonblocking(fd);
+  if (!evhttp_accept_socket_with_handle(this->http.get(), fd)) {
+    close(fd);
+    throw runtime_error("cannot accept connections on metrics socket");
+  }
+}
+
+string MetricsServer::prometheus_text() const {
+  string ret = metrics.prometheus_text();
+
+  array<size_t, NUM_VERSIONS> clients_by_version = {};
+  for (const auto& it : this->state->channel_to_client) {
+    clients_by_version[static_cast<size_t>(it.second->version())]++;
+  }
+  add_metric_header(ret, "newserv_clients", "gauge", "Number of connected clients");
+  for (size_t v = 0; v < NUM_VERSIONS; v++) {
+    ret += string_printf("newserv_clients{version=\"%s\"} %zu\n",
+        name_for_enum(static_cast<Version>(v)), clients_by_version[v]);
+  }
+
+  size_t num_lobbies = 0;
+  size_t num_games = 0;
+  for (const auto& it : this->state->id_to_lobby) {
+    if (it.second->is_game()) {
+      num_games++;
+    } else {
+      num_lobbies++;
+    }
+  }
+  add_metric(ret, "newserv_lobbies", "gauge", "Number of lobbies (not including games)", num_lobbies);
+  add_metric(ret, "newserv_games", "gauge", "Number of games", num_games);
+
+  uint64_t download_quest_cache_bytes = 0;
+  for (const auto& index : {this->state->default_quest_index, this->state->ep3_download_quest_index}) {
+    if (index) {
+      download_quest_cache_bytes += index->download_quest_cache_bytes();
+    }
+  }
+  add_metric(ret, "newserv_download_quest_cache_bytes", "gauge",
+      "Total size of cached download quest files", download_quest_cache_bytes);
+
+  if (event_loop_stats) {
+    const auto& lag = event_loop_stats->get_loop_lag();
+    add_metric_header(ret, "newserv_event_loop_lag_seconds", "summary", "Delay in running event loop timers");
+    ret += string_printf("newserv_event_loop_lag_seconds_sum %g\n", static_cast<double>(lag.total_usecs) / 1000000.0);
+    ret += string_printf("newserv_event_loop_lag_seconds_count %" PRIu64 "\n", lag.count);
+  }
+
+  if (command_trace) {
+    add_metric(ret, "newserv_command_trace_records_written_total", "counter",
+        "Number of records written to the command trace", command_trace->records_written());
+    add_metric(ret, "newserv_command_trace_records_dropped_total", "counter",
+        "Number of command trace records dropped because the trace buffer was full or the trace file could not be written",
+        command_trace->records_dropped());
+  }
+
+  return ret;
+}
+
+void MetricsServer::dispatch_on_request(struct evhttp_request* req, void* ctx) {
+  reinterpret_cast<MetricsServer*>(ctx)->on_request(req);
+}
+
+void MetricsServer::on_request(struct evhttp_request* req) {
+  string text = this->prometheus_text();
+  unique_ptr<struct evbuffer, void (*)(struct evbuffer*)> buf(evbuffer_new(), evbuffer_free);
+  evbuffer_add(buf.get(), text.data(), text.size());
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "text/plain; version=0.0.4");
+  evhttp_send_reply(req, 200, "OK", buf.get());
+}
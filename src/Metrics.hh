@@ -0,0 +1,88 @@
+#pragma once
+
+#include <event2/event.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+struct evhttp;
+struct evhttp_request;
+struct ServerState;
+
+// Traffic counters for all connections accepted on one port
+struct TrafficCounters {
+  std::string port_name;
+  uint16_t port;
+  std::atomic<uint64_t> commands_received = 0;
+  std::atomic<uint64_t> bytes_received = 0;
+  std::atomic<uint64_t> commands_sent = 0;
+  std::atomic<uint64_t> bytes_sent = 0;
+
+  TrafficCounters(const std::string& port_name, uint16_t port);
+};
+
+// Process-wide counters for monitoring. These are always enabled, so they
+// must be cheap to update: each is a relaxed atomic increment, since some of
+// them (e.g. PRS compression) are updated from worker threads. Values that can
+// be computed from the server's state (e.g. the number of connected clients)
+// are not counted here; MetricsServer computes them when it's queried.
+class Metrics {
+public:
+  std::atomic<uint64_t> clients_connected = 0;
+  std::atomic<uint64_t> clients_disconnected = 0;
+  std::atomic<uint64_t> item_drop_checks = 0;
+  std::atomic<uint64_t> bb_saves = 0;
+  std::atomic<uint64_t> bb_save_usecs = 0;
+  std::atomic<uint64_t> prs_compressions = 0;
+  std::atomic<uint64_t> prs_compress_input_bytes = 0;
+  std::atomic<uint64_t> prs_compress_usecs = 0;
+  std::atomic<uint64_t> quest_files_sent = 0;
+  std::atomic<uint64_t> download_quest_cache_hits = 0;
+  std::atomic<uint64_t> download_quest_cache_misses = 0;
+
+  static inline void add(std::atomic<uint64_t>& counter, uint64_t delta = 1) {
+    counter.fetch_add(delta, std::memory_order_relaxed);
+  }
+
+  // Returns the counters for the given port. The returned object is never
+  // deleted, so the pointer may be kept indefinitely.
+  TrafficCounters* traffic_counters_for_port(const std::string& port_name, uint16_t port);
+
+  // Returns all counters in Prometheus text exposition format
+  std::string prometheus_text();
+
+private:
+  std::mutex traffic_counters_lock;
+  std::map<uint16_t, std::unique_ptr<TrafficCounters>> traffic_counters;
+};
+
+extern Metrics metrics;
+
+// Serves the contents of metrics (and some values computed from the server's
+// state) over HTTP at /metrics, in Prometheus text format. This runs on the
+// main thread, since it reads ServerState.
+class MetricsServer {
+public:
+  MetricsServer(std::shared_ptr<struct event_base> base, std::shared_ptr<ServerState> state);
+  MetricsServer(const MetricsServer&) = delete;
+  MetricsServer(MetricsServer&&) = delete;
+  MetricsServer& operator=(const MetricsServer&) = delete;
+  MetricsServer& operator=(MetricsServer&&) = delete;
+  ~MetricsServer() = default;
+
+  void listen(const std::string& addr, int port);
+
+  std::string prometheus_text() const;
+
+private:
+  std::shared_ptr<struct event_base> base;
+  std::shared_ptr<ServerState> state;
+  std::unique_ptr<struct evhttp, void (*)(struct evhttp*)> http;
+
+  static void dispatch_on_request(struct evhttp_request* req, void* ctx);
+  void on_request(struct evhttp_request* req);
+};
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
 #include <phosg/Encoding.hh>
 #include <phosg/Random.hh>
 #include <phosg/Strings.hh>
@@ -18,106 +19,8 @@ void PSOEncryption::decrypt(void* data, size_t size, bool advance) {
   this->encrypt(data, size, advance);
 }
 
-PSOLFGEncryption::PSOLFGEncryption(
-    uint32_t seed, size_t stream_length, size_t end_offset)
-    : stream(stream_length, 0),
-      offset(0),
-      end_offset(end_offset),
-      initial_seed(seed),
-      cycles(0) {}
-
-uint32_t PSOLFGEncryption::next(bool advance) {
-  if (this->offset == this->end_offset) {
-    this->update_stream();
-  }
-  uint32_t ret = this->stream[this->offset];
-  if (advance) {
-    this->offset++;
-  }
-  return ret;
-}
-
-template <bool IsBigEndian>
-void PSOLFGEncryption::encrypt_t(void* vdata, size_t size, bool advance) {
-  using U32T = typename std::conditional<IsBigEndian, be_uint32_t, le_uint32_t>::type;
-
-  if (!advance && (size != 4)) {
-    throw logic_error("cannot peek-encrypt/decrypt with size > 4");
-  }
-
-  size_t uint32_count = size >> 2;
-  size_t extra_bytes = size & 3;
-  U32T* data = reinterpret_cast<U32T*>(vdata);
-  for (size_t x = 0; x < uint32_count; x++) {
-    data[x] ^= this->next(advance);
-  }
-  if (extra_bytes) {
-    U32T last = 0;
-    memcpy(&last, &data[uint32_count], extra_bytes);
-    last ^= this->next(advance);
-    memcpy(&data[uint32_count], &last, extra_bytes);
-  }
-}
-
-template <bool IsBigEndian>
-void PSOLFGEncryption::encrypt_minus_t(void* vdata, size_t size, bool advance) {
-  using U32T = typename std::conditional<IsBigEndian, be_uint32_t, le_uint32_t>::type;
-
-  if (!advance && (size != 4)) {
-    throw logic_error("cannot peek-encrypt/decrypt with size > 4");
-  }
-
-  size_t uint32_count = size >> 2;
-  size_t extra_bytes = size & 3;
-  U32T* data = reinterpret_cast<U32T*>(vdata);
-  for (size_t x = 0; x < uint32_count; x++) {
-    data[x] = this->next(advance) - data[x];
-  }
-  if (extra_bytes) {
-    U32T last = 0;
-    memcpy(&last, &data[uint32_count], extra_bytes);
-    last = this->next(advance) - last;
-    memcpy(&data[uint32_count], &last, extra_bytes);
-  }
-}
-
-void PSOLFGEncryption::encrypt(void* vdata, size_t size, bool advance) {
-  this->encrypt_t<false>(vdata, size, advance);
-}
-
-void PSOLFGEncryption::encrypt_big_endian(void* vdata, size_t size, bool advance) {
-  this->encrypt_t<true>(vdata, size, advance);
-}
-
-void PSOLFGEncryption::encrypt_minus(void* vdata, size_t size, bool advance) {
-  this->encrypt_minus_t<false>(vdata, size, advance);
-}
-
-void PSOLFGEncryption::encrypt_big_endian_minus(void* vdata, size_t size, bool advance) {
-  this->encrypt_minus_t<true>(vdata, size, advance);
-}
-
-void PSOLFGEncryption::encrypt_both_endian(
-    void* le_vdata, void* be_vdata, size_t size, bool advance) {
-  if (size & 3) {
-    throw invalid_argument("size must be a multiple of 4");
-  }
-  if (!advance && (size != 4)) {
-    throw logic_error("cannot peek-encrypt/decrypt with size > 4");
-  }
-  size >>= 2;
-
-  le_uint32_t* le_data = reinterpret_cast<le_uint32_t*>(le_vdata);
-  be_uint32_t* be_data = reinterpret_cast<be_uint32_t*>(be_vdata);
-  for (size_t x = 0; x < size; x++) {
-    uint32_t key = this->next(advance);
-    le_data[x] ^= key;
-    be_data[x] ^= key;
-  }
-}
-
-PSOV2Encryption::PSOV2Encryption(uint32_t seed)
-    : PSOLFGEncryption(seed, STREAM_LENGTH + 1, STREAM_LENGTH) {
+PSOV2LFG::PSOV2LFG(uint32_t seed)
+    : PSOLFG(seed) {
   uint32_t a = 1, b = this->initial_seed;
   this->stream[0x37] = b;
   for (uint16_t virtual_index = 0x15; virtual_index <= 0x36 * 0x15; virtual_index += 0x15) {
@@ -132,23 +35,26 @@ PSOV2Encryption::PSOV2Encryption(uint32_t seed)
   this->cycles = 0;
 }
 
-void PSOV2Encryption::update_stream() {
+void PSOV2LFG::update_stream() {
   for (size_t z = 1; z < 0x19; z++) {
     this->stream[z] -= this->stream[z + 0x1F];
   }
-  for (size_t z = 0x19; z < 0x38; z++) {
-    this->stream[z] -= this->stream[z - 0x18];
+  // Each word in the second phase depends on the word 0x18 words before it,
+  // which may have been updated earlier in the same phase. Processing the
+  // words in blocks of 0x18 makes each block's loop free of dependencies, so
+  // it can be vectorized.
+  for (size_t block_start = 0x19; block_start < 0x38; block_start += 0x18) {
+    size_t block_end = min<size_t>(block_start + 0x18, 0x38);
+    for (size_t z = block_start; z < block_end; z++) {
+      this->stream[z] -= this->stream[z - 0x18];
+    }
   }
   this->offset = 1;
   this->cycles++;
 }
 
-PSOEncryption::Type PSOV2Encryption::type() const {
-  return Type::V2;
-}
-
-PSOV3Encryption::PSOV3Encryption(uint32_t seed)
-    : PSOLFGEncryption(seed, STREAM_LENGTH, STREAM_LENGTH) {
+PSOV3LFG::PSOV3LFG(uint32_t seed)
+    : PSOLFG(seed) {
   uint32_t x, y, basekey, source1, source2, source3;
   basekey = 0;
 
@@ -181,20 +87,177 @@ PSOV3Encryption::PSOV3Encryption(uint32_t seed)
   this->cycles = 0;
 }
 
-void PSOV3Encryption::update_stream() {
+void PSOV3LFG::update_stream() {
   static constexpr size_t PHASE2_OFFSET = STREAM_LENGTH - 489;
   for (size_t z = 489; z < STREAM_LENGTH; z++) {
     this->stream[z - 489] ^= this->stream[z];
   }
-  for (size_t z = PHASE2_OFFSET; z < STREAM_LENGTH; z++) {
-    this->stream[z] ^= this->stream[z - PHASE2_OFFSET];
+  // As in PSOV2LFG::update_stream, process the second phase in blocks so
+  // each block's loop has no dependencies
+  for (size_t block_start = PHASE2_OFFSET; block_start < STREAM_LENGTH; block_start += PHASE2_OFFSET) {
+    size_t block_end = min<size_t>(block_start + PHASE2_OFFSET, STREAM_LENGTH);
+    for (size_t z = block_start; z < block_end; z++) {
+      this->stream[z] ^= this->stream[z - PHASE2_OFFSET];
+    }
   }
   this->offset = 0;
   this->cycles++;
 }
 
-PSOEncryption::Type PSOV3Encryption::type() const {
-  return Type::V3;
+// The seed matcher's key expansion functions are equivalent to the
+// PSOV2Encryption and PSOV3Encryption constructors and update_stream
+// functions, but operate on BATCH_SIZE interleaved states at once. update
+// computes only the first num_words words of the keystream; this is only
+// correct for the last round before the keystream is read, since the
+// remaining words would be needed for the following round.
+
+struct PSOV2SeedMatcherTraits {
+  static constexpr size_t LANES = PSOLFGSeedMatcher::BATCH_SIZE;
+  static constexpr size_t STATE_LENGTH = 0x39;
+  static constexpr size_t KEYSTREAM_OFFSET = 1;
+  static constexpr size_t WORDS_PER_ROUND = 0x37;
+  static constexpr size_t INITIAL_ROUNDS = 5;
+
+  static void expand_key(uint32_t (*state)[LANES], uint32_t first_seed) {
+    uint32_t a[LANES], b[LANES];
+    for (size_t l = 0; l < LANES; l++) {
+      a[l] = 1;
+      b[l] = first_seed + l;
+      state[0x37][l] = b[l];
+      state[0x38][l] = 0;
+    }
+    for (uint16_t virtual_index = 0x15; virtual_index <= 0x36 * 0x15; virtual_index += 0x15) {
+      uint32_t* dest = state[virtual_index % 0x37];
+      for (size_t l = 0; l < LANES; l++) {
+        dest[l] = a[l];
+        uint32_t c = b[l] - a[l];
+        b[l] = a[l];
+        a[l] = c;
+      }
+    }
+  }
+
+  static void update(uint32_t (*state)[LANES], size_t num_words) {
+    size_t end = num_words + 1;
+    for (size_t z = 1; z < min<size_t>(end, 0x19); z++) {
+      for (size_t l = 0; l < LANES; l++) {
+        state[z][l] -= state[z + 0x1F][l];
+      }
+    }
+    for (size_t z = 0x19; z < end; z++) {
+      for (size_t l = 0; l < LANES; l++) {
+        state[z][l] -= state[z - 0x18][l];
+      }
+    }
+  }
+};
+
+struct PSOV3SeedMatcherTraits {
+  static constexpr size_t LANES = PSOLFGSeedMatcher::BATCH_SIZE;
+  static constexpr size_t STATE_LENGTH = 521;
+  static constexpr size_t KEYSTREAM_OFFSET = 0;
+  static constexpr size_t WORDS_PER_ROUND = 521;
+  static constexpr size_t INITIAL_ROUNDS = 4;
+
+  static void expand_key(uint32_t (*state)[LANES], uint32_t first_seed) {
+    uint32_t seed[LANES], basekey[LANES];
+    for (size_t l = 0; l < LANES; l++) {
+      seed[l] = first_seed + l;
+      basekey[l] = 0;
+    }
+    for (size_t x = 0; x <= 16; x++) {
+      for (size_t y = 0; y < 32; y++) {
+        for (size_t l = 0; l < LANES; l++) {
+          seed[l] = seed[l] * 0x5D588B65 + 1;
+          basekey[l] = (basekey[l] >> 1) | (seed[l] & 0x80000000);
+        }
+      }
+      for (size_t l = 0; l < LANES; l++) {
+        state[x][l] = basekey[l];
+      }
+    }
+    for (size_t l = 0; l < LANES; l++) {
+      state[16][l] = ((state[0][l] >> 9) ^ (state[16][l] << 23)) ^ state[15][l];
+    }
+    for (size_t z = 17; z < STATE_LENGTH; z++) {
+      for (size_t l = 0; l < LANES; l++) {
+        state[z][l] = state[z - 1][l] ^ (((state[z - 17][l] << 23) & 0xFF800000) ^ ((state[z - 16][l] >> 9) & 0x007FFFFF));
+      }
+    }
+  }
+
+  static void update(uint32_t (*state)[LANES], size_t num_words) {
+    for (size_t z = 0; z < min<size_t>(num_words, 32); z++) {
+      for (size_t l = 0; l < LANES; l++) {
+        state[z][l] ^= state[z + 489][l];
+      }
+    }
+    for (size_t z = 32; z < num_words; z++) {
+      for (size_t l = 0; l < LANES; l++) {
+        state[z][l] ^= state[z - 32][l];
+      }
+    }
+  }
+};
+
+PSOLFGSeedMatcher::PSOLFGSeedMatcher(bool is_v3, vector<Pattern>&& patterns)
+    : is_v3(is_v3),
+      patterns(std::move(patterns)),
+      num_keystream_words(0) {
+  for (const auto& pattern : this->patterns) {
+    if (pattern.values.size() != pattern.masks.size()) {
+      throw logic_error("pattern values and masks are not the same length");
+    }
+    this->num_keystream_words = max<size_t>(this->num_keystream_words, pattern.values.size());
+  }
+}
+
+template <typename TraitsT>
+uint32_t PSOLFGSeedMatcher::match_batch(uint32_t first_seed, array<uint32_t, BATCH_SIZE>* keystream) const {
+  uint32_t state[TraitsT::STATE_LENGTH][BATCH_SIZE];
+  TraitsT::expand_key(state, first_seed);
+  for (size_t z = 1; z < TraitsT::INITIAL_ROUNDS; z++) {
+    TraitsT::update(state, TraitsT::WORDS_PER_ROUND);
+  }
+  for (size_t offset = 0; offset < this->num_keystream_words; offset += TraitsT::WORDS_PER_ROUND) {
+    size_t num_words = min<size_t>(this->num_keystream_words - offset, TraitsT::WORDS_PER_ROUND);
+    TraitsT::update(state, num_words);
+    for (size_t z = 0; z < num_words; z++) {
+      for (size_t l = 0; l < BATCH_SIZE; l++) {
+        keystream[offset + z][l] = state[TraitsT::KEYSTREAM_OFFSET + z][l];
+      }
+    }
+  }
+
+  static constexpr uint32_t ALL_LANES = (1 << BATCH_SIZE) - 1;
+  uint32_t ret = 0;
+  for (const auto& pattern : this->patterns) {
+    uint32_t remaining = ALL_LANES & ~ret;
+    for (size_t z = 0; remaining && (z < pattern.values.size()); z++) {
+      for (size_t l = 0; l < BATCH_SIZE; l++) {
+        remaining &= ~(static_cast<uint32_t>((keystream[z][l] & pattern.masks[z]) != pattern.values[z]) << l);
+      }
+    }
+    ret |= remaining;
+    if (ret == ALL_LANES) {
+      break;
+    }
+  }
+  return ret;
+}
+
+uint64_t PSOLFGSeedMatcher::find(uint64_t start, uint64_t end) const {
+  vector<array<uint32_t, BATCH_SIZE>> keystream(max<size_t>(this->num_keystream_words, 1));
+  for (uint64_t first_seed = start; first_seed < end; first_seed += BATCH_SIZE) {
+    uint32_t matches = this->is_v3
+        ? this->match_batch<PSOV3SeedMatcherTraits>(first_seed, keystream.data())
+        : this->match_batch<PSOV2SeedMatcherTraits>(first_seed, keystream.data());
+    if (matches) {
+      uint64_t seed = first_seed + __builtin_ctz(matches);
+      return (seed < end) ? seed : end;
+    }
+  }
+  return end;
 }
 
 PSOBBEncryption::PSOBBEncryption(
@@ -203,6 +266,64 @@ PSOBBEncryption::PSOBBEncryption(
   this->apply_seed(original_seed, seed_size);
 }
 
+// The STANDARD and MOCB1 ciphers encrypt each 8-byte block independently
+// (the key state doesn't change), so we process several blocks at once. Each
+// block's rounds form a long chain of dependent table lookups; interleaving
+// the blocks lets the CPU overlap those chains. Decryption is the same as
+// encryption, but with the initial keys in reverse order.
+template <size_t NumBlocks>
+static inline void bb_standard_crypt_blocks(
+    le_uint32_t* data, const parray<le_uint32_t, 0x400>& private_keys, const uint32_t* k) {
+  auto f = [&private_keys](uint32_t x) -> uint32_t {
+    return ((private_keys[(x >> 0x18)] +
+                private_keys[((x >> 0x10) & 0xFF) + 0x100]) ^
+               private_keys[((x >> 0x8) & 0xFF) + 0x200]) +
+        private_keys[(x & 0xFF) + 0x300];
+  };
+
+  uint32_t a[NumBlocks], b[NumBlocks];
+  for (size_t z = 0; z < NumBlocks; z++) {
+    a[z] = data[z * 2] ^ k[0];
+  }
+  for (size_t z = 0; z < NumBlocks; z++) {
+    b[z] = f(a[z]) ^ k[1] ^ data[z * 2 + 1];
+  }
+  for (size_t z = 0; z < NumBlocks; z++) {
+    a[z] ^= f(b[z]) ^ k[2];
+  }
+  for (size_t z = 0; z < NumBlocks; z++) {
+    b[z] ^= f(a[z]) ^ k[3];
+  }
+  for (size_t z = 0; z < NumBlocks; z++) {
+    a[z] ^= f(b[z]) ^ k[4];
+  }
+  for (size_t z = 0; z < NumBlocks; z++) {
+    data[z * 2] = b[z] ^ k[5];
+    data[z * 2 + 1] = a[z];
+  }
+}
+
+static void bb_standard_crypt(void* vdata, size_t size, const PSOBBEncryption::KeyFile& state, bool is_decrypt) {
+  if (size & 7) {
+    throw invalid_argument("size must be a multiple of 8");
+  }
+
+  uint32_t k[6];
+  for (size_t z = 0; z < 6; z++) {
+    k[z] = state.initial_keys.as32[is_decrypt ? (5 - z) : z];
+  }
+
+  le_uint32_t* data = reinterpret_cast<le_uint32_t*>(vdata);
+  size_t num_blocks = size >> 3;
+  size_t block_index = 0;
+  for (; block_index + 4 <= num_blocks; block_index += 4) {
+    bb_standard_crypt_blocks<4>(data + block_index * 2, state.private_keys.as32, k);
+  }
+  for (; block_index < num_blocks; block_index++) {
+    bb_standard_crypt_blocks<1>(data + block_index * 2, state.private_keys.as32, k);
+  }
+}
+
 void PSOBBEncryption::encrypt(void* vdata, size_t size, bool advance) {
   if (this->state.subtype == Subtype::TFS1) {
     if (size & 7) {
@@ -258,45 +379,7 @@ void PSOBBEncryption::encrypt(void* vdata, size_t size, bool advance) {
     }
 
   } else { // STANDARD or MOCB1
-    if (size & 7) {
-      throw invalid_argument("size must be a multiple of 8");
-    }
-
-    size_t num_dwords = size >> 2;
-    le_uint32_t* data = reinterpret_cast<le_uint32_t*>(vdata);
-    uint32_t edx, ebx, ebp, esi, edi;
-
-    edx = 0;
-    while (edx < num_dwords) {
-      ebx = data[edx] ^ this->state.initial_keys.as32[0];
-      ebp = ((this->state.private_keys.as32[(ebx >> 0x18)] +
-                 this->state.private_keys.as32[((ebx >> 0x10) & 0xFF) + 0x100]) ^
-                this->state.private_keys.as32[((ebx >> 0x8) & 0xFF) + 0x200]) +
-          this->state.private_keys.as32[(ebx & 0xFF) + 0x300];
-      ebp = ebp ^ this->state.initial_keys.as32[1];
-      ebp ^= data[edx + 1];
-      edi = ((this->state.private_keys.as32[(ebp >> 0x18)] +
-                 this->state.private_keys.as32[((ebp >> 0x10) & 0xFF) + 0x100]) ^
-                this->state.private_keys.as32[((ebp >> 0x8) & 0xFF) + 0x200]) +
-          this->state.private_keys.as32[(ebp & 0xFF) + 0x300];
-      edi = edi ^ this->state.initial_keys.as32[2];
-      ebx = ebx ^ edi;
-      esi = ((this->state.private_keys.as32[(ebx >> 0x18)] +
-                 this->state.private_keys.as32[((ebx >> 0x10) & 0xFF) + 0x100]) ^
-                this->state.private_keys.as32[((ebx >> 0x8) & 0xFF) + 0x200]) +
-          this->state.private_keys.as32[(ebx & 0xFF) + 0x300];
-      ebp = ebp ^ esi ^ this->state.initial_keys.as32[3];
-      edi = ((this->state.private_keys.as32[(ebp >> 0x18)] +
-                 this->state.private_keys.as32[((ebp >> 0x10) & 0xFF) + 0x100]) ^
-                this->state.private_keys.as32[((ebp >> 0x8) & 0xFF) + 0x200]) +
-          this->state.private_keys.as32[(ebp & 0xFF) + 0x300];
-      edi = edi ^ this->state.initial_keys.as32[4];
-      ebp = ebp ^ this->state.initial_keys.as32[5];
-      ebx = ebx ^ edi;
-      data[edx] = ebp;
-      data[edx + 1] = ebx;
-      edx += 2;
-    }
+    bb_standard_crypt(vdata, size, this->state, false);
   }
 }
 
@@ -354,45 +437,7 @@ void PSOBBEncryption::decrypt(void* vdata, size_t size, bool advance) {
     }
 
   } else { // STANDARD or MOCB1
-    if (size & 7) {
-      throw invalid_argument("size must be a multiple of 8");
-    }
-    size_t num_dwords = size >> 2;
-    le_uint32_t* dwords = reinterpret_cast<le_uint32_t*>(vdata);
-    uint32_t edx, ebx, ebp, esi, edi;
-
-    edx = 0;
-    while (edx < num_dwords) {
-      ebx = dwords[edx];
-      ebx = ebx ^ this->state.initial_keys.as32[5];
-      ebp = ((this->state.private_keys.as32[(ebx >> 0x18)] +
-                 this->state.private_keys.as32[((ebx >> 0x10) & 0xFF) + 0x100]) ^
-                this->state.private_keys.as32[((ebx >> 0x8) & 0xFF) + 0x200]) +
-          this->state.private_keys.as32[(ebx & 0xFF) + 0x300];
-      ebp = ebp ^ this->state.initial_keys.as32[4];
-      ebp ^= dwords[edx + 1];
-      edi = ((this->state.private_keys.as32[(ebp >> 0x18)] +
-                 this->state.private_keys.as32[((ebp >> 0x10) & 0xFF) + 0x100]) ^
-                this->state.private_keys.as32[((ebp >> 0x8) & 0xFF) + 0x200]) +
-          this->state.private_keys.as32[(ebp & 0xFF) + 0x300];
-      edi = edi ^ this->state.initial_keys.as32[3];
-      ebx = ebx ^ edi;
-      esi = ((this->state.private_keys.as32[(ebx >> 0x18)] +
-                 this->state.private_keys.as32[((ebx >> 0x10) & 0xFF) + 0x100]) ^
-                this->state.private_keys.as32[((ebx >> 0x8) & 0xFF) + 0x200]) +
-          this->state.private_keys.as32[(ebx & 0xFF) + 0x300];
-      ebp = ebp ^ esi ^ this->state.initial_keys.as32[2];
-      edi = ((this->state.private_keys.as32[(ebp >> 0x18)] +
-                 this->state.private_keys.as32[((ebp >> 0x10) & 0xFF) + 0x100]) ^
-                this->state.private_keys.as32[((ebp >> 0x8) & 0xFF) + 0x200]) +
-          this->state.private_keys.as32[(ebp & 0xFF) + 0x300];
-      edi = edi ^ this->state.initial_keys.as32[1];
-      ebp = ebp ^ this->state.initial_keys.as32[0];
-      ebx = ebx ^ edi;
-      dwords[edx] = ebp;
-      dwords[edx + 1] = ebx;
-      edx += 2;
-    }
+    bb_standard_crypt(vdata, size, this->state, true);
   }
 }
 
@@ -419,7 +464,7 @@ void PSOBBEncryption::tfs1_scramble(uint32_t* out1, uint32_t* out2) const {
   *out2 = this->state.initial_keys.as32[0x10] ^ a;
 }
 
-void PSOBBEncryption::apply_seed(const void* original_seed, size_t seed_size) {
+string PSOBBEncryption::transform_seed(const void* original_seed, size_t seed_size) {
   // Note: This part is done in the 03 command handler in the BB client, and
   // isn't actually part of the encryption library. (Why did they do this?)
   string seed;
@@ -430,6 +475,37 @@ void PSOBBEncryption::apply_seed(const void* original_seed, size_t seed_size) {
     seed.push_back(original_seed_data[x + 1] ^ 0x16);
     seed.push_back(original_seed_data[x + 2] ^ 0x18);
   }
+  return seed;
+}
+
+void PSOBBEncryption::jsd1_peek_decrypt(
+    const KeyFile& key, const void* original_seed, size_t seed_size, void* vdata, size_t size) {
+  if (size & 1) {
+    throw invalid_argument("size must be a multiple of 2");
+  }
+  if (size > 0x100) {
+    throw logic_error("JSD1 can only peek-decrypt up to 0x100 bytes");
+  }
+  string seed = PSOBBEncryption::transform_seed(original_seed, seed_size);
+
+  uint8_t* bytes = reinterpret_cast<uint8_t*>(vdata);
+  for (size_t z = 0; z < size; z += 2) {
+    uint8_t a = bytes[z];
+    uint8_t b = bytes[z + 1];
+    bytes[z] = (a & 0x55) | (b & 0xAA);
+    bytes[z + 1] = (a & 0xAA) | (b & 0x55);
+  }
+  // This computes the same private key bytes as apply_seed does, but only
+  // the ones needed to decrypt this data
+  uint8_t offset = key.initial_keys.jsd1_stream_offset;
+  for (size_t z = 0; z < size; z++, offset++) {
+    uint8_t seed_byte = seed[offset % seed.size()];
+    bytes[z] ^= static_cast<uint8_t>((offset + seed_byte) ^ (seed_byte >> 1));
+  }
+}
+
+void PSOBBEncryption::apply_seed(const void* original_seed, size_t seed_size) {
+  string seed = PSOBBEncryption::transform_seed(original_seed, seed_size);
 
   if (this->state.subtype == Subtype::TFS1) {
     for (size_t x = 0; x < 0x12; x++) {
@@ -770,16 +846,36 @@ void PSOBBMultiKeyDetectorEncryption::decrypt(void* data, size_t size, bool adva
       throw logic_error("initial decryption size does not match expected first data size");
     }
 
+    // JSD1 keys can be checked without computing the full key schedule, so we
+    // check all of them before trying any other keys. For the other subtypes,
+    // every part of the schedule depends on the seed, so the full state must
+    // be built to decrypt even one block. We build it on the stack, so keys
+    // that don't match don't cost a heap allocation, and the matching key's
+    // state is moved into active_crypt rather than being computed again.
     for (const auto& key : this->possible_keys) {
-      this->active_key = key;
-      this->active_crypt = make_shared<PSOBBEncryption>(*this->active_key, this->seed.data(), this->seed.size());
+      if (key->subtype != PSOBBEncryption::Subtype::JSD1) {
+        continue;
+      }
       string test_data(reinterpret_cast<const char*>(data), size);
-      this->active_crypt->decrypt(test_data.data(), test_data.size(), false);
+      PSOBBEncryption::jsd1_peek_decrypt(*key, this->seed.data(), this->seed.size(), test_data.data(), test_data.size());
       if (this->expected_first_data.count(test_data)) {
+        this->active_key = key;
+        this->active_crypt = make_shared<PSOBBEncryption>(*key, this->seed.data(), this->seed.size());
         break;
       }
-      this->active_key.reset();
-      this->active_crypt.reset();
+    }
+    for (size_t z = 0; !this->active_crypt.get() && (z < this->possible_keys.size()); z++) {
+      const auto& key = this->possible_keys[z];
+      if (key->subtype == PSOBBEncryption::Subtype::JSD1) {
+        continue;
+      }
+      PSOBBEncryption crypt(*key, this->seed.data(), this->seed.size());
+      string test_data(reinterpret_cast<const char*>(data), size);
+      crypt.decrypt(test_data.data(), test_data.size(), false);
+      if (this->expected_first_data.count(test_data)) {
+        this->active_key = key;
+        this->active_crypt = make_shared<PSOBBEncryption>(std::move(crypt));
+      }
     }
     if (!this->active_crypt.get()) {
       throw runtime_error("none of the registered private keys are valid for this client");
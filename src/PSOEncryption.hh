@@ -2,11 +2,15 @@
 
 #include <inttypes.h>
 #include <stddef.h>
+#include <string.h>
 
+#include <algorithm>
+#include <array>
 #include <memory>
 #include <phosg/Encoding.hh>
 #include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include "Compression.hh"
@@ -39,60 +43,285 @@ protected:
   PSOEncryption() = default;
 };
 
-class PSOLFGEncryption : public PSOEncryption {
+// PSOLFG is the lagged Fibonacci generator used by the V2 and V3 ciphers and
+// by the games' random number generators. PSOV2LFG and PSOV3LFG are plain
+// value types (their state is stored inline and none of their methods are
+// virtual), so they can be used in hot paths and brute-force search tools
+// without allocating memory. PSOV2Encryption and PSOV3Encryption (below) wrap
+// them for code that needs a PSOEncryption.
+template <typename DerivedT, size_t StreamLength, size_t EndOffset>
+class PSOLFG {
 public:
-  virtual void encrypt(void* data, size_t size, bool advance = true);
-  void encrypt_big_endian(void* data, size_t size, bool advance = true);
-  void encrypt_minus(void* data, size_t size, bool advance = true);
-  void encrypt_big_endian_minus(void* data, size_t size, bool advance = true);
-  void encrypt_both_endian(void* le_data, void* be_data, size_t size, bool advance = true);
-
-  template <bool IsBigEndian>
-  void encrypt_t(void* data, size_t size, bool advance = true);
-  template <bool IsBigEndian>
-  void encrypt_minus_t(void* data, size_t size, bool advance = true);
-
-  uint32_t next(bool advance = true);
+  inline uint32_t next(bool advance = true) {
+    if (this->offset == EndOffset) {
+      static_cast<DerivedT*>(this)->update_stream();
+    }
+    uint32_t ret = this->stream[this->offset];
+    if (advance) {
+      this->offset++;
+    }
+    return ret;
+  }
 
   inline uint32_t seed() const {
     return this->initial_seed;
   }
-  uint32_t absolute_offset() const {
-    return (this->cycles * this->end_offset) + this->offset;
+  inline uint32_t absolute_offset() const {
+    return (this->cycles * EndOffset) + this->offset;
   }
 
-protected:
-  PSOLFGEncryption(uint32_t seed, size_t stream_length, size_t end_offset);
+  // The bulk functions below apply the keystream in runs that end at the
+  // points where the stream must be regenerated, so the inner loops have no
+  // branches or calls and can be vectorized.
 
-  virtual void update_stream() = 0;
+  template <bool IsBigEndian>
+  void encrypt_t(void* vdata, size_t size, bool advance = true) {
+    using U32T = typename std::conditional<IsBigEndian, be_uint32_t, le_uint32_t>::type;
+
+    if (!advance && (size != 4)) {
+      throw std::logic_error("cannot peek-encrypt/decrypt with size > 4");
+    }
+
+    size_t uint32_count = size >> 2;
+    size_t extra_bytes = size & 3;
+    U32T* data = reinterpret_cast<U32T*>(vdata);
+    if (!advance) {
+      data[0] ^= this->next(false);
+      return;
+    }
+    for (size_t x = 0; x < uint32_count;) {
+      size_t run_length = this->prepare_run(uint32_count - x);
+      const uint32_t* key = &this->stream[this->offset];
+      for (size_t z = 0; z < run_length; z++) {
+        data[x + z] ^= key[z];
+      }
+      this->offset += run_length;
+      x += run_length;
+    }
+    if (extra_bytes) {
+      U32T last = 0;
+      memcpy(&last, &data[uint32_count], extra_bytes);
+      last ^= this->next();
+      memcpy(&data[uint32_count], &last, extra_bytes);
+    }
+  }
+
+  template <bool IsBigEndian>
+  void encrypt_minus_t(void* vdata, size_t size, bool advance = true) {
+    using U32T = typename std::conditional<IsBigEndian, be_uint32_t, le_uint32_t>::type;
+
+    if (!advance && (size != 4)) {
+      throw std::logic_error("cannot peek-encrypt/decrypt with size > 4");
+    }
+
+    size_t uint32_count = size >> 2;
+    size_t extra_bytes = size & 3;
+    U32T* data = reinterpret_cast<U32T*>(vdata);
+    if (!advance) {
+      data[0] = this->next(false) - data[0];
+      return;
+    }
+    for (size_t x = 0; x < uint32_count;) {
+      size_t run_length = this->prepare_run(uint32_count - x);
+      const uint32_t* key = &this->stream[this->offset];
+      for (size_t z = 0; z < run_length; z++) {
+        data[x + z] = key[z] - data[x + z];
+      }
+      this->offset += run_length;
+      x += run_length;
+    }
+    if (extra_bytes) {
+      U32T last = 0;
+      memcpy(&last, &data[uint32_count], extra_bytes);
+      last = this->next() - last;
+      memcpy(&data[uint32_count], &last, extra_bytes);
+    }
+  }
 
-  std::vector<uint32_t> stream;
+  void encrypt_both_endian(void* le_vdata, void* be_vdata, size_t size, bool advance = true) {
+    if (size & 3) {
+      throw std::invalid_argument("size must be a multiple of 4");
+    }
+    if (!advance && (size != 4)) {
+      throw std::logic_error("cannot peek-encrypt/decrypt with size > 4");
+    }
+    size >>= 2;
+
+    le_uint32_t* le_data = reinterpret_cast<le_uint32_t*>(le_vdata);
+    be_uint32_t* be_data = reinterpret_cast<be_uint32_t*>(be_vdata);
+    if (!advance) {
+      uint32_t key = this->next(false);
+      le_data[0] ^= key;
+      be_data[0] ^= key;
+      return;
+    }
+    for (size_t x = 0; x < size;) {
+      size_t run_length = this->prepare_run(size - x);
+      const uint32_t* key = &this->stream[this->offset];
+      for (size_t z = 0; z < run_length; z++) {
+        le_data[x + z] ^= key[z];
+        be_data[x + z] ^= key[z];
+      }
+      this->offset += run_length;
+      x += run_length;
+    }
+  }
+
+protected:
+  explicit PSOLFG(uint32_t seed)
+      : offset(0),
+        initial_seed(seed),
+        cycles(0) {
+    this->stream.fill(0);
+  }
+
+  std::array<uint32_t, StreamLength> stream;
   size_t offset;
-  size_t end_offset;
   uint32_t initial_seed;
   size_t cycles;
+
+  // Regenerates the stream if needed, then returns how many of the next
+  // max_length keystream words can be read starting at stream[offset]
+  inline size_t prepare_run(size_t max_length) {
+    if (this->offset == EndOffset) {
+      static_cast<DerivedT*>(this)->update_stream();
+    }
+    return std::min<size_t>(max_length, EndOffset - this->offset);
+  }
 };
 
-class PSOV2Encryption : public PSOLFGEncryption {
+class PSOV2LFG : public PSOLFG<PSOV2LFG, 0x39, 0x38> {
 public:
-  explicit PSOV2Encryption(uint32_t seed);
-  virtual Type type() const;
+  explicit PSOV2LFG(uint32_t seed);
+
+  static constexpr size_t STREAM_LENGTH = 0x38;
 
 protected:
-  virtual void update_stream();
+  friend class PSOLFG<PSOV2LFG, 0x39, 0x38>;
+  void update_stream();
+};
 
-  static constexpr size_t STREAM_LENGTH = 0x38;
+class PSOV3LFG : public PSOLFG<PSOV3LFG, 521, 521> {
+public:
+  explicit PSOV3LFG(uint32_t seed);
+
+  static constexpr size_t STREAM_LENGTH = 521;
+
+protected:
+  friend class PSOLFG<PSOV3LFG, 521, 521>;
+  void update_stream();
 };
 
-class PSOV3Encryption : public PSOLFGEncryption {
+class PSOLFGEncryption : public PSOEncryption {
 public:
-  explicit PSOV3Encryption(uint32_t key);
-  virtual Type type() const;
+  virtual void encrypt(void* data, size_t size, bool advance = true) = 0;
+  virtual void encrypt_big_endian(void* data, size_t size, bool advance = true) = 0;
+  virtual void encrypt_minus(void* data, size_t size, bool advance = true) = 0;
+  virtual void encrypt_big_endian_minus(void* data, size_t size, bool advance = true) = 0;
+  virtual void encrypt_both_endian(void* le_data, void* be_data, size_t size, bool advance = true) = 0;
+
+  template <bool IsBigEndian>
+  inline void encrypt_t(void* data, size_t size, bool advance = true) {
+    if constexpr (IsBigEndian) {
+      this->encrypt_big_endian(data, size, advance);
+    } else {
+      this->encrypt(data, size, advance);
+    }
+  }
+  template <bool IsBigEndian>
+  inline void encrypt_minus_t(void* data, size_t size, bool advance = true) {
+    if constexpr (IsBigEndian) {
+      this->encrypt_big_endian_minus(data, size, advance);
+    } else {
+      this->encrypt_minus(data, size, advance);
+    }
+  }
+
+  virtual uint32_t next(bool advance = true) = 0;
+  virtual uint32_t seed() const = 0;
+  virtual uint32_t absolute_offset() const = 0;
 
 protected:
-  virtual void update_stream();
+  PSOLFGEncryption() = default;
+};
 
-  static constexpr size_t STREAM_LENGTH = 521;
+// This is final so that calls on a PSOV2Encryption or PSOV3Encryption (as
+// opposed to a PSOLFGEncryption reference) don't need to be virtual
+template <typename LFGT, PSOEncryption::Type TypeV>
+class PSOLFGEncryptionT final : public PSOLFGEncryption {
+public:
+  explicit PSOLFGEncryptionT(uint32_t seed) : lfg(seed) {}
+
+  virtual void encrypt(void* data, size_t size, bool advance = true) {
+    this->lfg.template encrypt_t<false>(data, size, advance);
+  }
+  virtual void encrypt_big_endian(void* data, size_t size, bool advance = true) {
+    this->lfg.template encrypt_t<true>(data, size, advance);
+  }
+  virtual void encrypt_minus(void* data, size_t size, bool advance = true) {
+    this->lfg.template encrypt_minus_t<false>(data, size, advance);
+  }
+  virtual void encrypt_big_endian_minus(void* data, size_t size, bool advance = true) {
+    this->lfg.template encrypt_minus_t<true>(data, size, advance);
+  }
+  virtual void encrypt_both_endian(void* le_data, void* be_data, size_t size, bool advance = true) {
+    this->lfg.encrypt_both_endian(le_data, be_data, size, advance);
+  }
+
+  virtual uint32_t next(bool advance = true) {
+    return this->lfg.next(advance);
+  }
+  virtual uint32_t seed() const {
+    return this->lfg.seed();
+  }
+  virtual uint32_t absolute_offset() const {
+    return this->lfg.absolute_offset();
+  }
+
+  virtual Type type() const {
+    return TypeV;
+  }
+
+protected:
+  LFGT lfg;
+};
+
+using PSOV2Encryption = PSOLFGEncryptionT<PSOV2LFG, PSOEncryption::Type::V2>;
+using PSOV3Encryption = PSOLFGEncryptionT<PSOV3LFG, PSOEncryption::Type::V3>;
+
+// Tests V2 or V3 seeds against keystream patterns, for brute-force seed
+// searches (e.g. find-decryption-seed). A seed matches a pattern if the first
+// words w of its keystream satisfy (w[z] & masks[z]) == values[z] for all z.
+// This is much faster than constructing a PSOV2Encryption or PSOV3Encryption
+// for each seed: it doesn't allocate memory, it interleaves the states of
+// several seeds so the compiler can vectorize the key expansion across them,
+// it only generates as much keystream as the longest pattern needs, and it
+// stops checking a pattern as soon as every seed in the batch has failed it.
+class PSOLFGSeedMatcher {
+public:
+  struct Pattern {
+    std::vector<uint32_t> values;
+    std::vector<uint32_t> masks;
+  };
+
+  // Number of seeds evaluated together
+  static constexpr size_t BATCH_SIZE = 8;
+
+  PSOLFGSeedMatcher(bool is_v3, std::vector<Pattern>&& patterns);
+
+  // Returns the lowest seed in [start, end) that matches any pattern, or end
+  // if there is none
+  uint64_t find(uint64_t start, uint64_t end) const;
+
+protected:
+  bool is_v3;
+  std::vector<Pattern> patterns;
+  size_t num_keystream_words;
+
+  // Returns a bitmask of which seeds in [first_seed, first_seed + BATCH_SIZE)
+  // match any pattern
+  template <typename TraitsT>
+  uint32_t match_batch(uint32_t first_seed, std::array<uint32_t, BATCH_SIZE>* keystream) const;
 };
 
 class PSOBBEncryption : public PSOEncryption {
@@ -137,9 +366,18 @@ public:
 
   virtual Type type() const;
 
+  // Decrypts data with a JSD1 key without constructing the full state, which
+  // is much cheaper than constructing a PSOBBEncryption. This works because
+  // JSD1's state depends only on the seed, and decrypting the first few bytes
+  // requires only the corresponding few bytes of the state. Like decrypt with
+  // advance = false, size must be at most 0x100.
+  static void jsd1_peek_decrypt(
+      const KeyFile& key, const void* seed, size_t seed_size, void* data, size_t size);
+
 protected:
   KeyFile state;
 
+  static std::string transform_seed(const void* original_seed, size_t seed_size);
   void tfs1_scramble(uint32_t* out1, uint32_t* out2) const;
   void apply_seed(const void* original_seed, size_t seed_size);
 };
@@ -282,8 +520,10 @@ DecryptedPR2 decrypt_pr2_data(const std::string& data) {
 template <bool IsBigEndian>
 std::string decrypt_and_decompress_pr2_data(const std::string& data) {
   auto decrypted = decrypt_pr2_data<IsBigEndian>(data);
-  std::string decompressed = prs_decompress(decrypted.compressed_data);
-  if (decompressed.size() != decrypted.decompressed_size) {
+  std::string decompressed(decrypted.decompressed_size, '\0');
+  size_t decompressed_size = prs_decompress_into(
+      decompressed.data(), decompressed.size(), decrypted.compressed_data.data(), decrypted.compressed_data.size());
+  if (decompressed_size != decrypted.decompressed_size) {
     throw std::runtime_error("decompressed size does not match expected size");
   }
   return decompressed;
@@ -1,7 +1,11 @@
 #include "PatchFileIndex.hh"
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <functional>
 #include <phosg/Filesystem.hh>
@@ -18,17 +22,109 @@ PatchFileIndex::File::File(PatchFileIndex* index)
       crc32(0),
       size(0) {}
 
+PatchFileIndex::MappedData::MappedData(const string& filename)
+    : is_mapped(false),
+      addr(nullptr),
+      bytes(0) {
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw cannot_open_file(filename);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw runtime_error("cannot stat file: " + filename);
+  }
+
+  // Small files are copied, so they can't be affected by later changes to the
+  // file at all. This also covers empty files, which can't be mapped.
+  if (static_cast<size_t>(st.st_size) < COPY_THRESHOLD) {
+    this->copied_data.resize(st.st_size);
+    try {
+      preadx(fd, this->copied_data.data(), this->copied_data.size(), 0);
+    } catch (const exception&) {
+      close(fd);
+      throw;
+    }
+    close(fd);
+    this->addr = this->copied_data.data();
+    this->bytes = this->copied_data.size();
+    return;
+  }
+
+  this->bytes = st.st_size;
+  this->addr = mmap(nullptr, this->bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (this->addr == MAP_FAILED) {
+    this->addr = nullptr;
+    throw runtime_error("cannot map file: " + filename);
+  }
+  madvise(this->addr, this->bytes, MADV_SEQUENTIAL);
+  this->is_mapped = true;
+}
+
+PatchFileIndex::MappedData::~MappedData() {
+  if (this->is_mapped) {
+    munmap(this->addr, this->bytes);
+  }
+}
+
+PatchFileIndex::FileReader::FileReader(const string& filename)
+    : filename(filename),
+      fd(::open(filename.c_str(), O_RDONLY | O_CLOEXEC)),
+      bytes(0) {
+  if (this->fd < 0) {
+    throw cannot_open_file(filename);
+  }
+  struct stat st;
+  if (fstat(this->fd, &st) != 0) {
+    close(this->fd);
+    throw runtime_error("cannot stat file: " + filename);
+  }
+  this->bytes = st.st_size;
+}
+
+PatchFileIndex::FileReader::~FileReader() {
+  close(this->fd);
+}
+
+void PatchFileIndex::FileReader::read(void* dest, size_t size, size_t offset) const {
+  try {
+    preadx(this->fd, dest, size, offset);
+  } catch (const exception& e) {
+    throw runtime_error(string_printf("cannot read %zu bytes at offset %zX from %s (it may have been modified in place): %s",
+        size, offset, this->filename.c_str(), e.what()));
+  }
+}
+
+string PatchFileIndex::File::full_path() const {
+  return this->index->root_dir + "/" + join(this->path_directories, "/") + "/" + this->name;
+}
+
 std::shared_ptr<const std::string> PatchFileIndex::File::load_data() {
   if (!this->loaded_data) {
-    string relative_path = join(this->path_directories, "/") + "/" + this->name;
-    string full_path = this->index->root_dir + "/" + relative_path;
-    patch_index_log.info("Loading data for %s", relative_path.c_str());
+    string full_path = this->full_path();
+    patch_index_log.info("Loading data for %s", full_path.c_str());
     this->loaded_data = make_shared<string>(load_file(full_path));
     this->size = this->loaded_data->size();
   }
   return this->loaded_data;
 }
 
+std::shared_ptr<const PatchFileIndex::MappedData> PatchFileIndex::File::map_data() {
+  auto ret = this->mapped_data.lock();
+  if (!ret) {
+    ret = make_shared<MappedData>(this->full_path());
+    this->size = ret->size();
+    this->mapped_data = ret;
+  }
+  return ret;
+}
+
+std::shared_ptr<const PatchFileIndex::FileReader> PatchFileIndex::File::open() const {
+  return make_shared<FileReader>(this->full_path());
+}
+
 PatchFileIndex::PatchFileIndex(const string& root_dir)
     : root_dir(root_dir) {
 
@@ -97,7 +193,9 @@ PatchFileIndex::PatchFileIndex(const string& root_dir)
         }
 
         if (!compute_crc32s_message.empty()) {
-          auto data = f->load_data(); // Sets f->size
+          // Map the file instead of loading it, so its data isn't kept in
+          // memory after the checksums are computed
+          auto data = f->map_data(); // Sets f->size
           f->crc32 = crc32(data->data(), f->size);
           for (size_t x = 0; x < data->size(); x += 0x4000) {
             size_t chunk_bytes = min<size_t>(f->size - x, 0x4000);
@@ -11,17 +11,87 @@
 struct PatchFileIndex {
   explicit PatchFileIndex(const std::string& root_dir);
 
+  // The read-only contents of an entire file. Files smaller than
+  // COPY_THRESHOLD bytes are copied into memory; larger files are mapped.
+  // Reading a mapping beyond the end of a file that was truncated after it was
+  // mapped crashes the process (with SIGBUS), so mappings should only be kept
+  // for a short time; anything that reads a file over a long time (e.g. while
+  // sending it to a client) should use FileReader instead.
+  class MappedData {
+  public:
+    static constexpr size_t COPY_THRESHOLD = 0x100000;
+
+    explicit MappedData(const std::string& filename);
+    MappedData(const MappedData&) = delete;
+    MappedData(MappedData&&) = delete;
+    MappedData& operator=(const MappedData&) = delete;
+    MappedData& operator=(MappedData&&) = delete;
+    ~MappedData();
+
+    inline const char* data() const {
+      return reinterpret_cast<const char*>(this->addr);
+    }
+    inline size_t size() const {
+      return this->bytes;
+    }
+
+  private:
+    std::string copied_data;
+    bool is_mapped;
+    void* addr;
+    size_t bytes;
+  };
+
+  // An open handle to a file, from which parts of the file are read on demand
+  // (e.g. while sending it to a client). Unlike a mapping, this is safe even
+  // if the file is truncated or rewritten in place while it's open: a read
+  // past the file's new end throws instead of crashing the process.
+  class FileReader {
+  public:
+    explicit FileReader(const std::string& filename);
+    FileReader(const FileReader&) = delete;
+    FileReader(FileReader&&) = delete;
+    FileReader& operator=(const FileReader&) = delete;
+    FileReader& operator=(FileReader&&) = delete;
+    ~FileReader();
+
+    // Returns the file's size when it was opened
+    inline size_t size() const {
+      return this->bytes;
+    }
+
+    // Reads exactly size bytes starting at offset into dest
+    void read(void* dest, size_t size, size_t offset) const;
+
+  private:
+    std::string filename;
+    int fd;
+    size_t bytes;
+  };
+
   struct File {
     PatchFileIndex* index;
     std::vector<std::string> path_directories;
     std::string name;
     std::shared_ptr<const std::string> loaded_data;
+    std::weak_ptr<const MappedData> mapped_data;
     std::vector<uint32_t> chunk_crcs;
     uint32_t crc32;
     uint32_t size;
 
     explicit File(PatchFileIndex* index);
+    std::string full_path() const;
+    // Loads the file's contents and keeps them in memory. This is intended for
+    // files that the server itself uses (e.g. BB data files); sending files to
+    // clients should use open instead.
     std::shared_ptr<const std::string> load_data();
+    // Maps the file's contents into memory. The mapping is shared by all
+    // callers, and is unmapped when the last reference to it is destroyed.
+    std::shared_ptr<const MappedData> map_data();
+    // Opens the file for reading in parts. This is what sending files to
+    // clients uses, since a transfer can last long enough for the file to be
+    // changed in the meantime.
+    std::shared_ptr<const FileReader> open() const;
   };
 
   const std::vector<std::shared_ptr<File>>& all_files() const;
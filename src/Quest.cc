@@ -1,12 +1,16 @@
 #include "Quest.hh"
 
+#include <sys/stat.h>
+
 #include <algorithm>
+#include <atomic>
 #include <mutex>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
 #include <phosg/Hash.hh>
 #include <phosg/Random.hh>
 #include <phosg/Strings.hh>
+#include <phosg/Time.hh>
 #include <phosg/Tools.hh>
 #include <string>
 #include <unordered_map>
@@ -14,6 +18,7 @@
 #include "CommandFormats.hh"
 #include "Compression.hh"
 #include "Loggers.hh"
+#include "Metrics.hh"
 #include "PSOEncryption.hh"
 #include "QuestScript.hh"
 #include "SaveFileFormats.hh"
@@ -21,6 +26,17 @@
 
 using namespace std;
 
+// Returns the modification time in nanoseconds, so that a file rewritten twice
+// in the same second is still detected as changed
+static uint64_t mtime_nsecs(const struct stat& st) {
+#ifdef __APPLE__
+  const auto& ts = st.st_mtimespec;
+#else
+  const auto& ts = st.st_mtim;
+#endif
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
 QuestCategoryIndex::Category::Category(uint32_t category_id, const JSON& json)
     : category_id(category_id) {
   this->enabled_flags = json.get_int(0);
@@ -462,120 +478,216 @@ shared_ptr<const VersionedQuest> Quest::version(Version v, uint8_t language) con
 QuestIndex::QuestIndex(
     const string& directory,
     std::shared_ptr<const QuestCategoryIndex> category_index,
-    bool is_ep3)
+    bool is_ep3,
+    shared_ptr<const QuestIndex> previous,
+    size_t num_threads)
     : directory(directory),
-      category_index(category_index) {
-
-  struct FileData {
-    std::string filename;
-    shared_ptr<const string> data;
+      category_index(category_index),
+      is_ep3(is_ep3) {
+
+  // Loading and indexing quests is done in two phases, each of which runs on
+  // multiple threads. First, all files are read and decoded (which may involve
+  // decompressing, decrypting, or assembling them); then, each .bin file is
+  // matched with its corresponding .dat, .pvr, and .json files and parsed.
+  // In both phases the per-file work is done in parallel, but the results are
+  // merged (and all log messages are written) in directory order afterward, so
+  // the resulting index doesn't depend on thread timing.
+
+  struct InputFile {
+    shared_ptr<const QuestCategoryIndex::Category> cat;
+    string filename;
+    string path;
+    // This is filled in by the loading phase
+    SourceFile source;
   };
-  map<string, FileData> bin_files;
-  map<string, FileData> dat_files;
-  map<string, FileData> pvr_files;
-  map<string, FileData> json_files;
-  map<string, uint32_t> categories;
-  for (const auto& cat : this->category_index->categories) {
-    // Don't index Ep3 download categories for non-Ep3 quest indexing, and vice
-    // versa
-    if (is_ep3 != cat->check_flag(QuestMenuType::EP3_DOWNLOAD)) {
-      continue;
-    }
 
-    auto add_file = [&](map<string, FileData>& files, const string& basename, const string& filename, string&& value) {
-      if (categories.emplace(basename, cat->category_id).first->second != cat->category_id) {
-        throw runtime_error("file " + basename + " exists in multiple categories");
-      }
-      auto data_ptr = make_shared<string>(std::move(value));
-      if (!files.emplace(basename, FileData{filename, data_ptr}).second) {
-        throw runtime_error("file " + basename + " already exists");
-      }
-    };
-
-    string cat_path = directory + "/" + cat->directory_name;
+  vector<InputFile> input_files;
+  for (const auto& [cat, cat_path] : this->category_directories()) {
     if (!isdir(cat_path)) {
       static_game_data_log.warning("Quest category directory %s is missing; skipping it", cat_path.c_str());
       continue;
     }
-    for (string filename : list_directory_sorted(cat_path)) {
-      if (filename == ".DS_Store") {
-        continue;
+    for (const string& filename : list_directory_sorted(cat_path)) {
+      if (filename != ".DS_Store") {
+        auto& f = input_files.emplace_back();
+        f.cat = cat;
+        f.filename = filename;
+        f.path = cat_path + "/" + filename;
       }
+    }
+  }
 
-      string file_path = cat_path + "/" + filename;
-      try {
-        string orig_filename = filename;
-        string file_data;
-        if (ends_with(filename, ".gci")) {
-          file_data = decode_gci_data(load_file(file_path));
-          filename.resize(filename.size() - 4);
-        } else if (ends_with(filename, ".vms")) {
-          file_data = decode_vms_data(load_file(file_path));
-          filename.resize(filename.size() - 4);
-        } else if (ends_with(filename, ".dlq")) {
-          file_data = decode_dlq_data(load_file(file_path));
-          filename.resize(filename.size() - 4);
-        } else if (ends_with(filename, ".txt")) {
-          file_data = assemble_quest_script(load_file(file_path));
-          filename.resize(filename.size() - 4);
-          if (ends_with(filename, ".bin")) {
-            filename.push_back('d');
-          }
-        } else {
-          file_data = load_file(file_path);
+  uint64_t load_start = now();
+  atomic<size_t> num_files_reused = 0;
+  parallel_range<size_t>([&](size_t index, size_t) -> bool {
+    auto& f = input_files[index];
+    auto& source = f.source;
+    string filename = f.filename;
+    try {
+      auto st = stat(f.path);
+      source.size = st.st_size;
+      source.mtime = mtime_nsecs(st);
+      string raw_data = load_file(f.path);
+      source.hash = fnv1a64(raw_data.data(), raw_data.size());
+
+      // If the file is unchanged since the previous index was built, reuse its
+      // decoded contents instead of decoding it again. The modification time
+      // isn't checked here since it can be changed without changing the file.
+      if (previous) {
+        auto prev_it = previous->source_files.find(f.path);
+        if ((prev_it != previous->source_files.end()) &&
+            (prev_it->second.size == raw_data.size()) &&
+            (prev_it->second.hash == source.hash)) {
+          source.basename = prev_it->second.basename;
+          source.contents = prev_it->second.contents;
+          source.warning = prev_it->second.warning;
+          num_files_reused++;
+          return false;
         }
+      }
 
-        size_t dot_pos = filename.rfind('.');
-        string file_basename;
-        string extension;
-        if (dot_pos != string::npos) {
-          file_basename = tolower(filename.substr(0, dot_pos));
-          extension = tolower(filename.substr(dot_pos + 1));
-        } else {
-          file_basename = tolower(filename);
+      string file_data;
+      if (ends_with(filename, ".gci")) {
+        file_data = decode_gci_data(raw_data);
+        filename.resize(filename.size() - 4);
+      } else if (ends_with(filename, ".vms")) {
+        file_data = decode_vms_data(raw_data);
+        filename.resize(filename.size() - 4);
+      } else if (ends_with(filename, ".dlq")) {
+        file_data = decode_dlq_data(raw_data);
+        filename.resize(filename.size() - 4);
+      } else if (ends_with(filename, ".txt")) {
+        file_data = assemble_quest_script(raw_data);
+        filename.resize(filename.size() - 4);
+        if (ends_with(filename, ".bin")) {
+          filename.push_back('d');
         }
+      } else {
+        file_data = std::move(raw_data);
+      }
+
+      size_t dot_pos = filename.rfind('.');
+      string extension;
+      if (dot_pos != string::npos) {
+        source.basename = tolower(filename.substr(0, dot_pos));
+        extension = tolower(filename.substr(dot_pos + 1));
+      } else {
+        source.basename = tolower(filename);
+      }
 
-        if (extension == "json") {
-          add_file(json_files, file_basename, orig_filename, std::move(file_data));
-        } else if (extension == "bin" || extension == "mnm") {
-          add_file(bin_files, file_basename, orig_filename, std::move(file_data));
-        } else if (extension == "bind" || extension == "mnmd") {
-          add_file(bin_files, file_basename, orig_filename, prs_compress_optimal(file_data));
-        } else if (extension == "dat") {
-          add_file(dat_files, file_basename, orig_filename, std::move(file_data));
-        } else if (extension == "datd") {
-          add_file(dat_files, file_basename, orig_filename, prs_compress_optimal(file_data));
-        } else if (extension == "pvr") {
-          add_file(pvr_files, file_basename, orig_filename, std::move(file_data));
-        } else if (extension == "qst") {
-          auto files = decode_qst_data(file_data);
-          for (auto& it : files) {
-            if (ends_with(it.first, ".bin")) {
-              add_file(bin_files, file_basename, orig_filename, std::move(it.second));
-            } else if (ends_with(it.first, ".dat")) {
-              add_file(dat_files, file_basename, orig_filename, std::move(it.second));
-            } else if (ends_with(it.first, ".pvr")) {
-              add_file(pvr_files, file_basename, orig_filename, std::move(it.second));
-            } else {
-              throw runtime_error("qst file contains unsupported file type: " + it.first);
-            }
+      if (extension == "json") {
+        source.contents.emplace_back(FileType::JSON, make_shared<string>(std::move(file_data)));
+      } else if (extension == "bin" || extension == "mnm") {
+        source.contents.emplace_back(FileType::BIN, make_shared<string>(std::move(file_data)));
+      } else if (extension == "bind" || extension == "mnmd") {
+        source.contents.emplace_back(FileType::BIN, make_shared<string>(prs_compress_optimal(file_data)));
+      } else if (extension == "dat") {
+        source.contents.emplace_back(FileType::DAT, make_shared<string>(std::move(file_data)));
+      } else if (extension == "datd") {
+        source.contents.emplace_back(FileType::DAT, make_shared<string>(prs_compress_optimal(file_data)));
+      } else if (extension == "pvr") {
+        source.contents.emplace_back(FileType::PVR, make_shared<string>(std::move(file_data)));
+      } else if (extension == "qst") {
+        auto files = decode_qst_data(file_data);
+        for (auto& it : files) {
+          if (ends_with(it.first, ".bin")) {
+            source.contents.emplace_back(FileType::BIN, make_shared<string>(std::move(it.second)));
+          } else if (ends_with(it.first, ".dat")) {
+            source.contents.emplace_back(FileType::DAT, make_shared<string>(std::move(it.second)));
+          } else if (ends_with(it.first, ".pvr")) {
+            source.contents.emplace_back(FileType::PVR, make_shared<string>(std::move(it.second)));
+          } else {
+            throw runtime_error("qst file contains unsupported file type: " + it.first);
           }
-        } else {
-          static_game_data_log.warning("(%s) Skipping file (unsupported format)", filename.c_str());
         }
+      } else {
+        source.warning = string_printf("(%s) Skipping file (unsupported format)", filename.c_str());
+      }
 
-      } catch (const exception& e) {
-        static_game_data_log.warning("(%s) Failed to load quest file: (%s)", filename.c_str(), e.what());
+    } catch (const exception& e) {
+      source.contents.clear();
+      source.warning = string_printf("(%s) Failed to load quest file: (%s)", filename.c_str(), e.what());
+    }
+    return false;
+  },
+      0, input_files.size(), num_threads);
+  uint64_t load_usecs = now() - load_start;
+
+  struct FileData {
+    std::string filename;
+    shared_ptr<const string> data;
+  };
+  map<string, FileData> bin_files;
+  map<string, FileData> dat_files;
+  map<string, FileData> pvr_files;
+  map<string, FileData> json_files;
+  map<string, uint32_t> categories;
+  for (auto& f : input_files) {
+    const auto& source = f.source;
+    if (!source.warning.empty()) {
+      static_game_data_log.warning("%s", source.warning.c_str());
+      this->source_files.emplace(f.path, std::move(f.source));
+      continue;
+    }
+    try {
+      if (categories.emplace(source.basename, f.cat->category_id).first->second != f.cat->category_id) {
+        throw runtime_error("file " + source.basename + " exists in multiple categories");
       }
+      for (const auto& it : source.contents) {
+        map<string, FileData>* files;
+        switch (it.first) {
+          case FileType::BIN:
+            files = &bin_files;
+            break;
+          case FileType::DAT:
+            files = &dat_files;
+            break;
+          case FileType::PVR:
+            files = &pvr_files;
+            break;
+          case FileType::JSON:
+            files = &json_files;
+            break;
+          default:
+            throw logic_error("invalid quest file type");
+        }
+        if (!files->emplace(source.basename, FileData{f.filename, it.second}).second) {
+          throw runtime_error("file " + source.basename + " already exists");
+        }
+      }
+    } catch (const exception& e) {
+      static_game_data_log.warning("(%s) Failed to load quest file: (%s)", f.filename.c_str(), e.what());
     }
+    this->source_files.emplace(f.path, std::move(f.source));
   }
+  input_files.clear();
 
   // All quests have a bin file (even in Episode 3, though its format is
   // different), so we use bin_files as the primary list of all quests that
   // should be indexed
-  for (auto& bin_it : bin_files) {
-    const string& basename = bin_it.first;
-    const auto* bin_filedata = &bin_it.second;
+  struct IndexedQuest {
+    const string* basename;
+    const FileData* bin_filedata;
+    // These fields are filled in by the indexing phase
+    shared_ptr<const VersionedQuest> vq;
+    shared_ptr<const string> json_contents;
+    string filenames_str;
+    string error;
+  };
+  vector<IndexedQuest> indexed_quests;
+  indexed_quests.reserve(bin_files.size());
+  for (const auto& bin_it : bin_files) {
+    auto& iq = indexed_quests.emplace_back();
+    iq.basename = &bin_it.first;
+    iq.bin_filedata = &bin_it.second;
+  }
+
+  uint64_t index_start = now();
+  atomic<size_t> num_quests_reused = 0;
+  parallel_range<size_t>([&](size_t index, size_t) -> bool {
+    auto& iq = indexed_quests[index];
+    const string& basename = *iq.basename;
+    const auto* bin_filedata = iq.bin_filedata;
 
     try {
       // Quest .bin filenames are like K###-VERS-LANG.EXT, where:
@@ -673,6 +785,40 @@ QuestIndex::QuestIndex(
           }
         }
       }
+      if (json_filedata) {
+        iq.json_contents = json_filedata->data;
+      }
+
+      iq.filenames_str = bin_filedata->filename;
+      if (dat_filedata) {
+        iq.filenames_str += string_printf("/%s", dat_filedata->filename.c_str());
+      }
+      if (pvr_filedata) {
+        iq.filenames_str += string_printf("/%s", pvr_filedata->filename.c_str());
+      }
+      if (json_filedata) {
+        iq.filenames_str += string_printf("/%s", json_filedata->filename.c_str());
+      }
+
+      // If none of the quest's files have changed since the previous index was
+      // built, they will be the same objects as before (since the load phase
+      // reuses unchanged files' contents), so we can reuse the parsed quest too
+      if (previous) {
+        auto prev_it = previous->source_quests.find(basename);
+        if (prev_it != previous->source_quests.end()) {
+          const auto& prev_vq = prev_it->second.vq;
+          if ((prev_vq->category_id == category_id) &&
+              (prev_vq->bin_contents == bin_filedata->data) &&
+              (prev_vq->dat_contents == (dat_filedata ? dat_filedata->data : nullptr)) &&
+              (prev_vq->pvr_contents == (pvr_filedata ? pvr_filedata->data : nullptr)) &&
+              (prev_it->second.json_contents == iq.json_contents)) {
+            iq.vq = prev_vq;
+            num_quests_reused++;
+            return false;
+          }
+        }
+      }
+
       if (json_filedata) {
         auto metadata_json = JSON::parse(*json_filedata->data);
         try {
@@ -693,7 +839,7 @@ QuestIndex::QuestIndex(
         }
       }
 
-      auto vq = make_shared<VersionedQuest>(
+      iq.vq = make_shared<VersionedQuest>(
           quest_number,
           category_id,
           version,
@@ -705,23 +851,29 @@ QuestIndex::QuestIndex(
           challenge_template_index,
           available_expression,
           enabled_expression);
+    } catch (const exception& e) {
+      iq.vq.reset();
+      iq.error = e.what();
+    }
+    return false;
+  },
+      0, indexed_quests.size(), num_threads);
+  uint64_t index_usecs = now() - index_start;
 
+  for (const auto& iq : indexed_quests) {
+    if (!iq.vq) {
+      static_game_data_log.warning("(%s) Failed to index quest file: (%s)", iq.basename->c_str(), iq.error.c_str());
+      continue;
+    }
+    const auto& vq = iq.vq;
+    this->source_quests.emplace(*iq.basename, SourceQuest{vq, iq.json_contents});
+    try {
       auto category_name = this->category_index->at(vq->category_id)->name;
-      string filenames_str = bin_filedata->filename;
-      if (dat_filedata) {
-        filenames_str += string_printf("/%s", dat_filedata->filename.c_str());
-      }
-      if (pvr_filedata) {
-        filenames_str += string_printf("/%s", pvr_filedata->filename.c_str());
-      }
-      if (json_filedata) {
-        filenames_str += string_printf("/%s", json_filedata->filename.c_str());
-      }
       auto q_it = this->quests_by_number.find(vq->quest_number);
       if (q_it != this->quests_by_number.end()) {
         q_it->second->add_version(vq);
         static_game_data_log.info("(%s) Added %s %c version of quest %" PRIu32 " (%s)",
-            filenames_str.c_str(),
+            iq.filenames_str.c_str(),
             name_for_enum(vq->version),
             char_for_language_code(vq->language),
             vq->quest_number,
@@ -732,7 +884,7 @@ QuestIndex::QuestIndex(
         this->quests_by_name.emplace(vq->name, q);
         this->quests_by_category_id_and_number[q->category_id].emplace(vq->quest_number, q);
         static_game_data_log.info("(%s) Created %s %c quest %" PRIu32 " (%s) (%s, %s (%" PRIu32 "), %s)",
-            filenames_str.c_str(),
+            iq.filenames_str.c_str(),
             name_for_enum(vq->version),
             char_for_language_code(vq->language),
             vq->quest_number,
@@ -743,9 +895,62 @@ QuestIndex::QuestIndex(
             vq->joinable ? "joinable" : "not joinable");
       }
     } catch (const exception& e) {
-      static_game_data_log.warning("(%s) Failed to index quest file: (%s)", basename.c_str(), e.what());
+      static_game_data_log.warning("(%s) Failed to index quest file: (%s)", iq.basename->c_str(), e.what());
+    }
+  }
+
+  this->num_files_reused = num_files_reused.load();
+  this->num_quests_reused = num_quests_reused.load();
+  static_game_data_log.info("Loaded %zu quest files (%zu unchanged) in %s; indexed %zu quests (%zu unchanged) in %s",
+      this->source_files.size(),
+      this->num_files_reused,
+      format_duration(load_usecs).c_str(),
+      indexed_quests.size(),
+      this->num_quests_reused,
+      format_duration(index_usecs).c_str());
+}
+
+vector<pair<shared_ptr<const QuestCategoryIndex::Category>, string>> QuestIndex::category_directories() const {
+  vector<pair<shared_ptr<const QuestCategoryIndex::Category>, string>> ret;
+  for (const auto& cat : this->category_index->categories) {
+    // Don't index Ep3 download categories for non-Ep3 quest indexing, and vice
+    // versa
+    if (this->is_ep3 != cat->check_flag(QuestMenuType::EP3_DOWNLOAD)) {
+      continue;
     }
+    ret.emplace_back(cat, this->directory + "/" + cat->directory_name);
   }
+  return ret;
+}
+
+bool QuestIndex::files_changed() const {
+  size_t num_files = 0;
+  for (const auto& [cat, cat_path] : this->category_directories()) {
+    if (!isdir(cat_path)) {
+      continue;
+    }
+    for (const string& filename : list_directory(cat_path)) {
+      if (filename == ".DS_Store") {
+        continue;
+      }
+      string path = cat_path + "/" + filename;
+      auto it = this->source_files.find(path);
+      if (it == this->source_files.end()) {
+        return true;
+      }
+      try {
+        auto st = stat(path);
+        if ((static_cast<uint64_t>(st.st_size) != it->second.size) ||
+            (mtime_nsecs(st) != it->second.mtime)) {
+          return true;
+        }
+      } catch (const exception&) {
+        return true;
+      }
+      num_files++;
+    }
+  }
+  return (num_files != this->source_files.size());
 }
 
 shared_ptr<const Quest> QuestIndex::get(uint32_t quest_number) const {
@@ -764,6 +969,40 @@ shared_ptr<const Quest> QuestIndex::get(const std::string& name) const {
   }
 }
 
+shared_ptr<const VersionedQuest> QuestIndex::download_quest(
+    shared_ptr<const VersionedQuest> vq, uint8_t override_language) const {
+  uint64_t key = (static_cast<uint64_t>(vq->quest_number) << 16) |
+      (static_cast<uint64_t>(vq->version) << 8) |
+      override_language;
+  {
+    lock_guard<mutex> g(this->download_quest_cache_lock);
+    auto it = this->download_quest_cache.find(key);
+    if (it != this->download_quest_cache.end()) {
+      Metrics::add(metrics.download_quest_cache_hits);
+      return it->second;
+    }
+  }
+
+  // Generate the download quest without holding the lock. If another thread
+  // generates the same quest at the same time, the first result is kept.
+  Metrics::add(metrics.download_quest_cache_misses);
+  shared_ptr<const VersionedQuest> dlq = vq->create_download_quest(override_language);
+  size_t bytes = dlq->bin_contents->size() + dlq->dat_contents->size() +
+      (dlq->pvr_contents ? dlq->pvr_contents->size() : 0);
+
+  lock_guard<mutex> g(this->download_quest_cache_lock);
+  auto emplace_ret = this->download_quest_cache.emplace(key, dlq);
+  if (emplace_ret.second) {
+    this->download_quest_cache_total_bytes += bytes;
+  }
+  return emplace_ret.first->second;
+}
+
+size_t QuestIndex::download_quest_cache_bytes() const {
+  lock_guard<mutex> g(this->download_quest_cache_lock);
+  return this->download_quest_cache_total_bytes;
+}
+
 vector<shared_ptr<const QuestCategoryIndex::Category>> QuestIndex::categories(
     QuestMenuType menu_type,
     Episode episode,
@@ -4,6 +4,7 @@
 
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -139,11 +140,43 @@ struct QuestIndex {
   std::map<std::string, std::shared_ptr<Quest>> quests_by_name;
   std::map<uint32_t, std::map<uint32_t, std::shared_ptr<Quest>>> quests_by_category_id_and_number;
 
-  QuestIndex(const std::string& directory, std::shared_ptr<const QuestCategoryIndex> category_index, bool is_ep3);
+  // How many files and quests were reused from the previous index (see below)
+  // rather than being loaded or parsed again
+  size_t num_files_reused = 0;
+  size_t num_quests_reused = 0;
+
+  // Files are loaded and parsed on num_threads threads; if num_threads is 0,
+  // one thread per CPU core is used. If previous is given, files whose
+  // contents haven't changed since previous was built are not decoded again,
+  // and quests whose files are all unchanged reuse previous's VersionedQuest
+  // objects instead of being parsed again.
+  QuestIndex(
+      const std::string& directory,
+      std::shared_ptr<const QuestCategoryIndex> category_index,
+      bool is_ep3,
+      std::shared_ptr<const QuestIndex> previous = nullptr,
+      size_t num_threads = 0);
+
+  // Returns true if any files have been added, deleted, or modified in the
+  // quest directories since this index was built. This only lists the
+  // directories and checks each file's size and modification time, so it's
+  // much faster than building a new index.
+  bool files_changed() const;
 
   std::shared_ptr<const Quest> get(uint32_t quest_number) const;
   std::shared_ptr<const Quest> get(const std::string& name) const;
 
+  // Returns the download-quest form of the given quest version (as produced
+  // by VersionedQuest::create_download_quest). The result is generated the
+  // first time each (quest number, version, language) combination is
+  // requested, then reused for all later requests, so it's not regenerated
+  // each time a player downloads the quest. The cache is owned by this index,
+  // so it's discarded when quests are reloaded.
+  std::shared_ptr<const VersionedQuest> download_quest(
+      std::shared_ptr<const VersionedQuest> vq, uint8_t override_language) const;
+  // Returns the total size of all cached download quest files
+  size_t download_quest_cache_bytes() const;
+
   std::vector<std::shared_ptr<const QuestCategoryIndex::Category>> categories(
       QuestMenuType menu_type,
       Episode episode,
@@ -156,6 +189,39 @@ struct QuestIndex {
       uint32_t category_id,
       IncludeCondition include_condition = nullptr,
       size_t limit = 0) const;
+
+private:
+  enum class FileType {
+    BIN = 0,
+    DAT,
+    PVR,
+    JSON,
+  };
+  // Metadata and decoded contents of each file in the quest directories, keyed
+  // by path. These are used to skip decoding and parsing unchanged files when
+  // the index is rebuilt.
+  struct SourceFile {
+    uint64_t size = 0;
+    uint64_t mtime = 0; // Nanoseconds
+    uint64_t hash = 0;
+    std::string basename;
+    std::vector<std::pair<FileType, std::shared_ptr<const std::string>>> contents;
+    std::string warning;
+  };
+  struct SourceQuest {
+    std::shared_ptr<const VersionedQuest> vq;
+    std::shared_ptr<const std::string> json_contents;
+  };
+  bool is_ep3;
+  std::map<std::string, SourceFile> source_files;
+  std::map<std::string, SourceQuest> source_quests;
+
+  std::vector<std::pair<std::shared_ptr<const QuestCategoryIndex::Category>, std::string>> category_directories() const;
+
+  // Keyed by (quest_number << 16) | (version << 8) | override_language
+  mutable std::mutex download_quest_cache_lock;
+  mutable std::unordered_map<uint64_t, std::shared_ptr<const VersionedQuest>> download_quest_cache;
+  mutable size_t download_quest_cache_total_bytes = 0;
 };
 
 std::string encode_download_quest_data(
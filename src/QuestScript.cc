@@ -850,53 +850,56 @@ static const QuestScriptOpcodeDefinition opcode_defs[] = {
     {0xF961, "bb_get_6xE3_status", {REG}, F_V4}, // Returns 0 if 6xE3 hasn't been received, 1 if the received item is valid, 2 if the received item is invalid
 };
 
+// These indexes are built for all versions at once (rather than lazily for
+// each version) so that they can be used from multiple threads, for example
+// when loading quests in parallel.
 static const unordered_map<uint16_t, const QuestScriptOpcodeDefinition*>&
 opcodes_for_version(Version v) {
-  static array<
-      unordered_map<uint16_t, const QuestScriptOpcodeDefinition*>,
-      static_cast<size_t>(Version::BB_V4) + 1>
-      indexes;
-
-  auto& index = indexes.at(static_cast<size_t>(v));
-  if (index.empty()) {
-    uint16_t vf = v_flag(v);
-    for (size_t z = 0; z < sizeof(opcode_defs) / sizeof(opcode_defs[0]); z++) {
-      const auto& def = opcode_defs[z];
-      if (!(def.flags & vf)) {
-        continue;
-      }
-      if (!index.emplace(def.opcode, &def).second) {
-        throw logic_error(string_printf("duplicate definition for opcode %04hX", def.opcode));
+  static const auto indexes = []() {
+    array<unordered_map<uint16_t, const QuestScriptOpcodeDefinition*>, static_cast<size_t>(Version::BB_V4) + 1> ret;
+    // Skip the patch server versions; their flags have other meanings here
+    for (size_t v_index = static_cast<size_t>(Version::DC_NTE); v_index < ret.size(); v_index++) {
+      auto& index = ret[v_index];
+      uint16_t vf = v_flag(static_cast<Version>(v_index));
+      for (size_t z = 0; z < sizeof(opcode_defs) / sizeof(opcode_defs[0]); z++) {
+        const auto& def = opcode_defs[z];
+        if (!(def.flags & vf)) {
+          continue;
+        }
+        if (!index.emplace(def.opcode, &def).second) {
+          throw logic_error(string_printf("duplicate definition for opcode %04hX", def.opcode));
+        }
       }
     }
-  }
-  return index;
+    return ret;
+  }();
+  return indexes.at(static_cast<size_t>(v));
 }
 
 static const unordered_map<string, const QuestScriptOpcodeDefinition*>&
 opcodes_by_name_for_version(Version v) {
-  static array<
-      unordered_map<string, const QuestScriptOpcodeDefinition*>,
-      static_cast<size_t>(Version::BB_V4) + 1>
-      indexes;
-
-  auto& index = indexes.at(static_cast<size_t>(v));
-  if (index.empty()) {
-    uint16_t vf = v_flag(v);
-    for (size_t z = 0; z < sizeof(opcode_defs) / sizeof(opcode_defs[0]); z++) {
-      const auto& def = opcode_defs[z];
-      if (!(def.flags & vf)) {
-        continue;
-      }
-      if (!def.name) {
-        continue;
-      }
-      if (!index.emplace(def.name, &def).second) {
-        throw logic_error(string_printf("duplicate definition for opcode %04hX", def.opcode));
+  static const auto indexes = []() {
+    array<unordered_map<string, const QuestScriptOpcodeDefinition*>, static_cast<size_t>(Version::BB_V4) + 1> ret;
+    // Skip the patch server versions; their flags have other meanings here
+    for (size_t v_index = static_cast<size_t>(Version::DC_NTE); v_index < ret.size(); v_index++) {
+      auto& index = ret[v_index];
+      uint16_t vf = v_flag(static_cast<Version>(v_index));
+      for (size_t z = 0; z < sizeof(opcode_defs) / sizeof(opcode_defs[0]); z++) {
+        const auto& def = opcode_defs[z];
+        if (!(def.flags & vf)) {
+          continue;
+        }
+        if (!def.name) {
+          continue;
+        }
+        if (!index.emplace(def.name, &def).second) {
+          throw logic_error(string_printf("duplicate definition for opcode %04hX", def.opcode));
+        }
       }
     }
-  }
-  return index;
+    return ret;
+  }();
+  return indexes.at(static_cast<size_t>(v));
 }
 
 std::string disassemble_quest_script(const void* data, size_t size, Version version, uint8_t language, bool reassembly_mode) {
@@ -0,0 +1,102 @@
+#include "RareEnemySeedIndex.hh"
+
+#include <string.h>
+
+#include <phosg/Filesystem.hh>
+#include <phosg/Random.hh>
+#include <phosg/Strings.hh>
+
+using namespace std;
+
+RareEnemySeedIndex::Entry::Entry(uint32_t seed, const vector<RareEnemySeedEvaluator::RareEnemy>& rares)
+    : seed(seed),
+      num_rares(min<size_t>(rares.size(), 0xFF)) {
+  for (size_t z = 0; z < min<size_t>(rares.size(), MAX_RARES_PER_ENTRY); z++) {
+    this->rares[z].enemy_index = rares[z].enemy_index;
+    this->rares[z].type = static_cast<uint16_t>(rares[z].type);
+  }
+}
+
+static parray<le_uint32_t, 8> encode_rare_rates(const Map::RareEnemyRates& rare_rates) {
+  parray<le_uint32_t, 8> ret;
+  ret[0] = rare_rates.hildeblue;
+  ret[1] = rare_rates.rappy;
+  ret[2] = rare_rates.nar_lily;
+  ret[3] = rare_rates.pouilly_slime;
+  ret[4] = rare_rates.merissa_aa;
+  ret[5] = rare_rates.pazuzu;
+  ret[6] = rare_rates.dorphon_eclair;
+  ret[7] = rare_rates.kondrieu;
+  return ret;
+}
+
+RareEnemySeedIndex::RareEnemySeedIndex(const string& filename) {
+  // The whole index is loaded into memory, so it isn't affected by changes to
+  // the file while the server is running
+  string data = load_file(filename);
+  StringReader r(data);
+  if (r.remaining() < sizeof(Header)) {
+    throw runtime_error("rare enemy seed index is too small");
+  }
+  this->header = r.get<Header>();
+  if (this->header.magic != MAGIC) {
+    throw runtime_error("rare enemy seed index has incorrect signature");
+  }
+  if (this->header.format_version != FORMAT_VERSION) {
+    throw runtime_error("rare enemy seed index has unsupported format version (it may need to be regenerated)");
+  }
+  if (r.remaining() != this->header.num_entries * sizeof(Entry)) {
+    throw runtime_error("rare enemy seed index size does not match entry count");
+  }
+  if (this->header.num_entries == 0) {
+    throw runtime_error("rare enemy seed index is empty");
+  }
+  this->entries.resize(this->header.num_entries);
+  memcpy(this->entries.data(), r.getv(this->entries.size() * sizeof(Entry)), this->entries.size() * sizeof(Entry));
+}
+
+string RareEnemySeedIndex::serialize(
+    Version version,
+    Episode episode,
+    GameMode mode,
+    uint8_t difficulty,
+    uint8_t event,
+    const Map::RareEnemyRates& rare_rates,
+    const vector<Entry>& entries) {
+  Header header;
+  header.version = static_cast<uint8_t>(version);
+  header.episode = static_cast<uint8_t>(episode);
+  header.mode = static_cast<uint8_t>(mode);
+  header.difficulty = difficulty;
+  header.event = event;
+  header.num_entries = entries.size();
+  header.rare_rates = encode_rare_rates(rare_rates);
+
+  StringWriter w;
+  w.put(header);
+  w.write(entries.data(), entries.size() * sizeof(Entry));
+  return std::move(w.str());
+}
+
+bool RareEnemySeedIndex::rare_rates_match(const Map::RareEnemyRates& rare_rates) const {
+  auto encoded = encode_rare_rates(rare_rates);
+  for (size_t z = 0; z < encoded.size(); z++) {
+    if (this->header.rare_rates[z] != encoded[z]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+const RareEnemySeedIndex::Entry& RareEnemySeedIndex::random_entry() const {
+  // Taking a random 32-bit value modulo the entry count would favor the
+  // entries at the beginning of the index (unless the count is a power of 2),
+  // so values in the incomplete range at the top are rejected and redrawn
+  uint64_t num_entries = this->entries.size();
+  uint64_t limit = 0x100000000 - (0x100000000 % num_entries);
+  uint64_t value;
+  do {
+    value = random_object<uint32_t>();
+  } while (value >= limit);
+  return this->entries[value % num_entries];
+}
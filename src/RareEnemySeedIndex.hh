@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <phosg/Encoding.hh>
+#include <string>
+#include <vector>
+
+#include "Map.hh"
+#include "StaticGameData.hh"
+#include "Text.hh"
+#include "Version.hh"
+
+// A list of random seeds that produce rare enemies in free-roam games with one
+// set of game parameters. These files are generated by find-rare-enemy-seeds
+// (with the --index option), and are loaded by the server so a seed can be
+// chosen from them when a game is created (see RareEnemySeedIndexes in
+// config.example.json).
+class RareEnemySeedIndex {
+public:
+  static constexpr uint32_t MAGIC = 0x52534549; // 'RSEI'
+  static constexpr uint16_t FORMAT_VERSION = 2;
+  static constexpr size_t MAX_RARES_PER_ENTRY = 6;
+
+  struct Header {
+    be_uint32_t magic = MAGIC;
+    le_uint16_t format_version = FORMAT_VERSION;
+    uint8_t version = 0; // Version enum value
+    uint8_t episode = 0; // Episode enum value
+    uint8_t mode = 0; // GameMode enum value
+    uint8_t difficulty = 0;
+    uint8_t event = 0;
+    uint8_t unused = 0;
+    le_uint32_t num_entries = 0;
+    // The rare enemy rates the seeds were found with, in the same order as the
+    // fields in Map::RareEnemyRates
+    parray<le_uint32_t, 8> rare_rates;
+  } __attribute__((packed));
+
+  struct Entry {
+    struct Rare {
+      le_uint16_t enemy_index = 0;
+      le_uint16_t type = 0; // EnemyType enum value
+    } __attribute__((packed));
+    le_uint32_t seed = 0;
+    // This may be greater than MAX_RARES_PER_ENTRY; in that case, only the
+    // first MAX_RARES_PER_ENTRY rares are listed
+    uint8_t num_rares = 0;
+    parray<uint8_t, 3> unused;
+    parray<Rare, MAX_RARES_PER_ENTRY> rares;
+
+    Entry() = default;
+    Entry(uint32_t seed, const std::vector<RareEnemySeedEvaluator::RareEnemy>& rares);
+  } __attribute__((packed));
+
+  explicit RareEnemySeedIndex(const std::string& filename);
+  RareEnemySeedIndex(const RareEnemySeedIndex&) = delete;
+  RareEnemySeedIndex(RareEnemySeedIndex&&) = delete;
+  RareEnemySeedIndex& operator=(const RareEnemySeedIndex&) = delete;
+  RareEnemySeedIndex& operator=(RareEnemySeedIndex&&) = delete;
+  ~RareEnemySeedIndex() = default;
+
+  static std::string serialize(
+      Version version,
+      Episode episode,
+      GameMode mode,
+      uint8_t difficulty,
+      uint8_t event,
+      const Map::RareEnemyRates& rare_rates,
+      const std::vector<Entry>& entries);
+
+  inline Version version() const {
+    return static_cast<Version>(this->header.version);
+  }
+  inline Episode episode() const {
+    return static_cast<Episode>(this->header.episode);
+  }
+  inline GameMode mode() const {
+    return static_cast<GameMode>(this->header.mode);
+  }
+  inline uint8_t difficulty() const {
+    return this->header.difficulty;
+  }
+  inline uint8_t event() const {
+    return this->header.event;
+  }
+  inline size_t num_entries() const {
+    return this->entries.size();
+  }
+  inline const Entry& entry(size_t index) const {
+    return this->entries[index];
+  }
+
+  // Returns true if the seeds in this index were found with the given rare
+  // enemy rates
+  bool rare_rates_match(const Map::RareEnemyRates& rare_rates) const;
+
+  // Returns a uniformly-chosen entry
+  const Entry& random_entry() const;
+
+private:
+  Header header;
+  std::vector<Entry> entries;
+};
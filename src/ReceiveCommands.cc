@@ -14,6 +14,7 @@
 #include "ChatCommands.hh"
 #include "Compression.hh"
 #include "Episode3/Tournament.hh"
+#include "EventLoopStats.hh"
 #include "FileContentsCache.hh"
 #include "ItemCreator.hh"
 #include "Loggers.hh"
@@ -2535,7 +2536,7 @@ static void on_10(shared_ptr<Client> c, uint16_t, uint32_t, string& data) {
         if (is_ep3(vq->version)) {
           send_open_quest_file(c, q->name, vq->bin_filename(), "", vq->quest_number, QuestFileType::EPISODE_3, vq->bin_contents);
         } else {
-          vq = vq->create_download_quest(c->language());
+          vq = quest_index->download_quest(vq, c->language());
           string xb_filename = vq->xb_filename();
           QuestFileType type = vq->pvr_contents ? QuestFileType::DOWNLOAD_WITH_PVR : QuestFileType::DOWNLOAD_WITHOUT_PVR;
           send_open_quest_file(c, q->name, vq->bin_filename(), xb_filename, vq->quest_number, type, vq->bin_contents);
@@ -2908,21 +2909,18 @@ static void send_file_chunk(
     const string& filename,
     size_t chunk_index,
     bool is_download_quest) {
-  shared_ptr<const string> data;
+  shared_ptr<const string> chunks;
   try {
-    data = c->sending_files.at(filename);
+    chunks = c->sending_files.at(filename);
   } catch (const out_of_range&) {
     return;
   }
 
-  size_t chunk_offset = chunk_index * 0x400;
-  if (chunk_offset >= data->size()) {
+  if (chunk_index >= num_quest_file_chunks(*chunks)) {
     c->log.info("Done sending file %s", filename.c_str());
     c->sending_files.erase(filename);
   } else {
-    const void* chunk_data = data->data() + (chunk_index * 0x400);
-    size_t chunk_size = min<size_t>(data->size() - chunk_offset, 0x400);
-    send_quest_file_chunk(c, filename, chunk_index, chunk_data, chunk_size, is_download_quest);
+    send_quest_file_chunk(c, filename, chunk_index, *chunks, is_download_quest);
   }
 }
 
@@ -4110,8 +4108,20 @@ shared_ptr<Lobby> create_game_generic(
     game->challenge_params = make_shared<Lobby::ChallengeParameters>();
   }
   game->difficulty = difficulty;
+  game->event = Lobby::game_event_for_lobby_event(current_lobby->event);
   if (c->config.check_flag(Client::Flag::USE_OVERRIDE_RANDOM_SEED)) {
     game->random_seed = c->config.override_random_seed;
+  } else {
+    // The item creator and the maps are both seeded from random_seed, so this
+    // is the only place the seed needs to be chosen
+    auto seed_index = s->rare_enemy_seed_index(game->base_version, game->episode, game->mode, game->difficulty, game->event);
+    if (seed_index) {
+      try {
+        game->random_seed = seed_index->random_entry().seed;
+      } catch (const exception& e) {
+        game->log.warning("Cannot choose seed from rare enemy seed index: %s", e.what());
+      }
+    }
   }
   game->random_crypt = make_shared<PSOV2Encryption>(game->random_seed);
   if (battle_player) {
@@ -4182,7 +4192,6 @@ shared_ptr<Lobby> create_game_generic(
       throw logic_error("invalid quest script version");
   }
 
-  game->event = Lobby::game_event_for_lobby_event(current_lobby->event);
   game->block = 0xFF;
   game->max_clients = game->check_flag(Lobby::Flag::IS_SPECTATOR_TEAM) ? 12 : 4;
   game->min_level = min_level;
@@ -5044,37 +5053,6 @@ static void on_02_P(shared_ptr<Client> c, uint16_t, uint32_t, string& data) {
   send_command(c, 0x04, 0x00); // This requests the user's login information
 }
 
-static void change_to_directory_patch(
-    shared_ptr<Client> c,
-    vector<string>& client_path_directories,
-    const vector<string>& file_path_directories) {
-  // First, exit all leaf directories that don't match the desired path
-  while (!client_path_directories.empty() &&
-      ((client_path_directories.size() > file_path_directories.size()) ||
-          (client_path_directories.back() != file_path_directories[client_path_directories.size() - 1]))) {
-    send_command(c, 0x0A, 0x00);
-    client_path_directories.pop_back();
-  }
-
-  // At this point, client_path_directories should be a prefix of
-  // file_path_directories (or should match exactly)
-  if (client_path_directories.size() > file_path_directories.size()) {
-    throw logic_error("did not exit all necessary directories");
-  }
-  for (size_t x = 0; x < client_path_directories.size(); x++) {
-    if (client_path_directories[x] != file_path_directories[x]) {
-      throw logic_error("intermediate path is not a prefix of final path");
-    }
-  }
-
-  // Second, enter all necessary leaf directories
-  while (client_path_directories.size() < file_path_directories.size()) {
-    const string& dir = file_path_directories[client_path_directories.size()];
-    send_enter_directory_patch(c, dir);
-    client_path_directories.emplace_back(dir);
-  }
-}
-
 static void on_04_P(shared_ptr<Client> c, uint16_t, uint32_t, string& data) {
   const auto& cmd = check_size_t<C_Login_Patch_04>(data);
   auto s = c->require_server_state();
@@ -5183,6 +5161,11 @@ static void on_0F_P(shared_ptr<Client> c, uint16_t, uint32_t, string& data) {
 }
 
 static void on_10_P(shared_ptr<Client> c, uint16_t, uint32_t, string&) {
+  // Starting a second transfer while one is in progress would interleave the
+  // two sets of 06/07/08 commands
+  if (!c->patch_files_to_send.empty() || c->patch_file_data) {
+    throw runtime_error("client requested patch files while a transfer is in progress");
+  }
 
   S_StartFileDownloads_Patch_11 start_cmd = {0, 0};
   for (const auto& req : c->patch_file_checksum_requests) {
@@ -5201,17 +5184,15 @@ static void on_10_P(shared_ptr<Client> c, uint16_t, uint32_t, string&) {
 
   if (start_cmd.num_files) {
     send_command_t(c, 0x11, 0x00, start_cmd);
-    vector<string> path_directories;
     for (const auto& req : c->patch_file_checksum_requests) {
       if (req.needs_update()) {
-        change_to_directory_patch(c, path_directories, req.file->path_directories);
-        send_patch_file(c, req.file);
+        c->patch_files_to_send.emplace_back(req.file);
       }
     }
-    change_to_directory_patch(c, path_directories, {});
   }
 
-  send_command(c, 0x12, 0x00);
+  // This sends the 12 command after all files are sent
+  send_queued_patch_files(c);
 }
 
 static void on_ignored(shared_ptr<Client>, uint16_t, uint32_t, string&) {}
@@ -5576,15 +5557,35 @@ void on_command(
     check_unlicensed_command(c->version(), command);
   }
 
-  auto fn = handlers[command & 0xFF][static_cast<size_t>(c->version())];
-  if (fn) {
-    fn(c, command, flag, data);
-  } else {
-    on_unimplemented_command(c, command, flag, data);
+  // Handlers that throw (which usually disconnects the client) are timed too,
+  // since a slow failing handler blocks the loop just as much
+  uint64_t start_time = event_loop_stats ? now() : 0;
+  size_t data_size = data.size();
+  Version version = c->version();
+  auto record_time = [&]() -> void {
+    if (event_loop_stats) {
+      event_loop_stats->add_command(version, command, data_size, now() - start_time);
+    }
+  };
+  auto fn = handlers[command & 0xFF][static_cast<size_t>(version)];
+  try {
+    if (fn) {
+      fn(c, command, flag, data);
+    } else {
+      on_unimplemented_command(c, command, flag, data);
+    }
+  } catch (...) {
+    record_time();
+    throw;
   }
+  record_time();
 }
 
-void on_command_with_header(shared_ptr<Client> c, const string& data) {
+void on_command_with_header(shared_ptr<Client> c, string&& data) {
+  // The header is stripped from data in place (instead of copying the rest of
+  // the command into a new string) since the handler takes ownership of it
+  uint16_t command;
+  uint32_t flag;
   switch (c->version()) {
     case Version::DC_NTE:
     case Version::DC_V1_11_2000_PROTOTYPE:
@@ -5595,27 +5596,31 @@ void on_command_with_header(shared_ptr<Client> c, const string& data) {
     case Version::GC_EP3_NTE:
     case Version::GC_EP3:
     case Version::XB_V3: {
-      auto& header = check_size_t<PSOCommandHeaderDCV3>(data, 0xFFFF);
-      string sub_data = data.substr(sizeof(header));
-      on_command(c, header.command, header.flag, sub_data);
+      const auto& header = check_size_t<PSOCommandHeaderDCV3>(data, 0xFFFF);
+      command = header.command;
+      flag = header.flag;
+      data.erase(0, sizeof(header));
       break;
     }
     case Version::PC_PATCH:
     case Version::BB_PATCH:
     case Version::PC_NTE:
     case Version::PC_V2: {
-      auto& header = check_size_t<PSOCommandHeaderPC>(data, 0xFFFF);
-      string sub_data = data.substr(sizeof(header));
-      on_command(c, header.command, header.flag, sub_data);
+      const auto& header = check_size_t<PSOCommandHeaderPC>(data, 0xFFFF);
+      command = header.command;
+      flag = header.flag;
+      data.erase(0, sizeof(header));
       break;
     }
     case Version::BB_V4: {
-      auto& header = check_size_t<PSOCommandHeaderBB>(data, 0xFFFF);
-      string sub_data = data.substr(sizeof(header));
-      on_command(c, header.command, header.flag, sub_data);
+      const auto& header = check_size_t<PSOCommandHeaderBB>(data, 0xFFFF);
+      command = header.command;
+      flag = header.flag;
+      data.erase(0, sizeof(header));
       break;
     }
     default:
       throw logic_error("unimplemented game version in on_command_with_header");
   }
+  on_command(c, command, flag, data);
 }
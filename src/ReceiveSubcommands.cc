@@ -6,10 +6,12 @@
 #include <memory>
 #include <phosg/Random.hh>
 #include <phosg/Strings.hh>
+#include <phosg/Time.hh>
 #include <phosg/Vector.hh>
 
 #include "Client.hh"
 #include "Compression.hh"
+#include "EventLoopStats.hh"
 #include "Items.hh"
 #include "Lobby.hh"
 #include "Loggers.hh"
@@ -2195,6 +2197,7 @@ static void on_entity_drop_item_request(shared_ptr<Client> c, uint8_t command, u
   }
 
   if (should_drop) {
+    Metrics::add(metrics.item_drop_checks);
     auto generate_item = [&]() -> ItemCreator::DropResult {
       if (is_box) {
         if (ignore_def) {
@@ -3764,12 +3767,27 @@ void on_subcommand_multi(shared_ptr<Client> c, uint8_t command, uint8_t flag, st
     }
     void* cmd_data = data.data() + offset;
 
-    const auto* def = def_for_subcommand(c->version(), header->subcommand);
-    if (def && def->handler) {
-      def->handler(c, command, flag, cmd_data, cmd_size);
-    } else {
-      on_unimplemented(c, command, flag, cmd_data, cmd_size);
+    // The handler may modify the header, so we save the subcommand number
+    uint8_t subcommand = header->subcommand;
+    uint64_t start_time = event_loop_stats ? now() : 0;
+    Version version = c->version();
+    auto record_time = [&]() -> void {
+      if (event_loop_stats) {
+        event_loop_stats->add_subcommand(version, subcommand, cmd_size, now() - start_time);
+      }
+    };
+    const auto* def = def_for_subcommand(version, subcommand);
+    try {
+      if (def && def->handler) {
+        def->handler(c, command, flag, cmd_data, cmd_size);
+      } else {
+        on_unimplemented(c, command, flag, cmd_data, cmd_size);
+      }
+    } catch (...) {
+      record_time();
+      throw;
     }
+    record_time();
     offset += cmd_size;
   }
 }
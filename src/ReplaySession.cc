@@ -4,6 +4,7 @@
 #include <phosg/Strings.hh>
 #include <phosg/Time.hh>
 
+#include "CommandTrace.hh"
 #include "Loggers.hh"
 #include "Server.hh"
 #include "Shell.hh"
@@ -464,6 +465,34 @@ ReplaySession::ReplaySession(
       bytes_sent(0),
       commands_received(0),
       bytes_received(0) {
+  // Binary command traces start with a byte that can't begin a line in a text
+  // log, so we can tell the formats apart without rewinding the input (which
+  // may be stdin)
+  size_t num_events;
+  int first_ch = fgetc(input_log);
+  if (first_ch != EOF) {
+    ungetc(first_ch, input_log);
+  }
+  if (first_ch == static_cast<uint8_t>(CommandTrace::MAGIC[0])) {
+    num_events = this->parse_binary_log(input_log);
+  } else {
+    num_events = this->parse_text_log(input_log);
+  }
+
+  replay_log.info("%zu clients in log", this->clients.size());
+  for (const auto& it : this->clients) {
+    string client_str = it.second->str();
+    replay_log.info("  %" PRIu64 " => %s", it.first, client_str.c_str());
+  }
+
+  replay_log.info("%zu events in replay log", num_events);
+  for (auto ev = this->first_event; ev != nullptr; ev = ev->next_event) {
+    string ev_str = ev->str();
+    replay_log.info("  %s", ev_str.c_str());
+  }
+}
+
+size_t ReplaySession::parse_text_log(FILE* input_log) {
   shared_ptr<Event> parsing_command = nullptr;
 
   size_t line_num = 0;
@@ -582,17 +611,100 @@ ReplaySession::ReplaySession(
     }
   }
 
-  replay_log.info("%zu clients in log", this->clients.size());
-  for (const auto& it : this->clients) {
-    string client_str = it.second->str();
-    replay_log.info("  %" PRIu64 " => %s", it.first, client_str.c_str());
+  return num_events;
+}
+
+size_t ReplaySession::parse_binary_log(FILE* input_log) {
+  CommandTrace::FileHeader header;
+  freadx(input_log, &header, sizeof(header));
+  if (memcmp(header.magic, CommandTrace::MAGIC, sizeof(header.magic))) {
+    throw runtime_error("command trace has incorrect signature");
+  }
+  if (header.format_version != CommandTrace::FORMAT_VERSION) {
+    throw runtime_error("command trace format version is not supported");
   }
 
-  replay_log.info("%zu events in replay log", num_events);
-  for (auto ev = this->first_event; ev != nullptr; ev = ev->next_event) {
-    string ev_str = ev->str();
-    replay_log.info("  %s", ev_str.c_str());
+  size_t record_num = 0;
+  size_t num_events = 0;
+  for (;;) {
+    CommandTrace::Record rec;
+    size_t bytes_read = fread(&rec, 1, sizeof(rec), input_log);
+    if (bytes_read == 0) {
+      break;
+    }
+    record_num++;
+    if ((bytes_read != sizeof(rec)) || (rec.size < sizeof(rec) + rec.name_size)) {
+      throw runtime_error(string_printf("(ev-line %zu) command trace record is truncated or invalid", record_num));
+    }
+    string name(rec.name_size, '\0');
+    freadx(input_log, name.data(), name.size());
+    string data(rec.size - sizeof(rec) - rec.name_size, '\0');
+    freadx(input_log, data.data(), data.size());
+
+    if (rec.type == CommandTrace::RecordType::DROPPED) {
+      throw runtime_error(string_printf("(ev-line %zu) command trace has dropped records and cannot be replayed", record_num));
+    }
+    // Proxy sessions are traced too, but can't be replayed
+    if (!starts_with(name, "C-")) {
+      continue;
+    }
+    uint64_t client_id = stoull(name.substr(2), nullptr, 16);
+
+    switch (rec.type) {
+      case CommandTrace::RecordType::CONNECT: {
+        auto listen_tokens = split(data, '-');
+        if (listen_tokens.size() < 4) {
+          throw runtime_error(string_printf("(ev-line %zu) client connection record listening socket name format is incorrect", record_num));
+        }
+        auto c = make_shared<Client>(
+            this, client_id, stoul(listen_tokens[1], nullptr, 10), static_cast<Version>(rec.version));
+        if (!this->clients.emplace(c->id, c).second) {
+          throw runtime_error(string_printf("(ev-line %zu) duplicate client ID in input log", record_num));
+        }
+        this->create_event(Event::Type::CONNECT, c, record_num);
+        num_events++;
+        break;
+      }
+      case CommandTrace::RecordType::DISCONNECT:
+        try {
+          auto& c = this->clients.at(client_id);
+          if (c->disconnect_event.get()) {
+            throw runtime_error(string_printf("(ev-line %zu) client has multiple disconnect events", record_num));
+          }
+          c->disconnect_event = this->create_event(Event::Type::DISCONNECT, c, record_num);
+          num_events++;
+        } catch (const out_of_range&) {
+          throw runtime_error(string_printf("(ev-line %zu) unknown disconnecting client ID in input log", record_num));
+        }
+        break;
+      case CommandTrace::RecordType::FROM_CLIENT:
+      case CommandTrace::RecordType::TO_CLIENT: {
+        bool from_client = (rec.type == CommandTrace::RecordType::FROM_CLIENT);
+        shared_ptr<Event> ev;
+        try {
+          ev = this->create_event(
+              from_client ? Event::Type::SEND : Event::Type::RECEIVE,
+              this->clients.at(client_id),
+              record_num);
+          num_events++;
+        } catch (const out_of_range&) {
+          throw runtime_error(string_printf("(ev-line %zu) input log contains command for missing client", record_num));
+        }
+        ev->mask.assign(data.size(), '\xFF');
+        ev->data = std::move(data);
+        if (from_client) {
+          this->check_for_password(ev);
+        } else {
+          this->apply_default_mask(ev);
+        }
+        break;
+      }
+      default:
+        throw runtime_error(string_printf("(ev-line %zu) command trace record has unknown type", record_num));
+    }
   }
+
+  return num_events;
 }
 
 void ReplaySession::start() {
@@ -80,6 +80,9 @@ private:
   size_t commands_received;
   size_t bytes_received;
 
+  size_t parse_text_log(FILE* input_log);
+  size_t parse_binary_log(FILE* input_log);
+
   std::shared_ptr<ReplaySession::Event> create_event(
       Event::Type type, std::shared_ptr<Client> c, size_t line_num);
   void update_timeout_event();
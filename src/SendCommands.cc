@@ -1,6 +1,7 @@
 #include "SendCommands.hh"
 
 #include <event2/buffer.h>
+#include <event2/bufferevent.h>
 #include <inttypes.h>
 #include <string.h>
 
@@ -17,6 +18,7 @@
 #include "Compression.hh"
 #include "FileContentsCache.hh"
 #include "PSOProtocol.hh"
+#include "Server.hh"
 #include "StaticGameData.hh"
 #include "Text.hh"
 
@@ -682,23 +684,111 @@ void send_enter_directory_patch(shared_ptr<Client> c, const string& dir) {
   send_command_t(c, 0x09, 0x00, cmd);
 }
 
-void send_patch_file(shared_ptr<Client> c, shared_ptr<PatchFileIndex::File> f) {
-  S_OpenFile_Patch_06 open_cmd = {0, f->size, {f->name, 1}};
-  send_command_t(c, 0x06, 0x00, open_cmd);
+void change_to_directory_patch(
+    shared_ptr<Client> c,
+    vector<string>& client_path_directories,
+    const vector<string>& file_path_directories) {
+  // First, exit all leaf directories that don't match the desired path
+  while (!client_path_directories.empty() &&
+      ((client_path_directories.size() > file_path_directories.size()) ||
+          (client_path_directories.back() != file_path_directories[client_path_directories.size() - 1]))) {
+    send_command(c, 0x0A, 0x00);
+    client_path_directories.pop_back();
+  }
 
-  for (size_t x = 0; x < f->chunk_crcs.size(); x++) {
-    auto data = f->load_data();
-    size_t chunk_size = min<uint32_t>(f->size - (x * 0x4000), 0x4000);
+  // At this point, client_path_directories should be a prefix of
+  // file_path_directories (or should match exactly)
+  if (client_path_directories.size() > file_path_directories.size()) {
+    throw logic_error("did not exit all necessary directories");
+  }
+  for (size_t x = 0; x < client_path_directories.size(); x++) {
+    if (client_path_directories[x] != file_path_directories[x]) {
+      throw logic_error("intermediate path is not a prefix of final path");
+    }
+  }
 
-    vector<pair<const void*, size_t>> blocks;
-    S_WriteFileHeader_Patch_07 cmd_header = {x, f->chunk_crcs[x], chunk_size};
-    blocks.emplace_back(&cmd_header, sizeof(cmd_header));
-    blocks.emplace_back(data->data() + (x * 0x4000), chunk_size);
-    send_command(c, 0x07, 0x00, blocks);
+  // Second, enter all necessary leaf directories
+  while (client_path_directories.size() < file_path_directories.size()) {
+    const string& dir = file_path_directories[client_path_directories.size()];
+    send_enter_directory_patch(c, dir);
+    client_path_directories.emplace_back(dir);
   }
+}
+
+// Patch file chunks are queued until the output buffer contains this many
+// bytes; more are queued when it drains to PATCH_SEND_LOW_WATERMARK bytes.
+// This keeps memory usage per client bounded regardless of how large the
+// patch files are.
+static constexpr size_t PATCH_SEND_HIGH_WATERMARK = 0x10000;
+static constexpr size_t PATCH_SEND_LOW_WATERMARK = 0x4000;
+
+void send_queued_patch_files(shared_ptr<Client> c) {
+  if (!c->channel.connected()) {
+    c->patch_files_to_send.clear();
+    c->patch_file_data.reset();
+    return;
+  }
+
+  struct evbuffer* out_buf = bufferevent_get_output(c->channel.bev.get());
+  while (!c->patch_files_to_send.empty() &&
+      (evbuffer_get_length(out_buf) < PATCH_SEND_HIGH_WATERMARK)) {
+    auto f = c->patch_files_to_send.front();
 
-  S_CloseCurrentFile_Patch_08 close_cmd = {0};
-  send_command_t(c, 0x08, 0x00, close_cmd);
+    if (!c->patch_file_data) {
+      change_to_directory_patch(c, c->patch_client_path_directories, f->path_directories);
+      c->patch_file_data = f->open();
+      c->patch_file_next_chunk = 0;
+      if ((c->patch_file_data->size() != f->size) ||
+          (f->chunk_crcs.size() != (f->size + 0x3FFF) / 0x4000)) {
+        throw runtime_error(string_printf("patch file %s has changed since it was indexed", f->name.c_str()));
+      }
+      S_OpenFile_Patch_06 open_cmd = {0, f->size, {f->name, 1}};
+      send_command_t(c, 0x06, 0x00, open_cmd);
+    }
+
+    if (c->patch_file_next_chunk < f->chunk_crcs.size()) {
+      // The chunk is read from the file directly into the output buffer. If
+      // the file was truncated in place since it was opened, the read throws
+      // and the client is disconnected.
+      size_t x = c->patch_file_next_chunk++;
+      size_t chunk_size = min<size_t>(c->patch_file_data->size() - (x * 0x4000), 0x4000);
+      S_WriteFileHeader_Patch_07 cmd_header = {x, f->chunk_crcs[x], chunk_size};
+      c->channel.send_generated(0x07, 0x00, sizeof(cmd_header) + chunk_size, [&](void* dest) -> void {
+        memcpy(dest, &cmd_header, sizeof(cmd_header));
+        c->patch_file_data->read(reinterpret_cast<uint8_t*>(dest) + sizeof(cmd_header), chunk_size, x * 0x4000);
+      });
+
+    } else {
+      S_CloseCurrentFile_Patch_08 close_cmd = {0};
+      send_command_t(c, 0x08, 0x00, close_cmd);
+      c->patch_file_data.reset();
+      c->patch_files_to_send.pop_front();
+    }
+  }
+
+  if (c->patch_files_to_send.empty()) {
+    change_to_directory_patch(c, c->patch_client_path_directories, {});
+    send_command(c, 0x12, 0x00);
+    c->channel.set_output_drained_callback(0, nullptr);
+
+  } else {
+    weak_ptr<Client> wc = c;
+    c->channel.set_output_drained_callback(PATCH_SEND_LOW_WATERMARK, [wc]() -> void {
+      auto c = wc.lock();
+      if (!c) {
+        return;
+      }
+      try {
+        send_queued_patch_files(c);
+      } catch (const exception& e) {
+        c->log.error("Failed to send patch files: %s", e.what());
+        auto server = c->server.lock();
+        if (server) {
+          server->disconnect_client(c);
+        }
+      }
+    });
+  }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -3280,28 +3370,65 @@ void set_mask_for_ep3_game_command(void* vdata, size_t size, uint8_t mask_key) {
   header->mask_key = mask_key;
 }
 
+static shared_ptr<const string> quest_file_chunk_commands(const string& filename, shared_ptr<const string> contents) {
+  // The 13/A7 commands are the same for all client versions, so when multiple
+  // clients download the same file at the same time (e.g. when a quest is
+  // started in a full game), they all share the same command bodies. Entries
+  // are keyed by the address of the file contents, so we also check that the
+  // contents object is the same one (and not a new one at the same address)
+  // before using an entry.
+  struct CacheEntry {
+    weak_ptr<const string> contents;
+    weak_ptr<const string> chunks;
+  };
+  static map<pair<const string*, string>, CacheEntry> cache;
+
+  auto& entry = cache[make_pair(contents.get(), filename)];
+  auto ret = entry.chunks.lock();
+  if (ret && (entry.contents.lock() == contents)) {
+    return ret;
+  }
+
+  size_t num_chunks = (contents->size() + 0x3FF) / 0x400;
+  auto chunks = make_shared<string>(num_chunks * sizeof(S_WriteFile_13_A7), '\0');
+  for (size_t z = 0; z < num_chunks; z++) {
+    size_t offset = z * 0x400;
+    size_t size = min<size_t>(contents->size() - offset, 0x400);
+    auto& cmd = *reinterpret_cast<S_WriteFile_13_A7*>(chunks->data() + z * sizeof(S_WriteFile_13_A7));
+    cmd.filename.encode(filename);
+    memcpy(cmd.data.data(), contents->data() + offset, size);
+    cmd.data_size = size;
+  }
+  entry.contents = contents;
+  entry.chunks = chunks;
+
+  for (auto it = cache.begin(); it != cache.end();) {
+    if (it->second.chunks.expired()) {
+      it = cache.erase(it);
+    } else {
+      it++;
+    }
+  }
+  return chunks;
+}
+
+size_t num_quest_file_chunks(const string& chunks) {
+  return chunks.size() / sizeof(S_WriteFile_13_A7);
+}
+
 void send_quest_file_chunk(
     shared_ptr<Client> c,
     const string& filename,
     size_t chunk_index,
-    const void* data,
-    size_t size,
+    const string& chunks,
     bool is_download_quest) {
-  if (size > 0x400) {
-    throw logic_error("quest file chunks must be 1KB or smaller");
+  if (chunk_index >= num_quest_file_chunks(chunks)) {
+    throw logic_error("quest file chunk index out of range");
   }
-
-  S_WriteFile_13_A7 cmd;
-  cmd.filename.encode(filename);
-  memcpy(cmd.data.data(), data, size);
-  if (size < 0x400) {
-    memset(&cmd.data[size], 0, 0x400 - size);
-  }
-  cmd.data_size = size;
-
   c->log.info("Sending quest file chunk %s:%zu", filename.c_str(), chunk_index);
   const auto& s = c->require_server_state();
-  c->channel.send(is_download_quest ? 0xA7 : 0x13, chunk_index, &cmd, sizeof(cmd), s->hide_download_commands);
+  c->channel.send(is_download_quest ? 0xA7 : 0x13, chunk_index,
+      chunks.data() + chunk_index * sizeof(S_WriteFile_13_A7), sizeof(S_WriteFile_13_A7), s->hide_download_commands);
 }
 
 template <typename CommandT>
@@ -3396,20 +3523,18 @@ void send_open_quest_file(
     default:
       throw logic_error("cannot send quest files to this version of client");
   }
+  Metrics::add(metrics.quest_files_sent);
 
   // For GC/XB/BB, we wait for acknowledgement commands before sending each
   // chunk. For DC/PC, we send the entire quest all at once.
+  auto chunks = quest_file_chunk_commands(filename, contents);
   if (is_v1_or_v2(c->version()) && (c->version() != Version::GC_NTE)) {
-    for (size_t offset = 0; offset < contents->size(); offset += 0x400) {
-      size_t chunk_bytes = contents->size() - offset;
-      if (chunk_bytes > 0x400) {
-        chunk_bytes = 0x400;
-      }
-      send_quest_file_chunk(c, filename.c_str(), offset / 0x400,
-          contents->data() + offset, chunk_bytes, (type != QuestFileType::ONLINE));
+    size_t num_chunks = num_quest_file_chunks(*chunks);
+    for (size_t z = 0; z < num_chunks; z++) {
+      send_quest_file_chunk(c, filename, z, *chunks, (type != QuestFileType::ONLINE));
     }
   } else {
-    c->sending_files.emplace(filename, contents);
+    c->sending_files.emplace(filename, chunks);
     c->log.info("Opened file %s", filename.c_str());
   }
 }
@@ -179,7 +179,14 @@ void send_approve_player_choice_bb(std::shared_ptr<Client> c);
 void send_complete_player_bb(std::shared_ptr<Client> c);
 
 void send_enter_directory_patch(std::shared_ptr<Client> c, const std::string& dir);
-void send_patch_file(std::shared_ptr<Client> c, std::shared_ptr<PatchFileIndex::File> f);
+void change_to_directory_patch(
+    std::shared_ptr<Client> c,
+    std::vector<std::string>& client_path_directories,
+    const std::vector<std::string>& file_path_directories);
+// Sends the files in c->patch_files_to_send, followed by the 12 command. Only
+// a few chunks are buffered at a time; the rest are sent as the client reads
+// them.
+void send_queued_patch_files(std::shared_ptr<Client> c);
 
 void send_message_box(std::shared_ptr<Client> c, const std::string& text);
 void send_ep3_timed_message_box(Channel& ch, uint32_t frames, const std::string& text);
@@ -387,12 +394,14 @@ void send_open_quest_file(
     uint32_t quest_number,
     QuestFileType type,
     std::shared_ptr<const std::string> contents);
+// chunks is the concatenated 13/A7 command bodies for all chunks of a file,
+// as stored in Client::sending_files by send_open_quest_file.
+size_t num_quest_file_chunks(const std::string& chunks);
 void send_quest_file_chunk(
     std::shared_ptr<Client> c,
     const std::string& filename,
     size_t chunk_index,
-    const void* data,
-    size_t size,
+    const std::string& chunks,
     bool is_download_quest);
 bool send_quest_barrier_if_all_clients_ready(std::shared_ptr<Lobby> l);
 bool send_ep3_start_tournament_deck_select_if_all_clients_ready(std::shared_ptr<Lobby> l);
@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include <algorithm>
@@ -20,6 +21,7 @@
 #include <phosg/Strings.hh>
 #include <phosg/Time.hh>
 
+#include "CommandTrace.hh"
 #include "Loggers.hh"
 #include "PSOProtocol.hh"
 #include "ReceiveCommands.hh"
@@ -27,6 +29,52 @@
 using namespace std;
 using namespace std::placeholders;
 
+static uint16_t port_for_sockaddr(const struct sockaddr_storage& ss) {
+  if (ss.ss_family == AF_INET) {
+    return ntohs(reinterpret_cast<const sockaddr_in*>(&ss)->sin_port);
+  } else if (ss.ss_family == AF_INET6) {
+    return ntohs(reinterpret_cast<const sockaddr_in6*>(&ss)->sin6_port);
+  } else {
+    return 0;
+  }
+}
+
+// Like phosg's listen(), but sets SO_REUSEPORT so the same port can be opened
+// multiple times
+static int listen_reuseport(const string& addr, int port) {
+  auto [ss, ss_size] = make_sockaddr_storage(addr, port);
+  int fd = socket(ss.ss_family, SOCK_STREAM, 0);
+  if (fd < 0) {
+    throw runtime_error("cannot create socket: " + string_for_error(errno));
+  }
+  int one = 1;
+  if ((setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0) ||
+      (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0)) {
+    string error = string_for_error(errno);
+    close(fd);
+    throw runtime_error("cannot set socket options: " + error);
+  }
+  if (bind(fd, reinterpret_cast<const sockaddr*>(&ss), ss_size) != 0) {
+    string error = string_for_error(errno);
+    close(fd);
+    throw runtime_error("cannot bind socket: " + error);
+  }
+  if (::listen(fd, SOMAXCONN) != 0) {
+    string error = string_for_error(errno);
+    close(fd);
+    throw runtime_error("cannot listen on socket: " + error);
+  }
+  evutil_make_socket_nonblocking(fd);
+  evutil_make_socket_closeonexec(fd);
+  return fd;
+}
+
+TrafficCounters* Server::traffic_counters_for_port(uint16_t port) const {
+  auto pc_it = this->state->number_to_port_config.find(port);
+  return metrics.traffic_counters_for_port(
+      (pc_it == this->state->number_to_port_config.end()) ? "" : pc_it->second->name, port);
+}
+
 void Server::disconnect_client(shared_ptr<Client> c) {
   if (c->channel.is_virtual_connection) {
     server_log.info("Client disconnected: C-%" PRIX64 " on virtual connection %p", c->id, c->channel.bev.get());
@@ -36,6 +84,11 @@ void Server::disconnect_client(shared_ptr<Client> c) {
     server_log.info("Client C-%" PRIX64 " removed from game server", c->id);
   }
 
+  if (command_trace) {
+    command_trace->add_disconnect(c->channel.name, c->version());
+  }
+  Metrics::add(metrics.clients_disconnected);
+
   this->state->channel_to_client.erase(&c->channel);
   c->channel.disconnect();
 
@@ -107,17 +160,37 @@ void Server::on_listen_accept(
     close(fd);
     return;
   }
+  this->on_client_accepted(fd, listen_fd, listening_socket->addr_str, listening_socket->version, listening_socket->behavior);
+}
+
+void Server::dispatch_on_worker_listen_accept(
+    struct evconnlistener*, evutil_socket_t fd, struct sockaddr*, int, void* ctx) {
+  // This is called on a worker thread, so it must not touch any of the
+  // server's state; the WorkerListeningSocket itself is never modified after
+  // the listener is created, so it's safe to read here.
+  auto* ls = reinterpret_cast<WorkerListeningSocket*>(ctx);
+  ls->server->state->main_thread_calls->call([ls, fd]() -> void {
+    ls->server->on_client_accepted(fd, ls->fd, ls->addr_str, ls->version, ls->behavior);
+  });
+}
 
+void Server::on_client_accepted(
+    evutil_socket_t fd, int listen_fd, const string& addr_str, Version version, ServerBehavior behavior) {
   struct bufferevent* bev = bufferevent_socket_new(this->base.get(), fd,
       BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
-  auto c = make_shared<Client>(this->shared_from_this(), bev, listening_socket->version, listening_socket->behavior);
+  auto c = make_shared<Client>(this->shared_from_this(), bev, version, behavior);
   c->channel.on_command_received = Server::on_client_input;
   c->channel.on_error = Server::on_client_error;
   c->channel.context_obj = this;
   this->state->channel_to_client.emplace(&c->channel, c);
 
   server_log.info("Client connected: C-%" PRIX64 " on fd %d via %d (%s)",
-      c->id, fd, listen_fd, listening_socket->addr_str.c_str());
+      c->id, fd, listen_fd, addr_str.c_str());
+  if (command_trace) {
+    command_trace->add_connect(c->channel.name, c->version(), addr_str);
+  }
+  c->channel.traffic_counters = this->traffic_counters_for_port(port_for_sockaddr(c->channel.local_addr));
+  Metrics::add(metrics.clients_connected);
 
   try {
     on_connect(c);
@@ -142,6 +215,12 @@ void Server::connect_client(
       server_port,
       name_for_enum(version),
       name_for_enum(initial_state));
+  if (command_trace) {
+    command_trace->add_connect(c->channel.name, version, string_printf("T-%hu-%s-%s-VI",
+        server_port, name_for_enum(version), name_for_enum(initial_state)));
+  }
+  c->channel.traffic_counters = this->traffic_counters_for_port(server_port);
+  Metrics::add(metrics.clients_connected);
 
   this->state->channel_to_client.emplace(&c->channel, c);
 
@@ -236,12 +315,38 @@ void Server::listen(
     ServerBehavior behavior) {
   if (port == 0) {
     this->listen(addr_str, addr, version, behavior);
-  } else {
+  } else if (this->state->listener_shards <= 1) {
     int fd = ::listen(addr, port, SOMAXCONN);
     string netloc_str = render_netloc(addr, port);
     server_log.info("Listening on TCP interface %s on fd %d as %s",
         netloc_str.c_str(), fd, addr_str.c_str());
     this->add_socket(addr_str, fd, version, behavior);
+  } else {
+    // Open the port multiple times; the kernel distributes incoming
+    // connections between the sockets. If there are worker threads, each
+    // socket is accepted on a different worker thread; otherwise, they're all
+    // accepted on this thread but still have separate accept queues.
+    string netloc_str = render_netloc(addr, port);
+    const auto& pool = this->state->worker_pool;
+    for (size_t z = 0; z < this->state->listener_shards; z++) {
+      int fd = listen_reuseport(addr, port);
+      if (pool) {
+        size_t thread_index = z % pool->size();
+        server_log.info("Listening on TCP interface %s on fd %d as %s (shard %zu on worker %zu)",
+            netloc_str.c_str(), fd, addr_str.c_str(), z, thread_index);
+        auto& ls = this->worker_listening_sockets.emplace_back(make_unique<WorkerListeningSocket>(
+            this, pool->get_base(thread_index), addr_str, fd, version, behavior));
+        // The listener must be created on the thread that runs its base
+        pool->call_on_thread(thread_index, [ls = ls.get()]() -> void {
+          ls->listener.reset(evconnlistener_new(
+              ls->base.get(), Server::dispatch_on_worker_listen_accept, ls, LEV_OPT_REUSEABLE, 0, ls->fd));
+        });
+      } else {
+        server_log.info("Listening on TCP interface %s on fd %d as %s (shard %zu)",
+            netloc_str.c_str(), fd, addr_str.c_str(), z);
+        this->add_socket(addr_str, fd, version, behavior);
+      }
+    }
   }
 }
 
@@ -249,6 +354,17 @@ void Server::listen(const std::string& addr_str, int port, Version version, Serv
   this->listen(addr_str, "", port, version, behavior);
 }
 
+Server::WorkerListeningSocket::WorkerListeningSocket(
+    Server* s, shared_ptr<struct event_base> base, const std::string& addr_str,
+    int fd, Version version, ServerBehavior behavior)
+    : server(s),
+      base(base),
+      addr_str(addr_str),
+      fd(fd),
+      version(version),
+      behavior(behavior),
+      listener(nullptr, evconnlistener_free) {}
+
 Server::ListeningSocket::ListeningSocket(
     Server* s, const std::string& addr_str,
     int fd, Version version, ServerBehavior behavior)
@@ -57,6 +57,30 @@ private:
         ServerBehavior behavior);
   };
   std::unordered_map<int, ListeningSocket> listening_sockets;
+
+  // Listening sockets whose connections are accepted on worker threads (see
+  // ListenerShards in config.json). These listeners are created and run on
+  // the workers' event bases; accepted connections are passed to the main
+  // thread, since all Clients are owned by the main thread.
+  struct WorkerListeningSocket {
+    Server* server;
+    std::shared_ptr<struct event_base> base; // Keeps the base alive until the listener is freed
+    std::string addr_str;
+    int fd;
+    Version version;
+    ServerBehavior behavior;
+    std::unique_ptr<struct evconnlistener, void (*)(struct evconnlistener*)> listener;
+
+    WorkerListeningSocket(
+        Server* s,
+        std::shared_ptr<struct event_base> base,
+        const std::string& addr_str,
+        int fd,
+        Version version,
+        ServerBehavior behavior);
+  };
+  std::vector<std::unique_ptr<WorkerListeningSocket>> worker_listening_sockets;
+
   std::unordered_set<std::shared_ptr<Client>> clients_to_destroy;
 
   std::shared_ptr<ServerState> state;
@@ -68,10 +92,16 @@ private:
   static void dispatch_on_listen_accept(struct evconnlistener* listener,
       evutil_socket_t fd, struct sockaddr* address, int socklen, void* ctx);
   static void dispatch_on_listen_error(struct evconnlistener* listener, void* ctx);
+  static void dispatch_on_worker_listen_accept(struct evconnlistener* listener,
+      evutil_socket_t fd, struct sockaddr* address, int socklen, void* ctx);
 
   void on_listen_accept(struct evconnlistener* listener, evutil_socket_t fd,
       struct sockaddr* address, int socklen);
   void on_listen_error(struct evconnlistener* listener);
+  void on_client_accepted(evutil_socket_t fd, int listen_fd,
+      const std::string& addr_str, Version version, ServerBehavior behavior);
+
+  TrafficCounters* traffic_counters_for_port(uint16_t port) const;
 
   static void on_client_input(Channel& ch, uint16_t command, uint32_t flag, std::string& data);
   static void on_client_error(Channel& ch, short events);
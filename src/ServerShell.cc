@@ -4,9 +4,11 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <phosg/Filesystem.hh>
 #include <phosg/Random.hh>
 #include <phosg/Strings.hh>
 
+#include "EventLoopStats.hh"
 #include "ReceiveCommands.hh"
 #include "SendCommands.hh"
 #include "ServerState.hh"
@@ -210,6 +212,14 @@ Server commands:\n\
   describe-tournament TOURNAMENT-NAME\n\
     Show the current state of a tournament. Quotes are required around the\n\
     tournament name unless the name contains no spaces.\n\
+  loop-stats [json FILENAME | reset]\n\
+    Show how many times each command and subcommand handler has been called,\n\
+    how much data each handler received, and how long each handler took, as\n\
+    well as how late the event loop has been in running timers. The times for\n\
+    commands that contain subcommands (e.g. 60 and 62) include the times for\n\
+    the subcommands in them, which are also listed separately. With the json\n\
+    option, write the statistics to a JSON file instead. With the reset option,\n\
+    clear all statistics collected so far.\n\
 \n\
 Proxy session commands:\n\
   sc DATA\n\
@@ -589,6 +599,23 @@ Proxy session commands:\n\
       fprintf(stderr, "no such tournament exists\n");
     }
 
+  } else if (command_name == "loop-stats") {
+    if (!event_loop_stats) {
+      throw runtime_error("event loop statistics are disabled");
+    }
+    auto tokens = split(command_args, ' ');
+    if (command_args.empty()) {
+      string s = event_loop_stats->str();
+      fwritex(stderr, s.data(), s.size());
+    } else if ((tokens.size() == 2) && (tokens[0] == "json")) {
+      save_file(tokens[1], event_loop_stats->json().serialize(JSON::SerializeOption::FORMAT));
+      fprintf(stderr, "Statistics saved to %s\n", tokens[1].c_str());
+    } else if ((tokens.size() == 1) && (tokens[0] == "reset")) {
+      event_loop_stats->reset();
+    } else {
+      throw invalid_argument("incorrect arguments");
+    }
+
     // PROXY COMMANDS
 
   } else if ((command_name == "sc") || (command_name == "ss")) {
@@ -628,7 +655,7 @@ Proxy session commands:\n\
 
       if (c) {
         if (command_name[1] == 's') {
-          on_command_with_header(c, data);
+          on_command_with_header(c, std::move(data));
         } else {
           send_command_with_header(c->channel, data.data(), data.size());
         }
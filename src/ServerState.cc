@@ -42,7 +42,8 @@ ServerState::ServerState(shared_ptr<struct event_base> base, const string& confi
       config_filename(config_filename),
       is_replay(is_replay),
       player_files_manager(this->base ? make_shared<PlayerFilesManager>(base) : nullptr),
-      destroy_lobbies_event(this->base ? event_new(base.get(), -1, EV_TIMEOUT, &ServerState::dispatch_destroy_lobbies, this) : nullptr, event_free) {
+      destroy_lobbies_event(this->base ? event_new(base.get(), -1, EV_TIMEOUT, &ServerState::dispatch_destroy_lobbies, this) : nullptr, event_free),
+      quest_reload_check_event(this->base ? event_new(base.get(), -1, EV_TIMEOUT | EV_PERSIST, &ServerState::dispatch_check_quest_files, this) : nullptr, event_free) {
   this->create_load_step_graph();
 }
 
@@ -371,6 +372,96 @@ void ServerState::dispatch_destroy_lobbies(evutil_socket_t, short, void* ctx) {
   reinterpret_cast<ServerState*>(ctx)->lobbies_to_destroy.clear();
 }
 
+using QuestIndexPair = pair<shared_ptr<const QuestIndex>, shared_ptr<const QuestIndex>>;
+
+// Builds the default and Episode 3 download quest indexes. Files that haven't
+// changed since the previous indexes were built are reused rather than being
+// loaded and parsed again.
+static QuestIndexPair build_quest_indexes(
+    shared_ptr<const QuestCategoryIndex> category_index,
+    shared_ptr<const QuestIndex> prev_default_index,
+    shared_ptr<const QuestIndex> prev_ep3_download_index,
+    size_t num_threads) {
+  config_log.info("Collecting quests");
+  auto default_index = make_shared<QuestIndex>(
+      "system/quests", category_index, false, prev_default_index, num_threads);
+  config_log.info("Collecting Episode 3 download quests");
+  auto ep3_download_index = make_shared<QuestIndex>(
+      "system/ep3/maps-download", category_index, true, prev_ep3_download_index, num_threads);
+  return make_pair(std::move(default_index), std::move(ep3_download_index));
+}
+
+void ServerState::dispatch_check_quest_files(evutil_socket_t, short, void* ctx) {
+  reinterpret_cast<ServerState*>(ctx)->check_quest_files();
+}
+
+void ServerState::check_quest_files() {
+  if (!this->worker_pool) {
+    if ((this->default_quest_index && this->default_quest_index->files_changed()) ||
+        (this->ep3_download_quest_index && this->ep3_download_quest_index->files_changed())) {
+      config_log.info("Quest files have changed; reloading quest index");
+      try {
+        this->load_objects_and_downstream_dependents("quest_index");
+      } catch (const exception& e) {
+        config_log.error("Failed to reload quest index: %s", e.what());
+      }
+    }
+    return;
+  }
+
+  // If there's a worker pool, check for changes and build the new indexes on a
+  // worker thread, since this can take a long time when many quests changed.
+  // The QuestIndex objects are immutable, so the worker can safely read the
+  // current ones; the new ones are installed on the main thread.
+  if (this->quest_reload_in_progress) {
+    return;
+  }
+  this->quest_reload_in_progress = true;
+
+  auto prev_default_index = this->default_quest_index;
+  auto prev_ep3_download_index = this->ep3_download_quest_index;
+  auto category_index = this->quest_category_index;
+  weak_ptr<ServerState> s_weak = this->shared_from_this();
+  this->worker_pool->call_with_completion<QuestIndexPair>(
+      [prev_default_index, prev_ep3_download_index, category_index]() -> QuestIndexPair {
+        if ((!prev_default_index || !prev_default_index->files_changed()) &&
+            (!prev_ep3_download_index || !prev_ep3_download_index->files_changed())) {
+          return QuestIndexPair();
+        }
+        config_log.info("Quest files have changed; reloading quest index");
+        // Only this worker thread is used to build the indexes, so a large
+        // reload doesn't compete with the main thread or the other workers
+        return build_quest_indexes(category_index, prev_default_index, prev_ep3_download_index, 1);
+      },
+      this->main_thread_calls,
+      [s_weak, prev_default_index, prev_ep3_download_index](shared_ptr<QuestIndexPair> res, exception_ptr exc) -> void {
+        auto s = s_weak.lock();
+        if (!s) {
+          return;
+        }
+        s->quest_reload_in_progress = false;
+        if (exc) {
+          try {
+            rethrow_exception(exc);
+          } catch (const exception& e) {
+            config_log.error("Failed to reload quest index: %s", e.what());
+          }
+        } else if (res->first) {
+          if ((s->default_quest_index != prev_default_index) ||
+              (s->ep3_download_quest_index != prev_ep3_download_index)) {
+            // The index was reloaded some other way (e.g. by the reload shell
+            // command) while the worker was running; the next check will pick
+            // up any changes that reload missed
+            config_log.info("Quest index was replaced during background reload; discarding result");
+          } else {
+            s->default_quest_index = std::move(res->first);
+            s->ep3_download_quest_index = std::move(res->second);
+            config_log.info("Quest index reloaded");
+          }
+        }
+      });
+}
+
 shared_ptr<const ItemParameterTable> ServerState::item_parameter_table(Version version) const {
   auto ret = this->item_parameter_tables.at(static_cast<size_t>(version));
   if (ret == nullptr) {
@@ -504,6 +595,15 @@ shared_ptr<const string> ServerState::load_map_file(Version version, const strin
   return cache->get(filename, bind(&ServerState::load_map_file_uncached, this, version, placeholders::_1));
 }
 
+shared_ptr<const RareEnemySeedIndex> ServerState::rare_enemy_seed_index(
+    Version version, Episode episode, GameMode mode, uint8_t difficulty, uint8_t event) const {
+  try {
+    return this->rare_enemy_seed_indexes.at(make_tuple(version, episode, mode, difficulty, event));
+  } catch (const out_of_range&) {
+    return nullptr;
+  }
+}
+
 shared_ptr<const string> ServerState::load_map_file_uncached(Version version, const string& filename) const {
   if (version == Version::BB_V4) {
     try {
@@ -618,6 +718,45 @@ void ServerState::load_config() {
       this->dns_server_port = spec.second;
     } catch (const out_of_range&) {
     }
+    try {
+      auto spec = this->parse_port_spec(json.at("MetricsServerPort"));
+      this->metrics_server_addr = std::move(spec.first);
+      this->metrics_server_port = spec.second;
+    } catch (const out_of_range&) {
+    }
+    this->num_worker_threads = json.get_int("WorkerThreads", this->num_worker_threads);
+    this->listener_shards = json.get_int("ListenerShards", this->listener_shards);
+    // Replays should not depend on (or modify) files left by previous runs
+    if (!this->is_replay) {
+      set_compression_cache_directory(
+          json.get_string("CompressionCacheDirectory", "system/.cache"),
+          max<int64_t>(json.get_int("CompressionCacheMaxSize", 0x10000000), 0));
+    }
+    try {
+      const auto& trace_json = json.at("CommandTrace");
+      auto& opts = this->command_trace_options;
+      opts.filename = trace_json.at("Filename").as_string();
+      string format = trace_json.get_string("Format", "Binary");
+      if (format == "Binary") {
+        opts.format = CommandTrace::Format::BINARY;
+      } else if (format == "Text") {
+        opts.format = CommandTrace::Format::TEXT;
+      } else {
+        throw runtime_error("invalid value for CommandTrace.Format");
+      }
+      opts.buffer_size = trace_json.get_int("BufferSize", opts.buffer_size);
+      opts.max_file_size = trace_json.get_int("MaxFileSize", opts.max_file_size);
+      opts.max_files = trace_json.get_int("MaxFiles", opts.max_files);
+    } catch (const out_of_range&) {
+    }
+    try {
+      const auto& stats_json = json.at("EventLoopStats");
+      auto& opts = this->event_loop_stats_options;
+      this->event_loop_stats_enabled = stats_json.get_bool("Enabled", this->event_loop_stats_enabled);
+      opts.slow_handler_threshold_usecs = stats_json.get_int("SlowHandlerThresholdUsecs", opts.slow_handler_threshold_usecs);
+      opts.lag_probe_interval_usecs = stats_json.get_int("LagProbeIntervalUsecs", opts.lag_probe_interval_usecs);
+    } catch (const out_of_range&) {
+    }
     try {
       for (const auto& item : json.at("IPStackListen").as_list()) {
         if (item->is_int()) {
@@ -640,6 +779,16 @@ void ServerState::load_config() {
     }
   }
 
+  this->quest_reload_check_interval_usecs = json.get_int("QuestReloadCheckInterval", 0) * 1000000;
+  if (this->quest_reload_check_event && !this->is_replay) {
+    if (this->quest_reload_check_interval_usecs) {
+      auto tv = usecs_to_timeval(this->quest_reload_check_interval_usecs);
+      event_add(this->quest_reload_check_event.get(), &tv);
+    } else {
+      event_del(this->quest_reload_check_event.get());
+    }
+  }
+
   auto local_address_str = json.at("LocalAddress").as_string();
   try {
     this->local_address = this->all_addresses.at(local_address_str);
@@ -1049,6 +1198,40 @@ void ServerState::load_config() {
     this->rare_enemy_rates_challenge = Map::DEFAULT_RARE_ENEMIES;
   }
 
+  this->rare_enemy_seed_indexes.clear();
+  try {
+    for (const auto& filename_json : json.get_list("RareEnemySeedIndexes")) {
+      const string& filename = filename_json->as_string();
+      shared_ptr<const RareEnemySeedIndex> index;
+      try {
+        index = make_shared<RareEnemySeedIndex>(filename);
+      } catch (const exception& e) {
+        throw runtime_error(string_printf("cannot load rare enemy seed index %s: %s", filename.c_str(), e.what()));
+      }
+      // The seeds in an index are only rare with the rates they were found
+      // with; games use the configured rates on BB and the defaults otherwise
+      shared_ptr<const Map::RareEnemyRates> rare_rates;
+      if (index->version() != Version::BB_V4) {
+        rare_rates = Map::DEFAULT_RARE_ENEMIES;
+      } else if (index->mode() == GameMode::CHALLENGE) {
+        rare_rates = this->rare_enemy_rates_challenge;
+      } else {
+        rare_rates = this->rare_enemy_rates_by_difficulty.at(index->difficulty());
+      }
+      if (!index->rare_rates_match(*rare_rates)) {
+        throw runtime_error(string_printf("rare enemy seed index %s was made with different rare enemy rates than are configured; regenerate it", filename.c_str()));
+      }
+      auto key = make_tuple(index->version(), index->episode(), index->mode(), index->difficulty(), index->event());
+      if (!this->rare_enemy_seed_indexes.emplace(key, index).second) {
+        throw runtime_error(string_printf("multiple rare enemy seed indexes have the same parameters as %s", filename.c_str()));
+      }
+      config_log.info("Loaded rare enemy seed index %s (%s %s %s difficulty %hhu event %hhu; %zu seeds)",
+          filename.c_str(), name_for_enum(index->version()), name_for_episode(index->episode()),
+          name_for_mode(index->mode()), index->difficulty(), index->event(), index->num_entries());
+    }
+  } catch (const out_of_range&) {
+  }
+
   this->min_levels_v4[0] = DEFAULT_MIN_LEVELS_V4_EP1;
   this->min_levels_v4[1] = DEFAULT_MIN_LEVELS_V4_EP2;
   this->min_levels_v4[2] = DEFAULT_MIN_LEVELS_V4_EP4;
@@ -1391,10 +1574,10 @@ void ServerState::load_ep3_data() {
 }
 
 void ServerState::load_quest_index() {
-  config_log.info("Collecting quests");
-  this->default_quest_index = make_shared<QuestIndex>("system/quests", this->quest_category_index, false);
-  config_log.info("Collecting Episode 3 download quests");
-  this->ep3_download_quest_index = make_shared<QuestIndex>("system/ep3/maps-download", this->quest_category_index, true);
+  auto indexes = build_quest_indexes(
+      this->quest_category_index, this->default_quest_index, this->ep3_download_quest_index, 0);
+  this->default_quest_index = std::move(indexes.first);
+  this->ep3_download_quest_index = std::move(indexes.second);
 }
 
 void ServerState::compile_functions() {
@@ -8,13 +8,16 @@
 #include <phosg/JSON.hh>
 #include <set>
 #include <string>
+#include <tuple>
 #include <unordered_map>
 #include <vector>
 
 #include "Client.hh"
+#include "CommandTrace.hh"
 #include "CommonItemSet.hh"
 #include "Episode3/DataIndexes.hh"
 #include "Episode3/Tournament.hh"
+#include "EventLoopStats.hh"
 #include "FunctionCompiler.hh"
 #include "GSLArchive.hh"
 #include "ItemNameIndex.hh"
@@ -23,11 +26,14 @@
 #include "License.hh"
 #include "Lobby.hh"
 #include "Menu.hh"
+#include "Metrics.hh"
 #include "PlayerFilesManager.hh"
 #include "Quest.hh"
+#include "RareEnemySeedIndex.hh"
 #include "StepGraph.hh"
 #include "TeamIndex.hh"
 #include "WordSelectTable.hh"
+#include "WorkerPool.hh"
 
 // Forward declarations due to reference cycles
 class ProxyServer;
@@ -77,9 +83,17 @@ struct ServerState : public std::enable_shared_from_this<ServerState> {
   std::string username;
   std::string dns_server_addr;
   uint16_t dns_server_port = 0;
+  std::string metrics_server_addr;
+  uint16_t metrics_server_port = 0;
   std::vector<std::string> ip_stack_addresses;
   std::vector<std::string> ppp_stack_addresses;
   bool ip_stack_debug = false;
+  size_t num_worker_threads = 0;
+  size_t listener_shards = 1;
+  uint64_t quest_reload_check_interval_usecs = 0; // 0 = disabled
+  CommandTrace::Options command_trace_options; // Disabled if filename is blank
+  bool event_loop_stats_enabled = true;
+  EventLoopStats::Options event_loop_stats_options;
   bool allow_unregistered_users = false;
   bool allow_pc_nte = false;
   bool use_temp_licenses_for_prototypes = true;
@@ -150,6 +164,8 @@ struct ServerState : public std::enable_shared_from_this<ServerState> {
   std::shared_ptr<const WordSelectTable> word_select_table;
   std::array<std::shared_ptr<const Map::RareEnemyRates>, 4> rare_enemy_rates_by_difficulty;
   std::shared_ptr<const Map::RareEnemyRates> rare_enemy_rates_challenge;
+  // Keyed as (version, episode, mode, difficulty, event)
+  std::map<std::tuple<Version, Episode, GameMode, uint8_t, uint8_t>, std::shared_ptr<const RareEnemySeedIndex>> rare_enemy_seed_indexes;
   std::array<std::array<size_t, 4>, 3> min_levels_v4; // Indexed as [episode][difficulty]
 
   struct QuestF960Result {
@@ -216,6 +232,8 @@ struct ServerState : public std::enable_shared_from_this<ServerState> {
   std::map<int64_t, std::shared_ptr<Lobby>> id_to_lobby;
   std::unordered_set<std::shared_ptr<Lobby>> lobbies_to_destroy;
   std::shared_ptr<struct event> destroy_lobbies_event;
+  std::shared_ptr<struct event> quest_reload_check_event;
+  bool quest_reload_in_progress = false;
   std::vector<std::shared_ptr<Lobby>> public_lobby_search_order;
   std::atomic<int32_t> next_lobby_id = 1;
   uint8_t pre_lobby_event = 0;
@@ -231,6 +249,12 @@ struct ServerState : public std::enable_shared_from_this<ServerState> {
   std::shared_ptr<ProxyServer> proxy_server;
   std::shared_ptr<Server> game_server;
 
+  // Null if WorkerThreads is not set in the config. Work that runs on worker
+  // threads must not touch any of the mutable state above; results are passed
+  // back to the main thread via main_thread_calls.
+  std::shared_ptr<WorkerPool> worker_pool;
+  std::shared_ptr<CrossThreadCallQueue> main_thread_calls;
+
   explicit ServerState(const std::string& config_filename = "");
   ServerState(std::shared_ptr<struct event_base> base, const std::string& config_filename, bool is_replay);
   ServerState(const ServerState&) = delete;
@@ -293,6 +317,9 @@ struct ServerState : public std::enable_shared_from_this<ServerState> {
       const std::string& bb_directory_filename = "") const;
   std::shared_ptr<const std::string> load_map_file(Version version, const std::string& filename) const;
   std::shared_ptr<const std::string> load_map_file_uncached(Version version, const std::string& filename) const;
+  // Returns null if no index was configured for these parameters
+  std::shared_ptr<const RareEnemySeedIndex> rare_enemy_seed_index(
+      Version version, Episode episode, GameMode mode, uint8_t difficulty, uint8_t event) const;
 
   std::pair<std::string, uint16_t> parse_port_spec(const JSON& json) const;
   std::vector<PortConfiguration> parse_port_configuration(const JSON& json) const;
@@ -322,4 +349,6 @@ struct ServerState : public std::enable_shared_from_this<ServerState> {
 
   void enqueue_destroy_lobbies();
   static void dispatch_destroy_lobbies(evutil_socket_t, short, void* ctx);
+  static void dispatch_check_quest_files(evutil_socket_t, short, void* ctx);
+  void check_quest_files();
 };
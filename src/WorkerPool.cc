@@ -0,0 +1,121 @@
+#include "WorkerPool.hh"
+
+#include <event2/util.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <phosg/Strings.hh>
+
+#include "Loggers.hh"
+
+using namespace std;
+
+CrossThreadCallQueue::CrossThreadCallQueue(shared_ptr<struct event_base> base)
+    : base(base),
+      wake_event(nullptr, event_free),
+      wake_pending(false) {
+  if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, this->wake_fds) != 0) {
+    throw runtime_error("cannot create wake socket pair");
+  }
+  evutil_make_socket_nonblocking(this->wake_fds[0]);
+  evutil_make_socket_nonblocking(this->wake_fds[1]);
+  evutil_make_socket_closeonexec(this->wake_fds[0]);
+  evutil_make_socket_closeonexec(this->wake_fds[1]);
+  this->wake_event.reset(event_new(
+      this->base.get(), this->wake_fds[0], EV_READ | EV_PERSIST, &CrossThreadCallQueue::dispatch_on_wake, this));
+  event_add(this->wake_event.get(), nullptr);
+}
+
+CrossThreadCallQueue::~CrossThreadCallQueue() {
+  this->wake_event.reset();
+  evutil_closesocket(this->wake_fds[0]);
+  evutil_closesocket(this->wake_fds[1]);
+}
+
+void CrossThreadCallQueue::call(function<void()>&& fn) {
+  bool should_wake;
+  {
+    lock_guard<mutex> g(this->lock);
+    this->pending_calls.emplace_back(std::move(fn));
+    should_wake = !this->wake_pending;
+    this->wake_pending = true;
+  }
+  // Only one wake byte needs to be in flight at a time; on_wake processes all
+  // calls that were queued before it ran.
+  if (should_wake) {
+    char ch = 0;
+    ::send(this->wake_fds[1], &ch, 1, 0);
+  }
+}
+
+void CrossThreadCallQueue::dispatch_on_wake(evutil_socket_t, short, void* ctx) {
+  reinterpret_cast<CrossThreadCallQueue*>(ctx)->on_wake();
+}
+
+void CrossThreadCallQueue::on_wake() {
+  char buf[0x40];
+  while (::recv(this->wake_fds[0], buf, sizeof(buf), 0) > 0) {
+  }
+
+  deque<function<void()>> calls;
+  {
+    lock_guard<mutex> g(this->lock);
+    calls.swap(this->pending_calls);
+    this->wake_pending = false;
+  }
+
+  for (auto& fn : calls) {
+    try {
+      fn();
+    } catch (const exception& e) {
+      server_log.warning("Cross-thread call failed: %s", e.what());
+    }
+  }
+}
+
+WorkerPool::WorkerPool(size_t num_threads) : next_thread_index(0) {
+  if (num_threads == 0) {
+    throw invalid_argument("worker pool must have at least one thread");
+  }
+
+  while (this->workers.size() < num_threads) {
+    auto& w = this->workers.emplace_back(make_unique<Worker>());
+    w->base.reset(event_base_new(), event_base_free);
+    w->calls = make_unique<CrossThreadCallQueue>(w->base);
+    w->thread = thread([base = w->base]() -> void {
+      event_base_loop(base.get(), EVLOOP_NO_EXIT_ON_EMPTY);
+    });
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  this->stop();
+}
+
+void WorkerPool::stop() {
+  for (auto& w : this->workers) {
+    if (w->thread.joinable()) {
+      w->calls->call([base = w->base]() -> void {
+        event_base_loopbreak(base.get());
+      });
+    }
+  }
+  for (auto& w : this->workers) {
+    if (w->thread.joinable()) {
+      w->thread.join();
+    }
+  }
+}
+
+shared_ptr<struct event_base> WorkerPool::get_base(size_t thread_index) const {
+  return this->workers.at(thread_index)->base;
+}
+
+void WorkerPool::call_on_thread(size_t thread_index, function<void()>&& fn) {
+  this->workers.at(thread_index)->calls->call(std::move(fn));
+}
+
+void WorkerPool::call(function<void()>&& fn) {
+  size_t thread_index = this->next_thread_index.fetch_add(1) % this->workers.size();
+  this->call_on_thread(thread_index, std::move(fn));
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <event2/event.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs functions on the thread that runs an event_base. call() may be used
+// from any thread; the functions are called in the order they were queued,
+// during the target base's next loop iteration. This is the only supported way
+// to pass work between threads - objects owned by one base (bufferevents,
+// timers, Clients, Lobbies, etc.) must never be touched directly by another
+// thread.
+class CrossThreadCallQueue {
+public:
+  explicit CrossThreadCallQueue(std::shared_ptr<struct event_base> base);
+  CrossThreadCallQueue(const CrossThreadCallQueue&) = delete;
+  CrossThreadCallQueue(CrossThreadCallQueue&&) = delete;
+  CrossThreadCallQueue& operator=(const CrossThreadCallQueue&) = delete;
+  CrossThreadCallQueue& operator=(CrossThreadCallQueue&&) = delete;
+  ~CrossThreadCallQueue();
+
+  void call(std::function<void()>&& fn);
+
+  inline std::shared_ptr<struct event_base> get_base() const {
+    return this->base;
+  }
+
+private:
+  std::shared_ptr<struct event_base> base;
+  evutil_socket_t wake_fds[2];
+  std::unique_ptr<struct event, void (*)(struct event*)> wake_event;
+
+  std::mutex lock;
+  std::deque<std::function<void()>> pending_calls;
+  bool wake_pending;
+
+  static void dispatch_on_wake(evutil_socket_t fd, short events, void* ctx);
+  void on_wake();
+};
+
+// A fixed set of threads, each of which runs its own event_base. Work is
+// assigned to a thread either explicitly (by index, for objects that must stay
+// on the same thread) or round-robin (for independent tasks, e.g. CPU-heavy
+// work whose result is posted back to the main thread's CrossThreadCallQueue).
+class WorkerPool {
+public:
+  // num_threads must be at least 1. (A WorkerThreads value of 0 in the config
+  // means no pool is created at all.)
+  explicit WorkerPool(size_t num_threads);
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool(WorkerPool&&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+  WorkerPool& operator=(WorkerPool&&) = delete;
+  ~WorkerPool();
+
+  inline size_t size() const {
+    return this->workers.size();
+  }
+
+  std::shared_ptr<struct event_base> get_base(size_t thread_index) const;
+
+  void call_on_thread(size_t thread_index, std::function<void()>&& fn);
+  void call(std::function<void()>&& fn);
+
+  // Runs fn on a worker thread, then calls on_complete with its result on the
+  // thread that owns complete_queue. If fn throws, on_complete is called with
+  // a null result and the exception is passed as the second argument.
+  template <typename ResultT>
+  void call_with_completion(
+      std::function<ResultT()>&& fn,
+      std::shared_ptr<CrossThreadCallQueue> complete_queue,
+      std::function<void(std::shared_ptr<ResultT>, std::exception_ptr)>&& on_complete) {
+    this->call([fn = std::move(fn), complete_queue, on_complete = std::move(on_complete)]() mutable -> void {
+      std::shared_ptr<ResultT> result;
+      std::exception_ptr exc;
+      try {
+        result = std::make_shared<ResultT>(fn());
+      } catch (...) {
+        exc = std::current_exception();
+      }
+      complete_queue->call([result, exc, on_complete = std::move(on_complete)]() -> void {
+        on_complete(result, exc);
+      });
+    });
+  }
+
+  // Stops all threads. Pending calls that have not yet started are discarded.
+  // This is called by the destructor, but can be called earlier to make sure
+  // no worker thread is running while objects owned by the workers' bases are
+  // destroyed.
+  void stop();
+
+private:
+  struct Worker {
+    std::shared_ptr<struct event_base> base;
+    std::unique_ptr<CrossThreadCallQueue> calls;
+    std::thread thread;
+  };
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::atomic<size_t> next_thread_index;
+};
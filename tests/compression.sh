@@ -35,6 +35,46 @@ diff $BASENAME.mnrd $BASENAME.mnrd.$SCHEME.l0.dec
 echo "... check result from level=1"
 diff $BASENAME.mnrd $BASENAME.mnrd.$SCHEME.l1.dec
 
+if [ "$SCHEME" == "prs" ]; then
+  # The parallel compressor only splits inputs of at least two segments (0x40000
+  # bytes each), so build a larger input from several copies of the card
+  # definitions, interleaved with the (already-compressed) original file
+  echo "... build large input"
+  rm -f $BASENAME.large
+  for N in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16; do
+    cat $BASENAME.mnrd system/ep3/card-definitions.mnr >> $BASENAME.large
+  done
+
+  echo "... compress with threads=4 (small input)"
+  $EXECUTABLE compress-prs --threads=4 $BASENAME.mnrd $BASENAME.mnrd.$SCHEME.t4
+  echo "... compress with threads=4 (large input)"
+  $EXECUTABLE compress-prs --threads=4 $BASENAME.large $BASENAME.large.$SCHEME.t4
+  echo "... compress with threads=4 and level=1 (large input)"
+  $EXECUTABLE compress-prs --threads=4 --compression-level=1 $BASENAME.large $BASENAME.large.$SCHEME.t4l1
+
+  echo "... decompress from threads=4 (small input)"
+  $EXECUTABLE decompress-prs $BASENAME.mnrd.$SCHEME.t4 $BASENAME.mnrd.$SCHEME.t4.dec
+  echo "... decompress from threads=4 (large input)"
+  $EXECUTABLE decompress-prs $BASENAME.large.$SCHEME.t4 $BASENAME.large.$SCHEME.t4.dec
+  echo "... decompress from threads=4 and level=1 (large input)"
+  $EXECUTABLE decompress-prs $BASENAME.large.$SCHEME.t4l1 $BASENAME.large.$SCHEME.t4l1.dec
+
+  echo "... check result from threads=4 (small input)"
+  diff $BASENAME.mnrd $BASENAME.mnrd.$SCHEME.t4.dec
+  echo "... check result from threads=4 (large input)"
+  diff $BASENAME.large $BASENAME.large.$SCHEME.t4.dec
+  echo "... check result from threads=4 and level=1 (large input)"
+  diff $BASENAME.large $BASENAME.large.$SCHEME.t4l1.dec
+
+  rm $BASENAME.large \
+      $BASENAME.mnrd.$SCHEME.t4 \
+      $BASENAME.large.$SCHEME.t4 \
+      $BASENAME.large.$SCHEME.t4l1 \
+      $BASENAME.mnrd.$SCHEME.t4.dec \
+      $BASENAME.large.$SCHEME.t4.dec \
+      $BASENAME.large.$SCHEME.t4l1.dec
+fi
+
 echo "... clean up"
 rm $BASENAME.mnrd \
     $BASENAME.mnrd.$SCHEME.lN \
@@ -0,0 +1,31 @@
+#!/bin/sh
+
+set -e
+
+EXECUTABLE="$1"
+if [ "$EXECUTABLE" == "" ]; then
+  EXECUTABLE="./newserv"
+fi
+
+DIR="$(mktemp -d)"
+trap 'rm -rf "$DIR"' EXIT
+
+# The plaintext is longer than one round of both keystreams (56 words for V2
+# and 521 words for V3), and doesn't end on a word boundary
+head -c 2305 README.md > "$DIR/plain.bin"
+PLAINTEXT=$(od -An -tx1 -v "$DIR/plain.bin" | tr -d ' \n')
+
+check_seed() {
+  VERSION_OPTION="$1"
+  SEED="$2"
+  echo "... encrypt with $VERSION_OPTION seed $SEED"
+  $EXECUTABLE encrypt-data "$DIR/plain.bin" "$DIR/cipher.bin" $VERSION_OPTION --seed=$SEED
+  CIPHERTEXT=$(od -An -tx1 -v "$DIR/cipher.bin" | tr -d ' \n')
+  echo "... find $VERSION_OPTION seed"
+  $EXECUTABLE find-decryption-seed $VERSION_OPTION --encrypted=$CIPHERTEXT --decrypted=$PLAINTEXT > "$DIR/result.txt" 2>&1
+  cat "$DIR/result.txt"
+  grep -q "Found seed $SEED" "$DIR/result.txt"
+}
+
+check_seed --pc 00001234
+check_seed --gc 00002345
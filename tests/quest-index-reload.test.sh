@@ -0,0 +1,30 @@
+#!/bin/sh
+
+set -e
+
+EXECUTABLE="$1"
+if [ "$EXECUTABLE" == "" ]; then
+  EXECUTABLE="./newserv"
+fi
+
+DIR="$(mktemp -d)"
+trap 'rm -rf "$DIR"' EXIT
+
+echo "... copy system/quests/battle to $DIR"
+cp -R system/quests/battle "$DIR/battle"
+
+# Appending a newline to b88001.json changes only that file, so every other
+# file should be reused, and only the versions of quest b88001 (which all use
+# that file) should be parsed again
+NUM_FILES=$(ls "$DIR/battle" | wc -l)
+NUM_QUEST_VERSIONS=$(ls "$DIR/battle" | grep -c '\.bin$')
+NUM_MODIFIED_QUEST_VERSIONS=$(ls "$DIR/battle" | grep -c '^b88001-.*\.bin$')
+
+echo "... build index twice, modifying b88001.json in between"
+$EXECUTABLE index-quests "$DIR" --config=tests/config.json --modify=battle/b88001.json > "$DIR/result.txt"
+cat "$DIR/result.txt"
+
+echo "... check reused file and quest counts"
+printf "0 files reused\n0 quest versions reused\n%d files reused\n%d quest versions reused\n" \
+    $((NUM_FILES - 1)) $((NUM_QUEST_VERSIONS - NUM_MODIFIED_QUEST_VERSIONS)) > "$DIR/expected.txt"
+diff "$DIR/expected.txt" "$DIR/result.txt"
@@ -0,0 +1,23 @@
+#!/bin/sh
+
+set -e
+
+EXECUTABLE="$1"
+if [ "$EXECUTABLE" == "" ]; then
+  EXECUTABLE="./newserv"
+fi
+
+echo "... DC v2 Episode 1"
+$EXECUTABLE check-rare-enemy-maps --dc-v2 --ep1 --ultimate
+echo "... GC Episode 1"
+$EXECUTABLE check-rare-enemy-maps --gc --ep1 --ultimate
+echo "... GC Episode 2"
+$EXECUTABLE check-rare-enemy-maps --gc --ep2 --ultimate
+echo "... GC Episode 1 solo"
+$EXECUTABLE check-rare-enemy-maps --gc --ep1 --solo
+echo "... BB Episode 1"
+$EXECUTABLE check-rare-enemy-maps --bb --ep1 --hard
+echo "... BB Episode 2"
+$EXECUTABLE check-rare-enemy-maps --bb --ep2 --very-hard
+echo "... BB Episode 4"
+$EXECUTABLE check-rare-enemy-maps --bb --ep4 --ultimate